@@ -43,6 +43,7 @@ typedef struct {
 #define BAM_FSECONDARY   256
 #define BAM_FQCFAIL      512
 #define BAM_FDUP        1024
+#define BAM_FSUPPLEMENTARY 2048
 
 #define BAM_CIGAR_SHIFT 4
 #define BAM_CIGAR_MASK  ((1 << BAM_CIGAR_SHIFT) - 1)
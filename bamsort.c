@@ -0,0 +1,255 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <zlib.h>
+#include "bamsort.h"
+#include "bwa.h"
+#include "ksort.h"
+#include "kvec.h"
+
+#ifdef USE_MALLOC_WRAPPERS
+#  include "malloc_wrap.h"
+#endif
+
+/* Coordinate sorting of BAM records
+ *
+ * Records are buffered as they come. When the buffer is full, the record
+ * keys are split into one chunk per thread, the chunks are sorted in
+ * parallel and then merged into a run written to a temporary BGZF file at
+ * a low compression level. At the end, the runs and the chunks of the last
+ * buffer are merged into the output. Ties are broken by the source index
+ * and sources are numbered in the input order, so the sort is stable. When
+ * there are more than BSORT_FANIN runs, consecutive runs are first merged
+ * into longer runs in passes, which keeps both the order and the number of
+ * open files bounded.
+ */
+
+#define BSORT_LEVEL 1  // compression level of temporary files
+#define BSORT_FANIN 64 // maximum number of runs merged at a time
+
+typedef struct {
+	const pair64_t *k, *end; // a sorted chunk in memory
+	const uint8_t *buf;
+	gzFile fp;               // or a sorted run on disk
+	uint32_t l, m;           // current record read from fp
+	uint8_t *rec;
+	const uint8_t *p;        // the current record, including block_size
+} bsort_src_t;
+
+#define bsort_heap_lt(a, b) ((a).x > (b).x || ((a).x == (b).x && (a).y > (b).y)) // such that the root is the smallest
+KSORT_INIT(bsort_heap, pair64_t, bsort_heap_lt)
+
+static inline uint32_t bsort_u32(const uint8_t *p) { return p[0] | p[1]<<8 | p[2]<<16 | (uint32_t)p[3]<<24; }
+
+static inline pair64_t bsort_key(const uint8_t *p, uint64_t y) // $p points to block_size
+{
+	pair64_t k;
+	k.x = (uint64_t)bsort_u32(p + 4) << 32 | bsort_u32(p + 8); // an unmapped refID/pos of -1 is the largest
+	k.y = (uint64_t)(p[18]>>4&1) << 63 | y; // p[18] is the low byte of FLAG
+	return k;
+}
+
+bamsort_t *bamsort_init(const char *tmpdir, size_t max_mem, int n_threads)
+{
+	bamsort_t *s;
+	s = calloc(1, sizeof(bamsort_t));
+	s->dir = malloc(strlen(tmpdir) + 16);
+	sprintf(s->dir, "%s/bwa.XXXXXX", tmpdir);
+	if (mkdtemp(s->dir) == 0) // private to this process; no other user can plant files in it
+		err_fatal(__func__, "fail to create a temporary directory in '%s': %s", tmpdir, strerror(errno));
+	s->max_mem = max_mem > BAMSORT_MIN_MEM? max_mem : BAMSORT_MIN_MEM;
+	s->n_threads = n_threads > 1? n_threads : 1;
+	return s;
+}
+
+static void bsort_sort1(void *data, int i, int tid)
+{
+	bamsort_t *s = (bamsort_t*)data;
+	size_t st = s->key.n * i / s->n_threads, en = s->key.n * (i + 1) / s->n_threads;
+	ks_introsort_128(en - st, s->key.a + st);
+}
+
+static int bsort_next(bsort_src_t *r, int i, pair64_t *h)
+{ // load the next record of source $i; return 0 at the end
+	if (r->fp == 0) {
+		if (r->k == r->end) return 0;
+		r->p = r->buf + (r->k->y << 1 >> 1);
+		*h = *r->k++;
+	} else {
+		uint8_t b[4];
+		int l;
+		if ((l = gzread(r->fp, b, 4)) == 0) return 0;
+		if (l != 4) err_fatal(__func__, "truncated temporary file");
+		r->l = 4 + bsort_u32(b);
+		if (r->l > r->m) {
+			r->m = r->l; kv_roundup32(r->m);
+			r->rec = realloc(r->rec, r->m);
+		}
+		memcpy(r->rec, b, 4);
+		if (gzread(r->fp, r->rec + 4, r->l - 4) != (int)r->l - 4)
+			err_fatal(__func__, "truncated temporary file");
+		r->p = r->rec;
+		*h = bsort_key(r->p, 0);
+	}
+	h->y = h->y >> 63 << 63 | i;
+	return 1;
+}
+
+static void bsort_merge(int n, bsort_src_t *src, bgzfw_t *out)
+{
+	pair64_t *heap;
+	int i, n_heap = 0;
+	heap = malloc(n * sizeof(pair64_t));
+	for (i = 0; i < n; ++i)
+		if (bsort_next(&src[i], i, &heap[n_heap])) ++n_heap;
+	ks_heapmake(bsort_heap, n_heap, heap);
+	while (n_heap > 0) {
+		bsort_src_t *r;
+		i = (uint32_t)heap->y;
+		r = &src[i];
+		bgzfw_write(out, r->p, 4 + bsort_u32(r->p));
+		if (!bsort_next(r, i, heap)) heap[0] = heap[--n_heap];
+		ks_heapadjust(bsort_heap, 0, n_heap, heap);
+	}
+	free(heap);
+}
+
+static void bsort_chunks(bamsort_t *s, bsort_src_t *src)
+{ // sort the buffer in parallel and fill one source per chunk
+	extern void kt_for(int n_threads, void (*func)(void*,int,int), void *data, int n);
+	int i;
+	if (s->n_threads == 1) bsort_sort1(s, 0, 0);
+	else kt_for(s->n_threads, bsort_sort1, s, s->n_threads);
+	for (i = 0; i < s->n_threads; ++i) {
+		memset(&src[i], 0, sizeof(bsort_src_t));
+		src[i].k = s->key.a + s->key.n * i / s->n_threads;
+		src[i].end = s->key.a + s->key.n * (i + 1) / s->n_threads;
+		src[i].buf = s->buf;
+	}
+}
+
+static char *bsort_fn(const bamsort_t *s, int i)
+{
+	char *fn;
+	fn = malloc(strlen(s->dir) + 32);
+	sprintf(fn, "%s/%.4d.bam", s->dir, i);
+	return fn;
+}
+
+static bgzfw_t *bsort_create(bamsort_t *s, FILE **fp)
+{ // create the next temporary file and append it to the runs
+	char *fn;
+	int fd;
+	fn = bsort_fn(s, s->n_files);
+	if ((fd = open(fn, O_WRONLY|O_CREAT|O_EXCL, 0600)) < 0 || (*fp = fdopen(fd, "wb")) == 0)
+		err_fatal(__func__, "fail to create temporary file '%s': %s", fn, strerror(errno));
+	free(fn);
+	if (s->n_runs == s->m_runs) {
+		s->m_runs = s->m_runs? s->m_runs<<1 : 16;
+		s->run = realloc(s->run, s->m_runs * sizeof(int));
+	}
+	s->run[s->n_runs++] = s->n_files++;
+	return bgzfw_open(*fp, BSORT_LEVEL, s->n_threads);
+}
+
+static void bsort_open(const bamsort_t *s, int id, bsort_src_t *src)
+{ // open temporary file $id for merging
+	char *fn = bsort_fn(s, id);
+	memset(src, 0, sizeof(bsort_src_t));
+	if ((src->fp = gzopen(fn, "rb")) == 0)
+		err_fatal(__func__, "fail to open temporary file '%s'", fn);
+	free(fn);
+}
+
+static void bsort_close(const bamsort_t *s, int id, bsort_src_t *src)
+{ // close and remove temporary file $id
+	char *fn = bsort_fn(s, id);
+	gzclose(src->fp);
+	unlink(fn);
+	free(src->rec); free(fn);
+}
+
+static void bsort_spill(bamsort_t *s)
+{
+	bsort_src_t *src;
+	bgzfw_t *w;
+	FILE *fp;
+	if (s->key.n == 0) return;
+	w = bsort_create(s, &fp);
+	src = malloc(s->n_threads * sizeof(bsort_src_t));
+	bsort_chunks(s, src);
+	bsort_merge(s->n_threads, src, w);
+	bgzfw_close(w);
+	err_fclose(fp);
+	if (bwa_verbose >= 3)
+		fprintf(stderr, "[M::%s] wrote %ld records to temporary file %d\n", __func__, (long)s->key.n, s->n_files - 1);
+	free(src);
+	s->l = s->key.n = 0;
+}
+
+static void bsort_pass(bamsort_t *s)
+{ // merge every BSORT_FANIN consecutive runs into one
+	bsort_src_t *src;
+	int i, j, n_old = s->n_runs, *old, n = 0;
+	old = malloc(n_old * sizeof(int));
+	memcpy(old, s->run, n_old * sizeof(int));
+	src = malloc(BSORT_FANIN * sizeof(bsort_src_t));
+	for (i = 0; i < n_old; i += BSORT_FANIN) {
+		int m = n_old - i < BSORT_FANIN? n_old - i : BSORT_FANIN;
+		bgzfw_t *w;
+		FILE *fp;
+		if (m == 1) { // nothing to merge
+			s->run[n++] = old[i];
+			continue;
+		}
+		s->n_runs = n++; // the merged run takes the place of its inputs
+		w = bsort_create(s, &fp);
+		for (j = 0; j < m; ++j) bsort_open(s, old[i + j], &src[j]);
+		bsort_merge(m, src, w);
+		bgzfw_close(w);
+		err_fclose(fp);
+		for (j = 0; j < m; ++j) bsort_close(s, old[i + j], &src[j]);
+	}
+	s->n_runs = n;
+	free(src); free(old);
+}
+
+void bamsort_add(bamsort_t *s, const uint8_t *data, size_t len)
+{
+	const uint8_t *p;
+	if (s->l + len > s->m) {
+		s->m = s->l + len > s->m * 2? s->l + len : s->m * 2;
+		s->buf = realloc(s->buf, s->m);
+	}
+	memcpy(s->buf + s->l, data, len);
+	for (p = s->buf + s->l; p < s->buf + s->l + len; p += 4 + bsort_u32(p))
+		kv_push(pair64_t, s->key, bsort_key(p, p - s->buf));
+	s->l += len;
+	if (s->l + s->key.n * sizeof(pair64_t) >= s->max_mem) bsort_spill(s);
+}
+
+void bamsort_finish(bamsort_t *s, bgzfw_t *out)
+{
+	bsort_src_t *src;
+	int i, n_src;
+	while (s->n_runs > BSORT_FANIN) {
+		if (bwa_verbose >= 3)
+			fprintf(stderr, "[M::%s] merging %d temporary files in groups of %d\n", __func__, s->n_runs, BSORT_FANIN);
+		bsort_pass(s);
+	}
+	n_src = s->n_runs + s->n_threads;
+	src = calloc(n_src, sizeof(bsort_src_t));
+	for (i = 0; i < s->n_runs; ++i) // runs precede the records still in memory
+		bsort_open(s, s->run[i], &src[i]);
+	bsort_chunks(s, src + s->n_runs);
+	if (bwa_verbose >= 3 && s->n_runs > 0)
+		fprintf(stderr, "[M::%s] merging %d temporary files and %ld records in memory\n", __func__, s->n_runs, (long)s->key.n);
+	bsort_merge(n_src, src, out);
+	for (i = 0; i < s->n_runs; ++i)
+		bsort_close(s, s->run[i], &src[i]);
+	rmdir(s->dir);
+	free(src); free(s->buf); free(s->key.a); free(s->run); free(s->dir); free(s);
+}
@@ -0,0 +1,57 @@
+#ifndef BWA_BAMSORT_H
+#define BWA_BAMSORT_H
+
+#include <stdint.h>
+#include "bgzfw.h"
+#include "utils.h"
+
+#define BAMSORT_MIN_MEM (16<<20) // smallest buffer, or every few records make a run
+
+typedef struct {
+	int n_threads;
+	size_t max_mem;  // spill when the buffered records and keys take more than this
+	char *dir;       // private directory of temporary files
+	int n_files;     // number of temporary files created so far
+	int n_runs, m_runs, *run; // sorted runs on disk in the input order; run[i] is a file number
+	size_t l, m;     // buffered records
+	uint8_t *buf;
+	pair64_v key;    // .x: rid<<32|pos; .y: strand<<63|offset in buf
+} bamsort_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+	/**
+	 * Initialize a coordinate sorter of BAM records
+	 *
+	 * Temporary files go to a new directory made by mkdtemp() in $tmpdir.
+	 * Exits if the directory can't be created.
+	 *
+	 * @param tmpdir     where to create the temporary directory, e.g. "/tmp"
+	 * @param max_mem    approximate maximum memory used for buffering records; at least BAMSORT_MIN_MEM
+	 * @param n_threads  number of threads for sorting and compressing runs
+	 */
+	bamsort_t *bamsort_init(const char *tmpdir, size_t max_mem, int n_threads);
+
+	/**
+	 * Add one or more concatenated BAM records
+	 *
+	 * When the buffer is full, it is sorted and written to a temporary file.
+	 */
+	void bamsort_add(bamsort_t *s, const uint8_t *data, size_t len);
+
+	/**
+	 * Write all records in the coordinate order, remove temporary files and free $s
+	 *
+	 * Records with the same reference, position and strand are written in
+	 * the order they were added. Unmapped records without a mapped mate go
+	 * last.
+	 */
+	void bamsort_finish(bamsort_t *s, bgzfw_t *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
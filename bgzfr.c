@@ -0,0 +1,321 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <zlib.h>
+#include "bgzfr.h"
+#include "utils.h"
+
+#ifdef USE_MALLOC_WRAPPERS
+#  include "malloc_wrap.h"
+#endif
+
+/* Background decompression of input streams
+ *
+ * A producer thread fills a ring of BGZFR_N_SLOT chunks and a writer thread
+ * copies filled chunks, in order, to a pipe read by the caller with the usual
+ * gzdopen() and kseq. As a BGZF file is a series of independent blocks of at
+ * most 64kB, the producer reads BGZFR_N_BLOCK blocks per thread at a time and
+ * inflates them with kt_for(). Other gzip files are inflated as one stream.
+ *
+ * Both threads are detached. The writer quits when the caller closes the pipe
+ * early; the last thread to quit frees the shared state.
+ */
+
+#define BGZF_MAX_BLOCK 0x10000
+
+typedef struct {
+	uint8_t *s;
+	size_t l, m;
+} bgzfr_buf_t;
+
+typedef struct {
+	int fd_in, fd_out, n_threads;
+	int n_ref, done, err;
+	int64_t n_put, n_get; // number of chunks filled and written
+	pthread_mutex_t lock;
+	pthread_cond_t cv;
+	bgzfr_buf_t slot[BGZFR_N_SLOT];
+	int l_peek, i_peek;   // bytes read to detect the format
+	uint8_t peek[18];
+} bgzfr_t;
+
+static size_t bgzfr_read(bgzfr_t *r, void *buf, size_t len)
+{ // read up to $len bytes; fewer only at the end of the input
+	uint8_t *p = (uint8_t*)buf;
+	size_t n = 0;
+	if (r->i_peek < r->l_peek) {
+		n = r->l_peek - r->i_peek < len? r->l_peek - r->i_peek : len;
+		memcpy(p, r->peek + r->i_peek, n);
+		r->i_peek += n;
+	}
+	while (n < len) {
+		ssize_t l = read(r->fd_in, p + n, len - n);
+		if (l == 0) break;
+		if (l < 0) {
+			if (errno == EINTR) continue;
+			err_fatal(__func__, "fail to read the input: %s", strerror(errno));
+		}
+		n += l;
+	}
+	return n;
+}
+
+static void bgzfr_unref(bgzfr_t *r)
+{
+	int i, n_ref;
+	pthread_mutex_lock(&r->lock);
+	n_ref = --r->n_ref;
+	pthread_mutex_unlock(&r->lock);
+	if (n_ref > 0) return;
+	for (i = 0; i < BGZFR_N_SLOT; ++i) free(r->slot[i].s);
+	pthread_mutex_destroy(&r->lock);
+	pthread_cond_destroy(&r->cv);
+	free(r);
+}
+
+/**************
+ * The writer *
+ **************/
+
+static void *bgzfr_writer(void *data)
+{
+	bgzfr_t *r = (bgzfr_t*)data;
+	for (;;) {
+		bgzfr_buf_t *b = 0;
+		size_t n = 0;
+		pthread_mutex_lock(&r->lock);
+		while (r->n_get == r->n_put && !r->done) pthread_cond_wait(&r->cv, &r->lock);
+		if (r->n_get < r->n_put) b = &r->slot[r->n_get % BGZFR_N_SLOT];
+		pthread_mutex_unlock(&r->lock);
+		if (b == 0) break; // r->done is set and all chunks written
+		while (n < b->l) {
+			ssize_t l = write(r->fd_out, b->s + n, b->l - n);
+			if (l < 0 && errno == EINTR) continue;
+			if (l < 0) break; // EPIPE: the caller has closed the pipe
+			n += l;
+		}
+		pthread_mutex_lock(&r->lock);
+		if (n < b->l) r->err = 1;
+		else ++r->n_get;
+		pthread_cond_broadcast(&r->cv);
+		pthread_mutex_unlock(&r->lock);
+		if (r->err) break;
+	}
+	close(r->fd_out);
+	bgzfr_unref(r);
+	return 0;
+}
+
+/****************
+ * The producer *
+ ****************/
+
+static bgzfr_buf_t *bgzfr_get(bgzfr_t *r)
+{ // wait for an empty slot; return 0 if the writer has quit
+	bgzfr_buf_t *b = 0;
+	pthread_mutex_lock(&r->lock);
+	while (r->n_put - r->n_get == BGZFR_N_SLOT && !r->err) pthread_cond_wait(&r->cv, &r->lock);
+	if (!r->err) b = &r->slot[r->n_put % BGZFR_N_SLOT], b->l = 0;
+	pthread_mutex_unlock(&r->lock);
+	return b;
+}
+
+static void bgzfr_put(bgzfr_t *r, int done)
+{
+	pthread_mutex_lock(&r->lock);
+	if (done) r->done = 1;
+	else ++r->n_put;
+	pthread_cond_broadcast(&r->cv);
+	pthread_mutex_unlock(&r->lock);
+}
+
+static inline void bgzfr_reserve(bgzfr_buf_t *b, size_t m)
+{
+	if (m > b->m) {
+		b->m = m;
+		b->s = realloc(b->s, b->m);
+	}
+}
+
+typedef struct {
+	int n;
+	uint8_t *in, *out; // BGZF_MAX_BLOCK bytes per block
+	int *l_in, *l_out;
+} bgzfr_aux_t;
+
+static void bgzfr_inflate1(void *data, int i, int tid)
+{
+	bgzfr_aux_t *a = (bgzfr_aux_t*)data;
+	const uint8_t *in = a->in + (size_t)i * BGZF_MAX_BLOCK, *t = in + a->l_in[i] - 8;
+	uint8_t *out = a->out + (size_t)i * BGZF_MAX_BLOCK;
+	int xlen = in[10] | in[11]<<8;
+	uint32_t crc, isize;
+	z_stream zs;
+	crc = t[0] | t[1]<<8 | t[2]<<16 | (uint32_t)t[3]<<24;
+	isize = t[4] | t[5]<<8 | t[6]<<16 | (uint32_t)t[7]<<24;
+	if (isize > BGZF_MAX_BLOCK) err_fatal(__func__, "malformed BGZF block");
+	memset(&zs, 0, sizeof(z_stream));
+	if (inflateInit2(&zs, -15) != Z_OK) err_fatal(__func__, "failed to initialize zlib");
+	zs.next_in = (Bytef*)in + 12 + xlen, zs.avail_in = a->l_in[i] - 12 - xlen - 8;
+	zs.next_out = out, zs.avail_out = BGZF_MAX_BLOCK;
+	if (inflate(&zs, Z_FINISH) != Z_STREAM_END || zs.total_out != isize)
+		err_fatal(__func__, "malformed BGZF block");
+	inflateEnd(&zs);
+	if (crc32(crc32(0L, 0, 0), out, isize) != crc)
+		err_fatal(__func__, "CRC mismatch in a BGZF block");
+	a->l_out[i] = isize;
+}
+
+static int bgzfr_read_block(bgzfr_t *r, uint8_t *in)
+{ // read one BGZF block into $in; return its size, or 0 at the end of the input
+	int xlen, bsize = -1, j;
+	size_t l;
+	if ((l = bgzfr_read(r, in, 12)) == 0) return 0;
+	if (l < 12 || in[0] != 31 || in[1] != 139 || in[2] != 8 || (in[3]&4) == 0)
+		err_fatal(__func__, "the input is not in the BGZF format");
+	xlen = in[10] | in[11]<<8;
+	if (bgzfr_read(r, in + 12, xlen) != xlen)
+		err_fatal(__func__, "truncated BGZF block");
+	for (j = 12; j + 4 <= 12 + xlen; j += 4 + (in[j+2] | in[j+3]<<8)) // find the BC subfield
+		if (in[j] == 'B' && in[j+1] == 'C' && (in[j+2] | in[j+3]<<8) == 2)
+			bsize = (in[j+4] | in[j+5]<<8) + 1;
+	if (bsize < 12 + xlen + 8)
+		err_fatal(__func__, "the input is not in the BGZF format");
+	if (bgzfr_read(r, in + 12 + xlen, bsize - 12 - xlen) != bsize - 12 - xlen)
+		err_fatal(__func__, "truncated BGZF block");
+	return bsize;
+}
+
+static void bgzfr_bgzf(bgzfr_t *r)
+{
+	extern void kt_for(int n_threads, void (*func)(void*,int,int), void *data, int n);
+	bgzfr_aux_t a;
+	int i, max = r->n_threads * BGZFR_N_BLOCK, eof = 0;
+	a.in = malloc((size_t)max * BGZF_MAX_BLOCK);
+	a.l_in = malloc(max * sizeof(int));
+	a.l_out = malloc(max * sizeof(int));
+	while (!eof) {
+		bgzfr_buf_t *b;
+		for (a.n = 0; a.n < max; ++a.n) // raw blocks
+			if ((a.l_in[a.n] = bgzfr_read_block(r, a.in + (size_t)a.n * BGZF_MAX_BLOCK)) == 0)
+				break;
+		if (a.n < max) eof = 1;
+		if (a.n == 0 || (b = bgzfr_get(r)) == 0) break;
+		bgzfr_reserve(b, (size_t)a.n * BGZF_MAX_BLOCK);
+		a.out = b->s;
+		if (a.n == 1 || r->n_threads == 1)
+			for (i = 0; i < a.n; ++i) bgzfr_inflate1(&a, i, 0);
+		else kt_for(r->n_threads < a.n? r->n_threads : a.n, bgzfr_inflate1, &a, a.n);
+		for (i = 0; i < a.n; ++i) { // make the decompressed blocks contiguous
+			memmove(b->s + b->l, b->s + (size_t)i * BGZF_MAX_BLOCK, a.l_out[i]);
+			b->l += a.l_out[i];
+		}
+		bgzfr_put(r, 0);
+	}
+	free(a.in); free(a.l_in); free(a.l_out);
+}
+
+static void bgzfr_gzip(bgzfr_t *r)
+{
+	uint8_t *in;
+	z_stream zs;
+	int ret = Z_OK, eof = 0;
+	in = malloc(BGZF_MAX_BLOCK);
+	memset(&zs, 0, sizeof(z_stream));
+	if (inflateInit2(&zs, 15 + 16) != Z_OK) err_fatal(__func__, "failed to initialize zlib");
+	while (!eof) {
+		bgzfr_buf_t *b;
+		if ((b = bgzfr_get(r)) == 0) break;
+		bgzfr_reserve(b, BGZFR_CHUNK);
+		zs.next_out = b->s, zs.avail_out = BGZFR_CHUNK;
+		while (zs.avail_out > 0) {
+			if (zs.avail_in == 0) {
+				zs.avail_in = bgzfr_read(r, in, BGZF_MAX_BLOCK), zs.next_in = in;
+				if (zs.avail_in == 0) {
+					if (ret != Z_STREAM_END) err_fatal(__func__, "truncated gzip file");
+					eof = 1;
+					break;
+				}
+			}
+			if (ret == Z_STREAM_END) inflateReset(&zs); // concatenated gzip members
+			ret = inflate(&zs, Z_NO_FLUSH);
+			if (ret != Z_OK && ret != Z_STREAM_END)
+				err_fatal(__func__, "fail to decompress the input: %s", zs.msg? zs.msg : "unknown error");
+		}
+		b->l = BGZFR_CHUNK - zs.avail_out;
+		bgzfr_put(r, 0);
+	}
+	inflateEnd(&zs);
+	free(in);
+}
+
+static void bgzfr_plain(bgzfr_t *r)
+{
+	size_t l;
+	do {
+		bgzfr_buf_t *b;
+		if ((b = bgzfr_get(r)) == 0) break;
+		bgzfr_reserve(b, BGZFR_CHUNK);
+		b->l = l = bgzfr_read(r, b->s, BGZFR_CHUNK);
+		bgzfr_put(r, 0);
+	} while (l == BGZFR_CHUNK);
+}
+
+static void *bgzfr_producer(void *data)
+{
+	bgzfr_t *r = (bgzfr_t*)data;
+	const uint8_t *p = r->peek;
+	r->l_peek = bgzfr_read(r, r->peek, 18);
+	if (r->l_peek >= 18 && p[0] == 31 && p[1] == 139 && p[2] == 8 && (p[3]&4) && (p[10] | p[11]<<8) == 6 && p[12] == 'B' && p[13] == 'C')
+		bgzfr_bgzf(r);
+	else if (r->l_peek >= 2 && p[0] == 31 && p[1] == 139)
+		bgzfr_gzip(r);
+	else bgzfr_plain(r);
+	close(r->fd_in);
+	bgzfr_put(r, 1);
+	bgzfr_unref(r);
+	return 0;
+}
+
+int bgzfr_dopen(int fd, int n_threads)
+{
+	bgzfr_t *r;
+	int p[2];
+	pthread_t tid;
+	pthread_attr_t attr;
+	sigset_t set, old;
+	if (pipe(p) < 0) return -1;
+	r = calloc(1, sizeof(bgzfr_t));
+	r->fd_in = fd, r->fd_out = p[1];
+	r->n_threads = n_threads > 1? n_threads : 1;
+	r->n_ref = 2;
+	pthread_mutex_init(&r->lock, 0);
+	pthread_cond_init(&r->cv, 0);
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	sigemptyset(&set); sigaddset(&set, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &set, &old); // the threads inherit the mask; a closed pipe gives EPIPE instead
+	pthread_create(&tid, &attr, bgzfr_producer, r);
+	pthread_create(&tid, &attr, bgzfr_writer, r);
+	pthread_sigmask(SIG_SETMASK, &old, 0);
+	pthread_attr_destroy(&attr);
+	return p[0];
+}
+
+gzFile bgzfr_open(const char *fn, int n_threads)
+{
+	int fd;
+	gzFile fp;
+	if (strcmp(fn, "-") == 0) fd = fileno(stdin);
+	else if ((fd = open(fn, O_RDONLY)) < 0)
+		err_fatal(__func__, "fail to open file '%s' : %s", fn, strerror(errno));
+	if ((fd = bgzfr_dopen(fd, n_threads)) < 0)
+		err_fatal(__func__, "fail to create a pipe : %s", strerror(errno));
+	if ((fp = gzdopen(fd, "r")) == 0) err_fatal(__func__, "Out of memory");
+	return fp;
+}
@@ -0,0 +1,39 @@
+#ifndef BWA_BGZFR_H
+#define BWA_BGZFR_H
+
+#include <zlib.h>
+
+#define BGZFR_N_BLOCK 16       // number of BGZF blocks per thread decompressed in one round
+#define BGZFR_N_SLOT  4        // number of decompressed chunks queued for the reader
+#define BGZFR_CHUNK   0x100000 // size of a chunk from a gzip or an uncompressed stream
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+	/**
+	 * Decompress a stream in the background
+	 *
+	 * BGZF blocks are inflated by $n_threads threads, a plain gzip stream by
+	 * one dedicated thread, and uncompressed data are read ahead. The
+	 * decompressed data are written in order to a pipe.
+	 *
+	 * @param fd         input file descriptor; closed when the input is exhausted
+	 * @param n_threads  number of threads for BGZF
+	 *
+	 * @return  the read end of the pipe, to be passed to gzdopen(); -1 on failure
+	 */
+	int bgzfr_dopen(int fd, int n_threads);
+
+	/**
+	 * Open a file like xzopen(fn, "r") with decompression in the background
+	 *
+	 * "-" stands for the standard input. Exits on failure.
+	 */
+	gzFile bgzfr_open(const char *fn, int n_threads);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
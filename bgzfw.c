@@ -0,0 +1,107 @@
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+#include "bgzfw.h"
+#include "utils.h"
+
+#ifdef USE_MALLOC_WRAPPERS
+#  include "malloc_wrap.h"
+#endif
+
+/* Multi-threaded BGZF writer
+ *
+ * BGZF is a series of gzip members, each holding at most 64kB of data and
+ * recording its compressed size in the BC extra field. Blocks are thus
+ * independent and compressed by kt_for() in batches. A block is written
+ * only after all blocks before it, so the output is the same regardless of
+ * the number of threads.
+ */
+
+typedef struct {
+	const bgzfw_t *w;
+	uint8_t *out;  // BGZFW_MAX_BLOCK bytes per block
+	int *l_out;
+	size_t n;      // number of bytes to compress
+} bgzfw_aux_t;
+
+static void bgzfw_compress1(void *data, int i, int tid)
+{
+	static const uint8_t hdr[18] = { 31, 139, 8, 4, 0, 0, 0, 0, 0, 255, 6, 0, 'B', 'C', 2, 0, 0, 0 };
+	bgzfw_aux_t *a = (bgzfw_aux_t*)data;
+	const uint8_t *in = a->w->buf + (size_t)i * BGZFW_BLOCK_SIZE;
+	uint8_t *out = a->out + (size_t)i * BGZFW_MAX_BLOCK;
+	uInt l_in = a->n - (size_t)i * BGZFW_BLOCK_SIZE < BGZFW_BLOCK_SIZE? a->n - (size_t)i * BGZFW_BLOCK_SIZE : BGZFW_BLOCK_SIZE;
+	uint32_t crc, l;
+	z_stream zs;
+	memset(&zs, 0, sizeof(z_stream));
+	if (deflateInit2(&zs, a->w->level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		err_fatal(__func__, "failed to initialize zlib");
+	zs.next_in = (Bytef*)in, zs.avail_in = l_in;
+	zs.next_out = out + 18, zs.avail_out = BGZFW_MAX_BLOCK - 18 - 8;
+	if (deflate(&zs, Z_FINISH) != Z_STREAM_END) // not possible with BGZFW_BLOCK_SIZE input, even if incompressible
+		err_fatal(__func__, "compressed block too large");
+	deflateEnd(&zs);
+	memcpy(out, hdr, 18);
+	l = 18 + zs.total_out + 8;
+	out[16] = (l - 1) & 0xff, out[17] = (l - 1) >> 8; // BSIZE: total block size minus 1
+	crc = crc32(crc32(0L, 0, 0), in, l_in);
+	out += 18 + zs.total_out;
+	out[0] = crc, out[1] = crc>>8, out[2] = crc>>16, out[3] = crc>>24;
+	out[4] = l_in, out[5] = l_in>>8, out[6] = l_in>>16, out[7] = l_in>>24;
+	a->l_out[i] = l;
+}
+
+static void bgzfw_compress(bgzfw_t *w, size_t n)
+{ // compress and write the first $n bytes in the buffer
+	extern void kt_for(int n_threads, void (*func)(void*,int,int), void *data, int n);
+	bgzfw_aux_t a;
+	int i, n_blk = (n + BGZFW_BLOCK_SIZE - 1) / BGZFW_BLOCK_SIZE;
+	if (n == 0) return;
+	a.w = w, a.n = n;
+	a.out = malloc((size_t)n_blk * BGZFW_MAX_BLOCK);
+	a.l_out = malloc(n_blk * sizeof(int));
+	if (n_blk == 1) bgzfw_compress1(&a, 0, 0);
+	else kt_for(w->n_threads < n_blk? w->n_threads : n_blk, bgzfw_compress1, &a, n_blk);
+	for (i = 0; i < n_blk; ++i)
+		err_fwrite(a.out + (size_t)i * BGZFW_MAX_BLOCK, 1, a.l_out[i], w->fp);
+	free(a.out); free(a.l_out);
+	memmove(w->buf, w->buf + n, w->l - n);
+	w->l -= n;
+}
+
+bgzfw_t *bgzfw_open(FILE *fp, int level, int n_threads)
+{
+	bgzfw_t *w;
+	w = calloc(1, sizeof(bgzfw_t));
+	w->fp = fp, w->level = level < 0? Z_DEFAULT_COMPRESSION : level > 9? 9 : level;
+	w->n_threads = n_threads > 1? n_threads : 1;
+	w->m = (size_t)w->n_threads * BGZFW_N_BLOCK * BGZFW_BLOCK_SIZE;
+	w->buf = malloc(w->m);
+	return w;
+}
+
+void bgzfw_write(bgzfw_t *w, const void *data, size_t len)
+{
+	while (len > 0) {
+		size_t l = w->m - w->l < len? w->m - w->l : len;
+		memcpy(w->buf + w->l, data, l);
+		w->l += l, len -= l, data = (const uint8_t*)data + l;
+		if (w->l == w->m) bgzfw_compress(w, w->l); // a full round of blocks
+	}
+}
+
+void bgzfw_flush(bgzfw_t *w)
+{
+	bgzfw_compress(w, w->l);
+	err_fflush(w->fp);
+}
+
+void bgzfw_close(bgzfw_t *w)
+{
+	static const uint8_t eof[28] = { 31, 139, 8, 4, 0, 0, 0, 0, 0, 255, 6, 0, 'B', 'C', 2, 0, 27, 0, 3, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+	if (w == 0) return;
+	bgzfw_flush(w);
+	err_fwrite(eof, 1, 28, w->fp);
+	err_fflush(w->fp);
+	free(w->buf); free(w);
+}
@@ -0,0 +1,41 @@
+#ifndef BWA_BGZFW_H
+#define BWA_BGZFW_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define BGZFW_BLOCK_SIZE 0xff00  // maximum uncompressed size of a BGZF block; same as htslib
+#define BGZFW_MAX_BLOCK  0x10000 // maximum compressed size of a BGZF block
+#define BGZFW_N_BLOCK    16      // number of blocks per thread compressed in one round
+
+typedef struct {
+	FILE *fp;
+	int level, n_threads;
+	size_t l, m;  // pending uncompressed data
+	uint8_t *buf;
+} bgzfw_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+	/**
+	 * Open a BGZF writer on an open stream
+	 *
+	 * Data are collected until there are BGZFW_N_BLOCK blocks per thread,
+	 * which are then compressed in parallel and written in order.
+	 *
+	 * @param fp         output stream, e.g. stdout
+	 * @param level      zlib compression level; 0 for uncompressed BGZF, -1 for the default
+	 * @param n_threads  number of compression threads
+	 */
+	bgzfw_t *bgzfw_open(FILE *fp, int level, int n_threads);
+	void bgzfw_write(bgzfw_t *w, const void *data, size_t len);
+	void bgzfw_flush(bgzfw_t *w); // compress and write all pending data, ending the current block
+	void bgzfw_close(bgzfw_t *w); // flush, write the EOF marker and free $w; the stream is not closed
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -31,6 +31,7 @@
 #include <zlib.h>
 #include <unistd.h>
 #include <errno.h>
+#include <emmintrin.h>
 #include "bntseq.h"
 #include "utils.h"
 
@@ -352,6 +353,50 @@ int bns_cnt_ambi(const bntseq_t *bns, int64_t pos_f, int len, int *ref_id)
 	return nn;
 }
 
+static inline __m128i bns_rev16(__m128i x) // reverse 16 bytes
+{
+	x = _mm_shuffle_epi32(x, 0x4E);
+	x = _mm_shufflehi_epi16(_mm_shufflelo_epi16(x, 0x1B), 0x1B);
+	return _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8));
+}
+
+static void bns_rev(uint8_t *s, int64_t n, int comp) // reverse s[0..n-1] in place; complement if $comp is set
+{
+	int64_t i = 0, j = n - 16;
+	uint8_t c = comp? 3 : 0, t;
+	__m128i x = _mm_set1_epi8(c);
+	for (; i + 16 <= j; i += 16, j -= 16) {
+		__m128i a = _mm_loadu_si128((__m128i*)&s[i]), b = _mm_loadu_si128((__m128i*)&s[j]);
+		_mm_storeu_si128((__m128i*)&s[i], _mm_xor_si128(bns_rev16(b), x));
+		_mm_storeu_si128((__m128i*)&s[j], _mm_xor_si128(bns_rev16(a), x));
+	}
+	for (j += 15; i < j; ++i, --j)
+		t = s[i], s[i] = s[j] ^ c, s[j] = t ^ c;
+	if (i == j) s[i] ^= c;
+}
+
+void bns_unpack(const uint8_t *pac, int64_t beg, int64_t end, int rev, uint8_t *seq)
+{
+	int64_t k = beg, l = 0;
+	__m128i m3 = _mm_set1_epi8(3);
+	for (; k < end && (k&3); ++k) seq[l++] = _get_pac(pac, k);
+	for (; k + 64 <= end; k += 64, l += 64) { // 16 bytes to 64 bases at a time
+		__m128i v = _mm_loadu_si128((__m128i*)&pac[k>>2]), a, b, c, d;
+		a = _mm_and_si128(_mm_srli_epi16(v, 6), m3);
+		b = _mm_and_si128(_mm_srli_epi16(v, 4), m3);
+		c = _mm_and_si128(_mm_srli_epi16(v, 2), m3);
+		d = _mm_and_si128(v, m3);
+		v = _mm_unpacklo_epi8(a, b), a = _mm_unpackhi_epi8(a, b);
+		b = _mm_unpacklo_epi8(c, d), c = _mm_unpackhi_epi8(c, d);
+		_mm_storeu_si128((__m128i*)&seq[l],    _mm_unpacklo_epi16(v, b));
+		_mm_storeu_si128((__m128i*)&seq[l+16], _mm_unpackhi_epi16(v, b));
+		_mm_storeu_si128((__m128i*)&seq[l+32], _mm_unpacklo_epi16(a, c));
+		_mm_storeu_si128((__m128i*)&seq[l+48], _mm_unpackhi_epi16(a, c));
+	}
+	for (; k < end; ++k) seq[l++] = _get_pac(pac, k);
+	if (rev&1) bns_rev(seq, l, rev&2);
+}
+
 uint8_t *bns_get_seq(int64_t l_pac, const uint8_t *pac, int64_t beg, int64_t end, int64_t *len)
 {
 	uint8_t *seq = 0;
@@ -359,18 +404,54 @@ uint8_t *bns_get_seq(int64_t l_pac, const uint8_t *pac, int64_t beg, int64_t end
 	if (end > l_pac<<1) end = l_pac<<1;
 	if (beg < 0) beg = 0;
 	if (beg >= l_pac || end <= l_pac) {
-		int64_t k, l = 0;
 		*len = end - beg;
 		seq = malloc(end - beg);
-		if (beg >= l_pac) { // reverse strand
-			int64_t beg_f = (l_pac<<1) - 1 - end;
-			int64_t end_f = (l_pac<<1) - 1 - beg;
-			for (k = end_f; k > beg_f; --k)
-				seq[l++] = 3 - _get_pac(pac, k);
-		} else { // forward strand
-			for (k = beg; k < end; ++k)
-				seq[l++] = _get_pac(pac, k);
-		}
+		if (beg >= l_pac) bns_unpack(pac, (l_pac<<1) - end, (l_pac<<1) - beg, 3, seq); // reverse strand
+		else bns_unpack(pac, beg, end, 0, seq); // forward strand
 	} else *len = 0; // if bridging the forward-reverse boundary, return nothing
 	return seq;
 }
+
+uint8_t *bns_get_seq2(bns_seqcache_t *c, int64_t l_pac, const uint8_t *pac, int64_t beg, int64_t end, int64_t *len)
+{
+	uint8_t *seq = 0;
+	int64_t k, beg_f, end_f;
+	bns_seqwin_t *w = 0;
+	int i;
+	if (c == 0) return bns_get_seq(l_pac, pac, beg, end, len);
+	if (end < beg) end ^= beg, beg ^= end, end ^= beg; // if end is smaller, swap
+	if (end > l_pac<<1) end = l_pac<<1;
+	if (beg < 0) beg = 0;
+	if (beg < l_pac && end > l_pac) { // if bridging the forward-reverse boundary, return nothing
+		*len = 0;
+		return 0;
+	}
+	beg_f = beg < l_pac? beg : (l_pac<<1) - end; // [beg_f,end_f) on the forward strand
+	end_f = beg < l_pac? end : (l_pac<<1) - beg;
+	for (i = 0; i < BNS_CACHE_N; ++i) { // look for a window containing [beg_f,end_f); otherwise pick the least recently used one
+		bns_seqwin_t *p = &c->win[i];
+		if (p->seq && p->beg <= beg_f && end_f <= p->end) break;
+		if (w == 0 || p->last < w->last) w = p;
+	}
+	if (i < BNS_CACHE_N) w = &c->win[i];
+	else { // decode a new window
+		w->beg = beg_f > BNS_CACHE_PAD? beg_f - BNS_CACHE_PAD : 0;
+		w->end = end_f + BNS_CACHE_PAD < l_pac? end_f + BNS_CACHE_PAD : l_pac;
+		free(w->seq);
+		w->seq = bns_get_seq(l_pac, pac, w->beg, w->end, &k);
+	}
+	w->last = ++c->clock;
+	*len = end - beg;
+	seq = malloc(end - beg);
+	memcpy(seq, w->seq + (beg_f - w->beg), end - beg);
+	if (beg >= l_pac) bns_rev(seq, end - beg, 1); // reverse strand
+	return seq;
+}
+
+void bns_seqcache_clear(bns_seqcache_t *c)
+{
+	int i;
+	for (i = 0; i < BNS_CACHE_N; ++i) free(c->win[i].seq);
+	memset(c, 0, sizeof(bns_seqcache_t));
+}
+
@@ -61,6 +61,20 @@ typedef struct {
 	FILE *fp_pac;
 } bntseq_t;
 
+#define BNS_CACHE_N   8   // number of windows in bns_seqcache_t
+#define BNS_CACHE_PAD 256 // decode this many more bases on each side of a missed window
+
+typedef struct {
+	int64_t beg, end; // [beg,end) on the forward strand
+	uint64_t last;    // time of last use
+	uint8_t *seq;     // decoded bases; $end-$beg elements
+} bns_seqwin_t;
+
+typedef struct { // recently decoded reference windows; zero-filled on creation
+	uint64_t clock;
+	bns_seqwin_t win[BNS_CACHE_N];
+} bns_seqcache_t;
+
 extern unsigned char nst_nt4_table[256];
 
 #ifdef __cplusplus
@@ -76,6 +90,26 @@ extern "C" {
 	int bns_cnt_ambi(const bntseq_t *bns, int64_t pos_f, int len, int *ref_id);
 	uint8_t *bns_get_seq(int64_t l_pac, const uint8_t *pac, int64_t beg, int64_t end, int64_t *len);
 
+	/**
+	 * Decode [beg,end) on the forward strand of $pac to $seq, 16 bytes at a time
+	 *
+	 * If $rev&1, write the bases in the reverse order; if $rev&2, also
+	 * complement them. bns_unpack(pac, (l_pac<<1)-end, (l_pac<<1)-beg, 3, seq)
+	 * retrieves [beg,end) on the reverse strand. $seq must have $end-$beg bytes.
+	 */
+	void bns_unpack(const uint8_t *pac, int64_t beg, int64_t end, int rev, uint8_t *seq);
+
+	/**
+	 * Retrieve the reference sequence through a cache of decoded windows
+	 *
+	 * Identical to bns_get_seq() except that the bases are copied from a
+	 * cached window when [beg,end), on either strand, falls in a window
+	 * decoded before. A cache should be used with one $pac and one thread
+	 * only; $c==NULL disables caching.
+	 */
+	uint8_t *bns_get_seq2(bns_seqcache_t *c, int64_t l_pac, const uint8_t *pac, int64_t beg, int64_t end, int64_t *len);
+	void bns_seqcache_clear(bns_seqcache_t *c); // free all windows
+
 #ifdef __cplusplus
 }
 #endif
@@ -1,7 +1,13 @@
+#ifdef __linux__
+#define _GNU_SOURCE // for sched_getaffinity() and pthread_setaffinity_np()
+#include <sched.h>
+#endif
 #include <string.h>
 #include <stdio.h>
 #include <zlib.h>
 #include <assert.h>
+#include <pthread.h>
+#include <emmintrin.h>
 #include "bntseq.h"
 #include "bwa.h"
 #include "ksw.h"
@@ -28,13 +34,43 @@ static inline void trim_readno(kstring_t *s)
 		s->l -= 2, s->s[s->l] = 0;
 }
 
-static inline void kseq2bseq1(const kseq_t *ks, bseq1_t *s)
-{ // TODO: it would be better to allocate one chunk of memory, but probably it does not matter in practice
-	s->name = strdup(ks->name.s);
-	s->comment = ks->comment.l? strdup(ks->comment.s) : 0;
-	s->seq = strdup(ks->seq.s);
-	s->qual = ks->qual.l? strdup(ks->qual.s) : 0;
-	s->l_seq = strlen(s->seq);
+static inline char *bseq_put(kstring_t *a, const char *s, int l)
+{ // append $s of length $l to the arena, including the NULL; return the offset
+	size_t off = a->l;
+	kputsn(s, l, a);
+	++a->l;
+	return (char*)off;
+}
+
+static inline void kseq2bseq1(const kseq_t *ks, bseq1_t *s, kstring_t *a)
+{ // pointers are offsets in the arena until bseq_finish() relocates them; offset 0 stands for NULL
+	s->name = bseq_put(a, ks->name.s, ks->name.l);
+	s->comment = ks->comment.l? bseq_put(a, ks->comment.s, ks->comment.l) : 0;
+	s->seq = bseq_put(a, ks->seq.s, ks->seq.l);
+	s->qual = ks->qual.l? bseq_put(a, ks->qual.s, ks->qual.l) : 0;
+	s->l_seq = ks->seq.l;
+}
+
+static bseq1_t *bseq_finish(int n, bseq1_t *seqs, kstring_t *a)
+{ // move the records and all their strings to one block, freed with free(ret); $seqs and $a are freed
+	bseq1_t *ret = 0;
+	char *base;
+	int i;
+	if (n > 0) {
+		ret = malloc(n * sizeof(bseq1_t) + a->l);
+		base = (char*)(ret + n);
+		memcpy(base, a->s, a->l);
+		for (i = 0; i < n; ++i) {
+			bseq1_t *s = &ret[i];
+			*s = seqs[i];
+			s->name = base + (size_t)s->name;
+			s->seq  = base + (size_t)s->seq;
+			if (s->comment) s->comment = base + (size_t)s->comment;
+			if (s->qual) s->qual = base + (size_t)s->qual;
+		}
+	}
+	free(seqs); free(a->s);
+	return ret;
 }
 
 bseq1_t *bseq_read(int chunk_size, int *n_, void *ks1_, void *ks2_)
@@ -42,7 +78,9 @@ bseq1_t *bseq_read(int chunk_size, int *n_, void *ks1_, void *ks2_)
 	kseq_t *ks = (kseq_t*)ks1_, *ks2 = (kseq_t*)ks2_;
 	int size = 0, m, n;
 	bseq1_t *seqs;
+	kstring_t a = {0,0,0};
 	m = n = 0; seqs = 0;
+	kputc(0, &a); // such that no field is at offset 0
 	while (kseq_read(ks) >= 0) {
 		if (ks2 && kseq_read(ks2) < 0) { // the 2nd file has fewer reads
 			fprintf(stderr, "[W::%s] the 2nd file has fewer sequences.\n", __func__);
@@ -53,11 +91,11 @@ bseq1_t *bseq_read(int chunk_size, int *n_, void *ks1_, void *ks2_)
 			seqs = realloc(seqs, m * sizeof(bseq1_t));
 		}
 		trim_readno(&ks->name);
-		kseq2bseq1(ks, &seqs[n]);
+		kseq2bseq1(ks, &seqs[n], &a);
 		size += seqs[n++].l_seq;
 		if (ks2) {
 			trim_readno(&ks2->name);
-			kseq2bseq1(ks2, &seqs[n]);
+			kseq2bseq1(ks2, &seqs[n], &a);
 			size += seqs[n++].l_seq;
 		}
 		if (size >= chunk_size && (n&1) == 0) break;
@@ -67,7 +105,182 @@ bseq1_t *bseq_read(int chunk_size, int *n_, void *ks1_, void *ks2_)
 			fprintf(stderr, "[W::%s] the 1st file has fewer sequences.\n", __func__);
 	}
 	*n_ = n;
-	return seqs;
+	return bseq_finish(n, seqs, &a);
+}
+
+/********************
+ * Batch BAM reader *
+ ********************/
+
+#include "bamlite.h"
+
+struct bseq_bam_s {
+	gzFile fp;
+	bam1_t *b, *pend; // the current record and the one waiting for its mate
+	int has_pend, copy_tags;
+	int64_t n_skip;
+};
+
+static int bseq_bam_next(bseq_bam_t *f, bam1_t *b)
+{ // read the next primary record; return 0 at the end of the file
+	int ret;
+	while ((ret = bam_read1(f->fp, b)) >= 0)
+		if (!(b->core.flag & (BAM_FSECONDARY|BAM_FSUPPLEMENTARY))) return 1;
+	if (ret < -1) err_fatal(__func__, "truncated or malformed BAM record");
+	return 0;
+}
+
+bseq_bam_t *bseq_bam_init(void *fp, int copy_tags)
+{
+	bseq_bam_t *f;
+	bam_header_t *h;
+	if ((h = bam_header_read((gzFile)fp)) == 0) return 0;
+	bam_header_destroy(h);
+	f = calloc(1, sizeof(bseq_bam_t));
+	f->fp = (gzFile)fp, f->copy_tags = copy_tags;
+	f->b = bam_init1(), f->pend = bam_init1();
+	f->has_pend = bseq_bam_next(f, f->pend); // peek at the first record for bseq_bam_is_paired()
+	return f;
+}
+
+void bseq_bam_destroy(bseq_bam_t *f)
+{
+	if (f == 0) return;
+	if (f->n_skip > 0 && bwa_verbose >= 2)
+		fprintf(stderr, "[W::%s] skipped %ld records without a mate\n", __func__, (long)f->n_skip);
+	bam_destroy1(f->b); bam_destroy1(f->pend);
+	free(f);
+}
+
+int bseq_bam_is_paired(const bseq_bam_t *f)
+{
+	return f->has_pend && (f->pend->core.flag & BAM_FPAIRED);
+}
+
+static inline int bam_aux_drop(const uint8_t *tag)
+{ // tags that bwa mem writes itself, and RG if it is set by -R
+	static const char *own[] = { "NM", "MD", "AS", "XS", "SA", "XA", 0 };
+	int i;
+	for (i = 0; own[i]; ++i)
+		if (tag[0] == own[i][0] && tag[1] == own[i][1]) return 1;
+	return bwa_rg_id[0] && tag[0] == 'R' && tag[1] == 'G';
+}
+
+static void bam_aux2str(const bam1_t *b, kstring_t *s)
+{ // format the tags in SAM, separated by TAB
+	const uint8_t *p = bam1_aux(b), *end = b->data + b->data_len;
+	while (end - p >= 4) {
+		int type = p[2], drop = bam_aux_drop(p);
+		size_t l0 = s->l; // the tag is parsed anyway to skip it
+		if (s->l) kputc('\t', s);
+		kputsn((char*)p, 2, s); kputc(':', s);
+		p += 3;
+		if (type == 'A') {
+			kputsn("A:", 2, s); kputc(*p++, s);
+		} else if (type == 'c') { kputsn("i:", 2, s); kputw(*(int8_t*)p, s); ++p; }
+		else if (type == 'C') { kputsn("i:", 2, s); kputw(*p, s); ++p; }
+		else if (type == 's') { kputsn("i:", 2, s); kputw(*(int16_t*)p, s); p += 2; }
+		else if (type == 'S') { kputsn("i:", 2, s); kputw(*(uint16_t*)p, s); p += 2; }
+		else if (type == 'i') { kputsn("i:", 2, s); kputw(*(int32_t*)p, s); p += 4; }
+		else if (type == 'I') { kputsn("i:", 2, s); kputl(*(uint32_t*)p, s); p += 4; }
+		else if (type == 'f') { ksprintf(s, "f:%g", *(float*)p); p += 4; }
+		else if (type == 'd') { ksprintf(s, "f:%g", *(double*)p); p += 8; }
+		else if (type == 'Z' || type == 'H') {
+			kputc(type, s); kputc(':', s);
+			while (p < end && *p) kputc(*p++, s);
+			++p;
+		} else if (type == 'B' && end - p >= 5) {
+			int sub = p[0], i, n = *(int32_t*)(p + 1);
+			p += 5;
+			kputsn("B:", 2, s); kputc(sub, s);
+			for (i = 0; i < n && p < end; ++i) {
+				kputc(',', s);
+				if (sub == 'c') kputw(*(int8_t*)p++, s);
+				else if (sub == 'C') kputw(*p++, s);
+				else if (sub == 's') kputw(*(int16_t*)p, s), p += 2;
+				else if (sub == 'S') kputw(*(uint16_t*)p, s), p += 2;
+				else if (sub == 'i') kputw(*(int32_t*)p, s), p += 4;
+				else if (sub == 'I') kputl(*(uint32_t*)p, s), p += 4;
+				else if (sub == 'f') ksprintf(s, "%g", *(float*)p), p += 4;
+				else break;
+			}
+		} else break; // unknown type; drop the rest
+		if (drop) s->l = l0, s->s[l0] = 0;
+	}
+}
+
+static void bam2bseq1(const bam1_t *b, bseq1_t *s, kstring_t *a, kstring_t *tmp, int copy_tags)
+{ // same as kseq2bseq1(), with the original read restored if it is reverse complemented
+	static const char nt16[2][17] = { "=ACMGRSVTWYHKDBN", "=TGKCYSBAWRDMHVN" };
+	const uint8_t *seq = bam1_seq(b), *qual = bam1_qual(b);
+	int i, l = b->core.l_qseq, rev = bam1_strand(b);
+	s->name = bseq_put(a, bam1_qname(b), b->core.l_qname - 1);
+	s->comment = 0;
+	if (copy_tags) {
+		tmp->l = 0;
+		bam_aux2str(b, tmp);
+		if (tmp->l) s->comment = bseq_put(a, tmp->s, tmp->l);
+	}
+	tmp->l = 0;
+	for (i = 0; i < l; ++i)
+		kputc(nt16[rev][bam1_seqi(seq, rev? l - 1 - i : i)], tmp);
+	s->seq = bseq_put(a, tmp->s, l);
+	s->qual = 0;
+	if (l > 0 && qual[0] != 0xff) {
+		tmp->l = 0;
+		for (i = 0; i < l; ++i) {
+			int q = qual[rev? l - 1 - i : i];
+			kputc(q + 33 < 126? q + 33 : 126, tmp);
+		}
+		s->qual = bseq_put(a, tmp->s, l);
+	}
+	s->l_seq = l;
+}
+
+bseq1_t *bseq_read_bam(int chunk_size, int *n_, bseq_bam_t *f, int pe)
+{
+	int size = 0, m, n;
+	bseq1_t *seqs;
+	kstring_t a = {0,0,0}, tmp = {0,0,0};
+	m = n = 0; seqs = 0;
+	kputc(0, &a);
+	while (f->has_pend || bseq_bam_next(f, f->b)) {
+		bam1_t *r[2];
+		int k, n_rec = 1;
+		if (f->has_pend && !pe) { // the record peeked by bseq_bam_init()
+			r[0] = f->pend, f->has_pend = 0;
+		} else if (!pe) {
+			r[0] = f->b;
+		} else if (!f->has_pend) { // PE: wait for the mate
+			bam1_t *t = f->pend; f->pend = f->b, f->b = t;
+			f->has_pend = 1;
+			continue;
+		} else if (!bseq_bam_next(f, f->b)) {
+			break;
+		} else if (!(f->pend->core.flag & BAM_FPAIRED) || strcmp(bam1_qname(f->pend), bam1_qname(f->b)) != 0) {
+			bam1_t *t = f->pend; f->pend = f->b, f->b = t; // drop the pending record and wait for the mate of the new one
+			++f->n_skip;
+			continue;
+		} else { // a pair; READ1 goes first
+			int swap = (f->pend->core.flag & BAM_FREAD2) && !(f->b->core.flag & BAM_FREAD2);
+			r[0] = swap? f->b : f->pend, r[1] = swap? f->pend : f->b;
+			n_rec = 2, f->has_pend = 0;
+		}
+		if (n + n_rec > m) {
+			m = m? m<<1 : 256;
+			seqs = realloc(seqs, m * sizeof(bseq1_t));
+		}
+		for (k = 0; k < n_rec; ++k) {
+			bam2bseq1(r[k], &seqs[n], &a, &tmp, f->copy_tags);
+			size += seqs[n++].l_seq;
+		}
+		if (size >= chunk_size && (n&1) == 0) break;
+	}
+	if (pe && f->has_pend && size == 0) // the last record has no mate
+		++f->n_skip, f->has_pend = 0;
+	free(tmp.s);
+	*n_ = n;
+	return bseq_finish(n, seqs, &a);
 }
 
 /*****************
@@ -85,8 +298,34 @@ void bwa_fill_scmat(int a, int b, int8_t mat[25])
 	for (j = 0; j < 5; ++j) mat[k++] = -1;
 }
 
+// Score of the ungapped alignment between $query and $rseq of length $l, both in the nt4 encoding
+int bwa_ungapped_score(const int8_t mat[25], int l, const uint8_t *query, const uint8_t *rseq)
+{
+	int i, j, n_eq = 0, n_amb = 0, score = 0;
+	__m128i three = _mm_set1_epi8(3);
+	for (i = 0; i < 5; ++i) // we can count matches/mismatches only if $mat is generated by bwa_fill_scmat()
+		for (j = 0; j < 5; ++j)
+			if (mat[i*5+j] != (i == 4 || j == 4? mat[4] : i == j? mat[0] : mat[1])) break;
+	if (i < 5) {
+		for (i = 0; i < l; ++i) score += mat[rseq[i]*5 + query[i]];
+		return score;
+	}
+	for (i = 0; i + 16 <= l; i += 16) {
+		__m128i x = _mm_loadu_si128((const __m128i*)(query + i)), y = _mm_loadu_si128((const __m128i*)(rseq + i));
+		__m128i amb = _mm_cmpgt_epi8(_mm_max_epu8(x, y), three);
+		__m128i eq = _mm_andnot_si128(amb, _mm_cmpeq_epi8(x, y));
+		n_eq  += __builtin_popcount(_mm_movemask_epi8(eq));
+		n_amb += __builtin_popcount(_mm_movemask_epi8(amb));
+	}
+	for (; i < l; ++i) {
+		if (query[i] > 3 || rseq[i] > 3) ++n_amb;
+		else if (query[i] == rseq[i]) ++n_eq;
+	}
+	return n_eq * mat[0] + (l - n_eq - n_amb) * mat[1] + n_amb * mat[4];
+}
+
 // Generate CIGAR when the alignment end points are known
-uint32_t *bwa_gen_cigar(const int8_t mat[25], int q, int r, int w_, int64_t l_pac, const uint8_t *pac, int l_query, uint8_t *query, int64_t rb, int64_t re, int *score, int *n_cigar, int *NM)
+uint32_t *bwa_gen_cigar2(const int8_t mat[25], int q, int r, int w_, int64_t l_pac, const uint8_t *pac, int l_query, uint8_t *query, int64_t rb, int64_t re, int *score, int *n_cigar, int *NM, int n_cigar0, const uint32_t *cigar0, bns_seqcache_t *sc)
 {
 	uint32_t *cigar = 0;
 	uint8_t tmp, *rseq;
@@ -97,7 +336,7 @@ uint32_t *bwa_gen_cigar(const int8_t mat[25], int q, int r, int w_, int64_t l_pa
 
 	*n_cigar = 0; *NM = -1;
 	if (l_query <= 0 || rb >= re || (rb < l_pac && re > l_pac)) return 0; // reject if negative length or bridging the forward and reverse strand
-	rseq = bns_get_seq(l_pac, pac, rb, re, &rlen);
+	rseq = bns_get_seq2(sc, l_pac, pac, rb, re, &rlen);
 	if (re - rb != rlen) goto ret_gen_cigar; // possible if out of range
 	if (rb >= l_pac) { // then reverse both query and rseq; this is to ensure indels to be placed at the leftmost position
 		for (i = 0; i < l_query>>1; ++i)
@@ -105,13 +344,46 @@ uint32_t *bwa_gen_cigar(const int8_t mat[25], int q, int r, int w_, int64_t l_pa
 		for (i = 0; i < rlen>>1; ++i)
 			tmp = rseq[i], rseq[i] = rseq[rlen - 1 - i], rseq[rlen - 1 - i] = tmp;
 	}
-	if (l_query == re - rb && w_ == 0) { // no gap; no need to do DP
-		// FIXME: due to an issue in mem_reg2aln(), we never come to this block. This does not affect accuracy, but it hurts performance.
+	if (n_cigar0 > 0) { // CIGAR is given; no need to do DP
+		int k, x, y;
+		cigar = malloc(n_cigar0 * 4);
+		for (k = 0; k < n_cigar0; ++k) // CIGAR is on the strand of rb; reverse it like query and rseq
+			cigar[k] = cigar0[rb >= l_pac? n_cigar0 - 1 - k : k];
+		for (k = x = y = 0; k < n_cigar0; ++k) { // move indels left while the score does not drop, as ksw_global() places them
+			int op = cigar[k]&0xf, len = cigar[k]>>4;
+			if ((op == 1 || op == 2) && k > 0 && k < n_cigar0 - 1 && (cigar[k-1]&0xf) == 0 && (cigar[k+1]&0xf) == 0) {
+				int l, best = 0, d = 0;
+				for (l = 1; l <= (int)(cigar[k-1]>>4); ++l) { // step $l moves the last base of the gap into the match on its left
+					int xl = x - l, yl = y - l; // the matched pair next to the gap before the step
+					if (op == 1) d += mat[rseq[yl]*5 + query[xl + len]] - mat[rseq[yl]*5 + query[xl]];
+					else d += mat[rseq[yl + len]*5 + query[xl]] - mat[rseq[yl]*5 + query[xl]];
+					if (d >= 0) best = l;
+				}
+				cigar[k-1] -= best<<4, cigar[k+1] += best<<4, x -= best, y -= best;
+			}
+			if (op == 0 || op == 1) x += len;
+			if (op == 0 || op == 2) y += len;
+		}
+		for (k = 0, i = -1; k < n_cigar0; ++k) { // drop empty operations and merge adjacent ones
+			if (cigar[k]>>4 == 0) continue;
+			if (i >= 0 && (cigar[i]&0xf) == (cigar[k]&0xf)) cigar[i] += cigar[k]>>4<<4;
+			else cigar[++i] = cigar[k];
+		}
+		*n_cigar = n_cigar0 = i + 1;
+		for (k = 0, x = y = 0, *score = 0; k < n_cigar0; ++k) {
+			int op = cigar[k]&0xf, len = cigar[k]>>4;
+			if (op == 0) {
+				for (i = 0; i < len; ++i)
+					*score += mat[rseq[y + i]*5 + query[x + i]];
+				x += len, y += len;
+			} else if (op == 1) x += len, *score -= q + r * len;
+			else if (op == 2) y += len, *score -= q + r * len;
+		}
+	} else if (l_query == re - rb && w_ == 0) { // no gap; no need to do DP
 		cigar = malloc(4);
 		cigar[0] = l_query<<4 | 0;
 		*n_cigar = 1;
-		for (i = 0, *score = 0; i < l_query; ++i)
-			*score += mat[rseq[i]*5 + query[i]];
+		*score = bwa_ungapped_score(mat, l_query, query, rseq);
 	} else {
 		int w, max_gap, min_w;
 		// set the band-width
@@ -169,6 +441,11 @@ ret_gen_cigar:
 	return cigar;
 }
 
+uint32_t *bwa_gen_cigar(const int8_t mat[25], int q, int r, int w_, int64_t l_pac, const uint8_t *pac, int l_query, uint8_t *query, int64_t rb, int64_t re, int *score, int *n_cigar, int *NM)
+{
+	return bwa_gen_cigar2(mat, q, r, w_, l_pac, pac, l_query, query, rb, re, score, n_cigar, NM, 0, 0, 0);
+}
+
 int bwa_fix_xref(const int8_t mat[25], int q, int r, int w, const bntseq_t *bns, const uint8_t *pac, uint8_t *query, int *qb, int *qe, int64_t *rb, int64_t *re)
 {
 	int is_rev;
@@ -282,6 +559,16 @@ bwaidx_t *bwa_idx_load(const char *hint, int which)
 			idx->bns->fp_pac = 0;
 		}
 	}
+	if (which & BWA_IDX_MZ) {
+		char *tmp = calloc(strlen(prefix) + 5, 1);
+		strcat(strcpy(tmp, prefix), ".mzi");
+		idx->mz = mz_restore(tmp);
+		free(tmp);
+		if (idx->mz == 0) {
+			bwa_idx_destroy(idx);
+			idx = 0;
+		}
+	}
 	free(prefix);
 	return idx;
 }
@@ -292,9 +579,157 @@ void bwa_idx_destroy(bwaidx_t *idx)
 	if (idx->bwt) bwt_destroy(idx->bwt);
 	if (idx->bns) bns_destroy(idx->bns);
 	if (idx->pac) free(idx->pac);
+	if (idx->mz) mz_destroy(idx->mz);
 	free(idx);
 }
 
+/*****************
+ * NUMA replicas *
+ *****************/
+
+/* Each replica is copied by a thread pinned to its node. Large blocks from
+ * malloc() are fresh pages, which Linux allocates on the node of the thread
+ * that first touches them, so no libnuma is needed. The copy on node 0
+ * replaces the arrays of the index, such that the index is held once per
+ * node, not once more.
+ */
+
+#ifdef __linux__
+static int bwa_read_list(const char *fn, int **a)
+{ // read a list like "0-3,8,10-11" from $fn; return the number of integers or -1 on failure
+	char buf[4096], *p;
+	int n = 0, m = 0;
+	FILE *fp;
+	if ((fp = fopen(fn, "r")) == 0) return -1;
+	p = fgets(buf, sizeof(buf), fp);
+	fclose(fp);
+	if (p == 0) return -1;
+	while (isdigit(*p)) {
+		int i, beg, end;
+		beg = end = strtol(p, &p, 10);
+		if (*p == '-') end = strtol(p + 1, &p, 10);
+		for (i = beg; i <= end; ++i) {
+			if (n == m) m = m? m<<1 : 16, *a = realloc(*a, m * sizeof(int));
+			(*a)[n++] = i;
+		}
+		if (*p == ',') ++p;
+	}
+	return n;
+}
+
+typedef struct {
+	const bwt_t *bwt;
+	const uint8_t *pac;
+	int64_t l_pac;
+	bwa_numa_t *nm;
+	int i;
+} numa_copy_t;
+
+static void *bwa_numa_copy(void *data)
+{
+	numa_copy_t *c = (numa_copy_t*)data;
+	const bwt_t *bwt = c->bwt;
+	bwt_t *b;
+	bwa_numa_bind(c->nm, c->i);
+	b = c->nm->bwt[c->i] = malloc(sizeof(bwt_t));
+	*b = *bwt;
+	b->bwt = malloc(bwt->bwt_size * 4);
+	memcpy(b->bwt, bwt->bwt, bwt->bwt_size * 4);
+	b->sa = malloc(bwt->n_sa * sizeof(bwtint_t));
+	memcpy(b->sa, bwt->sa, bwt->n_sa * sizeof(bwtint_t));
+	c->nm->pac[c->i] = malloc(c->l_pac);
+	memcpy(c->nm->pac[c->i], c->pac, c->l_pac);
+	return 0;
+}
+
+bwa_numa_t *bwa_numa_init(bwaidx_t *idx, int max_node)
+{
+	bwa_numa_t *nm;
+	int i, j, n, *node = 0;
+	cpu_set_t cs;
+	numa_copy_t *c;
+	pthread_t *tid;
+	if ((n = bwa_read_list("/sys/devices/system/node/online", &node)) < 0) n = 0;
+	if (sched_getaffinity(0, sizeof(cpu_set_t), &cs) < 0) CPU_ZERO(&cs);
+	nm = calloc(1, sizeof(bwa_numa_t));
+	nm->n_cpu = calloc(n, sizeof(int));
+	nm->cpu = calloc(n, sizeof(int*));
+	for (i = 0; i < n && nm->n_node < max_node; ++i) { // keep the nodes with CPUs we may run on
+		char fn[64];
+		int k, m, *cpu = 0;
+		sprintf(fn, "/sys/devices/system/node/node%d/cpulist", node[i]);
+		m = bwa_read_list(fn, &cpu);
+		for (j = k = 0; j < m; ++j)
+			if (cpu[j] < CPU_SETSIZE && CPU_ISSET(cpu[j], &cs))
+				cpu[k++] = cpu[j];
+		if (k > 0) nm->n_cpu[nm->n_node] = k, nm->cpu[nm->n_node++] = cpu;
+		else free(cpu);
+	}
+	free(node);
+	if (nm->n_node < 2) {
+		if (bwa_verbose >= 3)
+			fprintf(stderr, "[M::%s] one NUMA node available; the index is not replicated\n", __func__);
+		bwa_numa_destroy(nm);
+		return 0;
+	}
+	nm->bwt = calloc(nm->n_node, sizeof(bwt_t*));
+	nm->pac = calloc(nm->n_node, sizeof(uint8_t*));
+	c = calloc(nm->n_node, sizeof(numa_copy_t));
+	tid = calloc(nm->n_node, sizeof(pthread_t));
+	for (i = 0; i < nm->n_node; ++i)
+		c[i].nm = nm, c[i].i = i, c[i].l_pac = idx->bns->l_pac/4+1;
+	c[0].bwt = idx->bwt, c[0].pac = idx->pac;
+	pthread_create(&tid[0], 0, bwa_numa_copy, &c[0]);
+	pthread_join(tid[0], 0);
+	free(idx->bwt->bwt); free(idx->bwt->sa); free(idx->pac); // the copy on node 0 takes their place
+	free(idx->bwt);
+	idx->bwt = nm->bwt[0], idx->pac = nm->pac[0];
+	for (i = 1; i < nm->n_node; ++i) { // the other nodes copy from node 0
+		c[i].bwt = idx->bwt, c[i].pac = idx->pac;
+		pthread_create(&tid[i], 0, bwa_numa_copy, &c[i]);
+	}
+	for (i = 1; i < nm->n_node; ++i) pthread_join(tid[i], 0);
+	free(c); free(tid);
+	if (bwa_verbose >= 3)
+		fprintf(stderr, "[M::%s] replicated the index on %d NUMA nodes\n", __func__, nm->n_node);
+	return nm;
+}
+
+void bwa_numa_bind(const bwa_numa_t *nm, int tid)
+{
+	cpu_set_t cs;
+	int i, k = tid % nm->n_node;
+	CPU_ZERO(&cs);
+	for (i = 0; i < nm->n_cpu[k]; ++i) CPU_SET(nm->cpu[k][i], &cs);
+	if (pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cs) != 0 && bwa_verbose >= 2)
+		fprintf(stderr, "[W::%s] fail to pin thread %d to NUMA node %d\n", __func__, tid, k);
+}
+#else
+bwa_numa_t *bwa_numa_init(bwaidx_t *idx, int max_node)
+{
+	if (bwa_verbose >= 2)
+		fprintf(stderr, "[W::%s] NUMA placement is only supported on Linux\n", __func__);
+	return 0;
+}
+
+void bwa_numa_bind(const bwa_numa_t *nm, int tid) {}
+#endif
+
+void bwa_numa_destroy(bwa_numa_t *nm)
+{
+	int i;
+	if (nm == 0) return;
+	for (i = 0; i < nm->n_node; ++i) {
+		free(nm->cpu[i]);
+		if (i == 0) continue; // the copy on node 0 is owned by the index
+		if (nm->bwt && nm->bwt[i]) {
+			free(nm->bwt[i]->bwt); free(nm->bwt[i]->sa); free(nm->bwt[i]);
+		}
+		if (nm->pac) free(nm->pac[i]);
+	}
+	free(nm->n_cpu); free(nm->cpu); free(nm->bwt); free(nm->pac); free(nm);
+}
+
 /***********************
  * SAM header routines *
  ***********************/
@@ -309,6 +744,63 @@ void bwa_print_sam_hdr(const bntseq_t *bns, const char *rg_line)
 	err_printf("%s\n", bwa_pg);
 }
 
+static inline void kput32(int32_t x, kstring_t *s) // little-endian, as in BAM
+{
+	uint8_t b[4];
+	b[0] = x, b[1] = x>>8, b[2] = x>>16, b[3] = x>>24;
+	kputsn((char*)b, 4, s);
+}
+
+char *bwa_sam_hdr(const bntseq_t *bns, const char *rg_line, int sorted)
+{
+	extern char *bwa_pg;
+	kstring_t txt = {0,0,0};
+	int i;
+	if (sorted) kputs("@HD\tVN:1.3\tSO:coordinate\n", &txt);
+	for (i = 0; i < bns->n_seqs; ++i) {
+		kputsn("@SQ\tSN:", 7, &txt); kputs(bns->anns[i].name, &txt);
+		kputsn("\tLN:", 4, &txt); kputw(bns->anns[i].len, &txt); kputc('\n', &txt);
+	}
+	if (rg_line) { kputs(rg_line, &txt); kputc('\n', &txt); }
+	kputs(bwa_pg, &txt); kputc('\n', &txt);
+	return txt.s;
+}
+
+char *bwa_bam_hdr(const bntseq_t *bns, const char *rg_line, int sorted, int *len)
+{
+	kstring_t txt = {0,0,0}, str = {0,0,0};
+	int i;
+	txt.s = bwa_sam_hdr(bns, rg_line, sorted);
+	txt.l = strlen(txt.s);
+	kputsn("BAM\1", 4, &str);
+	kput32(txt.l, &str); kputsn(txt.s, txt.l, &str);
+	kput32(bns->n_seqs, &str);
+	for (i = 0; i < bns->n_seqs; ++i) {
+		int l = strlen(bns->anns[i].name) + 1;
+		kput32(l, &str); kputsn(bns->anns[i].name, l, &str); // including the NULL
+		kput32(bns->anns[i].len, &str);
+	}
+	free(txt.s);
+	*len = str.l;
+	return str.s;
+}
+
+char *bwa_bwr_hdr(const bntseq_t *bns, int *len)
+{
+	kstring_t str = {0,0,0};
+	int i;
+	kputsn("BWR\1", 4, &str);
+	kput32(bns->n_seqs, &str);
+	for (i = 0; i < bns->n_seqs; ++i) {
+		int64_t l = bns->anns[i].len;
+		int l_name = strlen(bns->anns[i].name) + 1;
+		kput32(l_name, &str); kputsn(bns->anns[i].name, l_name, &str);
+		kputsn((char*)&l, 8, &str);
+	}
+	*len = str.l;
+	return str.s;
+}
+
 static char *bwa_escape(char *s)
 {
 	char *p, *q;
@@ -4,23 +4,35 @@
 #include <stdint.h>
 #include "bntseq.h"
 #include "bwt.h"
+#include "mzidx.h"
 
 #define BWA_IDX_BWT 0x1
 #define BWA_IDX_BNS 0x2
 #define BWA_IDX_PAC 0x4
 #define BWA_IDX_ALL 0x7
+#define BWA_IDX_MZ  0x8 // minimizer index; not included in BWA_IDX_ALL
 
 typedef struct {
 	bwt_t    *bwt; // FM-index
 	bntseq_t *bns; // information on the reference sequences
 	uint8_t  *pac; // the actual 2-bit encoded reference sequences with 'N' converted to a random base
+	mzidx_t  *mz;  // minimizer index, built by `bwa index -M'
 } bwaidx_t;
 
 typedef struct {
-	int l_seq;
+	int l_seq, l_sam; // l_sam: length of $sam, which holds binary records in the BAM output mode
 	char *name, *comment, *seq, *qual, *sam;
 } bseq1_t;
 
+typedef struct bseq_bam_s bseq_bam_t;
+
+typedef struct {
+	int n_node;        // number of NUMA nodes in use
+	int *n_cpu, **cpu; // the CPUs of each node that this process may run on
+	bwt_t **bwt;       // bwt[i]: FM-index and SA allocated on node i; bwt[0] is also bwaidx_t::bwt
+	uint8_t **pac;     // pac[i]: 2-bit encoded reference allocated on node i; pac[0] is also bwaidx_t::pac
+} bwa_numa_t;
+
 extern int bwa_verbose;
 extern char bwa_rg_id[256];
 
@@ -28,10 +40,17 @@ extern char bwa_rg_id[256];
 extern "C" {
 #endif
 
-	bseq1_t *bseq_read(int chunk_size, int *n_, void *ks1_, void *ks2_);
+	bseq1_t *bseq_read(int chunk_size, int *n_, void *ks1_, void *ks2_); // the records and their strings are in one block; only free() the returned pointer
+
+	bseq_bam_t *bseq_bam_init(void *fp, int copy_tags); // read the header from gzFile $fp; NULL if not BAM. With $copy_tags, tags go to bseq1_t::comment in SAM
+	int bseq_bam_is_paired(const bseq_bam_t *f); // whether the first primary record is flagged as paired
+	bseq1_t *bseq_read_bam(int chunk_size, int *n_, bseq_bam_t *f, int pe); // same as bseq_read(); if $pe, READ1/READ2 mates are paired by name
+	void bseq_bam_destroy(bseq_bam_t *f);
 
 	void bwa_fill_scmat(int a, int b, int8_t mat[25]);
+	int bwa_ungapped_score(const int8_t mat[25], int l, const uint8_t *query, const uint8_t *rseq);
 	uint32_t *bwa_gen_cigar(const int8_t mat[25], int q, int r, int w_, int64_t l_pac, const uint8_t *pac, int l_query, uint8_t *query, int64_t rb, int64_t re, int *score, int *n_cigar, int *NM);
+	uint32_t *bwa_gen_cigar2(const int8_t mat[25], int q, int r, int w_, int64_t l_pac, const uint8_t *pac, int l_query, uint8_t *query, int64_t rb, int64_t re, int *score, int *n_cigar, int *NM, int n_cigar0, const uint32_t *cigar0, bns_seqcache_t *sc); // use $cigar0 if n_cigar0>0; retrieve the reference via $sc if not NULL
 	int bwa_fix_xref(const int8_t mat[25], int q, int r, int w, const bntseq_t *bns, const uint8_t *pac, uint8_t *query, int *qb, int *qe, int64_t *rb, int64_t *re);
 
 	char *bwa_idx_infer_prefix(const char *hint);
@@ -40,7 +59,14 @@ extern "C" {
 	bwaidx_t *bwa_idx_load(const char *hint, int which);
 	void bwa_idx_destroy(bwaidx_t *idx);
 
+	bwa_numa_t *bwa_numa_init(bwaidx_t *idx, int max_node); // copy the FM-index, SA and pac of $idx to up to $max_node NUMA nodes, moving those of $idx to node 0; NULL if there is only one node
+	void bwa_numa_bind(const bwa_numa_t *nm, int tid); // pin the calling thread to the CPUs of node $tid % nm->n_node
+	void bwa_numa_destroy(bwa_numa_t *nm); // the copy on node 0 is freed by bwa_idx_destroy()
+
 	void bwa_print_sam_hdr(const bntseq_t *bns, const char *rg_line);
+	char *bwa_sam_hdr(const bntseq_t *bns, const char *rg_line, int sorted); // same text as bwa_print_sam_hdr(), plus @HD if $sorted
+	char *bwa_bwr_hdr(const bntseq_t *bns, int *len); // binary header of the BWR format; see bwr.h
+	char *bwa_bam_hdr(const bntseq_t *bns, const char *rg_line, int sorted, int *len); // binary BAM header with the same text as bwa_print_sam_hdr(), plus @HD if $sorted
 	char *bwa_set_rg(const char *s);
 
 #ifdef __cplusplus
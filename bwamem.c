@@ -56,6 +56,7 @@ mem_opt_t *mem_opt_init()
 	o->split_width = 10;
 	o->max_occ = 10000;
 	o->max_chain_gap = 10000;
+	o->dp_chain_len = 0;
 	o->max_ins = 10000;
 	o->mask_level = 0.50;
 	o->chain_drop_ratio = 0.50;
@@ -196,7 +197,9 @@ static int test_and_merge(const mem_opt_t *opt, int64_t l_pac, mem_chain_t *c, c
 	return 0; // request to add a new chain
 }
 
-static void mem_insert_seed(const mem_opt_t *opt, int64_t l_pac, kbtree_t(chn) *tree, smem_i *itr)
+typedef struct { size_t n, m; mem_seed_t *a; } mem_seed_v;
+
+static void mem_collect_seeds(const mem_opt_t *opt, int64_t l_pac, smem_i *itr, mem_seed_v *v)
 {
 	const bwtintv_v *a;
 	int split_len = (int)(opt->min_seed_len * opt->split_factor + .499);
@@ -209,29 +212,112 @@ static void mem_insert_seed(const mem_opt_t *opt, int64_t l_pac, kbtree_t(chn) *
 			int64_t k;
 			if (slen < opt->min_seed_len || p->x[2] > opt->max_occ) continue; // ignore if too short or too repetitive
 			for (k = 0; k < p->x[2]; ++k) {
-				mem_chain_t tmp, *lower, *upper;
 				mem_seed_t s;
-				int to_add = 0;
-				s.rbeg = tmp.pos = bwt_sa(itr->bwt, p->x[0] + k); // this is the base coordinate in the forward-reverse reference
+				s.rbeg = bwt_sa(itr->bwt, p->x[0] + k); // this is the base coordinate in the forward-reverse reference
 				s.qbeg = p->info>>32;
 				s.len  = slen;
 				if (bwa_verbose >= 5) printf("* Found SEED: length=%d,query_beg=%d,ref_beg=%ld\n", s.len, s.qbeg, (long)s.rbeg);
 				if (s.rbeg < l_pac && l_pac < s.rbeg + s.len) continue; // bridging forward-reverse boundary; skip
-				if (kb_size(tree)) {
-					kb_intervalp(chn, tree, &tmp, &lower, &upper); // find the closest chain
-					if (!lower || !test_and_merge(opt, l_pac, lower, &s)) to_add = 1;
-				} else to_add = 1;
-				if (to_add) { // add the seed as a new chain
-					tmp.n = 1; tmp.m = 4;
-					tmp.seeds = calloc(tmp.m, sizeof(mem_seed_t));
-					tmp.seeds[0] = s;
-					kb_putp(chn, tree, &tmp);
-				}
+				kv_push(mem_seed_t, *v, s);
 			}
 		}
 	}
 }
 
+static void mem_insert_seed(const mem_opt_t *opt, int64_t l_pac, kbtree_t(chn) *tree, int n, const mem_seed_t *a)
+{
+	int i;
+	for (i = 0; i < n; ++i) { // in the order of SMEMs
+		mem_chain_t tmp, *lower, *upper;
+		const mem_seed_t *s = &a[i];
+		int to_add = 0;
+		tmp.pos = s->rbeg;
+		if (kb_size(tree)) {
+			kb_intervalp(chn, tree, &tmp, &lower, &upper); // find the closest chain
+			if (!lower || !test_and_merge(opt, l_pac, lower, s)) to_add = 1;
+		} else to_add = 1;
+		if (to_add) { // add the seed as a new chain
+			tmp.n = 1; tmp.m = 4;
+			tmp.seeds = calloc(tmp.m, sizeof(mem_seed_t));
+			tmp.seeds[0] = *s;
+			kb_putp(chn, tree, &tmp);
+		}
+	}
+}
+
+/* Chaining long queries by dynamic programming
+ *
+ * The greedy chaining above only compares a seed with the last seed of the
+ * closest chain. On long noisy reads, this breaks a true hit into many
+ * chains, each leading to an extension across the read. For long queries,
+ * we instead sort seeds by reference position and compute the best score
+ * f(i) of a colinear chain ending at seed i, looking back at most
+ * MEM_DP_CHAIN_H seeds:
+ *
+ *   f(i) = max{ len(i), max_j f(j) + g(j,i) - gap(|dq-dr|) }
+ *
+ * where g(j,i) is the number of bases in seed i not covered by seed j, and
+ * dq and dr are the distances between the seed starts on the query and the
+ * reference. A seed j is not considered if the two seeds are on
+ * different strands, farther than max_chain_gap, or separated by an indel
+ * longer than the band width, such that each chain can be extended within
+ * the band. Chains are then backtracked from the highest f(i); a chain
+ * stops at a seed taken by a better chain.
+ */
+
+#define MEM_DP_CHAIN_H 50
+
+#define seed_rlt(a, b) ((a).rbeg < (b).rbeg || ((a).rbeg == (b).rbeg && (a).qbeg < (b).qbeg))
+KSORT_INIT(mem_seed_r, mem_seed_t, seed_rlt)
+
+static void mem_chain_dp(const mem_opt_t *opt, int64_t l_pac, int n, mem_seed_t *a, mem_chain_v *chain)
+{
+	int i, j, k, *f, *p, *t;
+	uint64_t *srt;
+	if (n == 0) return;
+	ks_introsort(mem_seed_r, n, a);
+	f = malloc(n * 3 * sizeof(int));
+	p = f + n, t = p + n;
+	srt = malloc(n * 8);
+	for (i = 0; i < n; ++i) {
+		const mem_seed_t *si = &a[i];
+		int max_f = si->len, max_j = -1;
+		for (j = i - 1; j >= 0 && j >= i - MEM_DP_CHAIN_H; --j) {
+			const mem_seed_t *sj = &a[j];
+			int64_t dr = si->rbeg - sj->rbeg;
+			int dq = si->qbeg - sj->qbeg, dd, sc;
+			int64_t gain;
+			if (dr > opt->max_chain_gap) break;
+			if ((sj->rbeg < l_pac) != (si->rbeg < l_pac)) break; // on different strands
+			if (dq <= 0 || dr <= 0 || dq > opt->max_chain_gap) continue; // not colinear or too far away on the query
+			dd = dq > dr? dq - dr : dr - dq;
+			if (dd > opt->w) continue; // a large gap; break the chain here
+			gain = si->qbeg + si->len - (sj->qbeg + sj->len); // bases not covered by seed j
+			gain = gain < dr + si->len - sj->len? gain : dr + si->len - sj->len;
+			gain = gain < si->len? gain : si->len;
+			gain = gain > 0? gain : 0;
+			sc = f[j] + gain - (dd? (int)(.01 * si->len * dd + .5 * log(dd) / M_LN2 + .499) : 0);
+			if (sc > max_f) max_f = sc, max_j = j;
+		}
+		f[i] = max_f, p[i] = max_j, t[i] = 0;
+		srt[i] = (uint64_t)max_f<<32 | i;
+	}
+	ks_introsort_64(n, srt);
+	for (k = n - 1; k >= 0; --k) { // backtrack from the best chain
+		mem_chain_t *c;
+		int n_s = 0;
+		i = (uint32_t)srt[k];
+		if (t[i]) continue;
+		for (j = i; j >= 0 && !t[j]; j = p[j]) t[j] = 1, ++n_s;
+		c = kv_pushp(mem_chain_t, *chain);
+		c->n = c->m = n_s;
+		c->seeds = malloc(n_s * sizeof(mem_seed_t));
+		for (j = i; n_s > 0; j = p[j]) c->seeds[--n_s] = a[j]; // such that seeds are in the ascending order of qbeg
+		c->pos = c->seeds[0].rbeg;
+	}
+	free(f); free(srt);
+}
+
 int mem_chain_weight(const mem_chain_t *c)
 {
 	int64_t end;
@@ -270,18 +356,87 @@ void mem_print_chain(const bntseq_t *bns, mem_chain_v *chn)
 	}
 }
 
-mem_chain_v mem_chain(const mem_opt_t *opt, const bwt_t *bwt, int64_t l_pac, int len, const uint8_t *seq)
+/* Seeding long queries with minimizers
+ *
+ * For a long query, looking up minimizers in a hash-sorted array is much
+ * cheaper than finding SMEMs with the FM-index. Each minimizer hit is an
+ * exact k-mer match, as the hash is invertible. Hits on the same diagonal
+ * that overlap or abut are merged into a longer exact match, which is then
+ * used as a seed in the same way as an SMEM.
+ */
+
+#define MEM_MZ_MAX_OCC 200 // skip minimizers occurring more often than this, in addition to opt->max_occ
+
+#define seed_qlt(a, b) ((a).qbeg < (b).qbeg || ((a).qbeg == (b).qbeg && (a).rbeg < (b).rbeg))
+KSORT_INIT(mem_seed_q, mem_seed_t, seed_qlt)
+
+static void mem_collect_seeds_mz(const mem_opt_t *opt, const mzidx_t *mz, int64_t l_pac, int len, const uint8_t *seq, mem_seed_v *v)
+{
+	pair64_v mini = {0,0,0}, hits = {0,0,0};
+	int i, k = mz->k, max_occ = opt->max_occ < MEM_MZ_MAX_OCC? opt->max_occ : MEM_MZ_MAX_OCC;
+	size_t j, n0 = v->n;
+	mz_sketch(k, mz->w, len, seq, &mini);
+	for (j = 0; j < mini.n; ++j) {
+		int64_t n, l;
+		int qbeg = (mini.a[j].y>>1) - k + 1, qz = mini.a[j].y&1;
+		const uint64_t *r = mz_get(mz, mini.a[j].x, &n);
+		if (n > max_occ) continue;
+		for (l = 0; l < n; ++l) {
+			int64_t rbeg = mz_pos(r[l]) - k + 1;
+			pair64_t *p;
+			if (mz_strand(r[l]) != qz) rbeg = (l_pac<<1) - (rbeg + k); // the query k-mer matches the reverse strand
+			p = kv_pushp(pair64_t, hits);
+			p->x = rbeg - qbeg + len, p->y = qbeg; // diagonal and query start
+		}
+	}
+	ks_introsort_128(hits.n, hits.a);
+	for (j = 0; j < hits.n; ++j) { // merge hits on the same diagonal
+		mem_seed_t *s = v->n > n0? &v->a[v->n-1] : 0;
+		int64_t rbeg = (int64_t)hits.a[j].x - len + hits.a[j].y;
+		if (s && s->rbeg - s->qbeg == rbeg - (int64_t)hits.a[j].y && hits.a[j].y <= s->qbeg + s->len) {
+			s->len = hits.a[j].y + k - s->qbeg;
+			continue;
+		}
+		s = kv_pushp(mem_seed_t, *v);
+		s->rbeg = rbeg, s->qbeg = hits.a[j].y, s->len = k;
+	}
+	for (j = i = n0; j < v->n; ++j) { // drop seeds bridging the forward-reverse boundary
+		const mem_seed_t *s = &v->a[j];
+		if (bwa_verbose >= 5) printf("* Found SEED: length=%d,query_beg=%d,ref_beg=%ld\n", s->len, s->qbeg, (long)s->rbeg);
+		if (s->rbeg < l_pac && l_pac < s->rbeg + s->len) continue;
+		v->a[i++] = *s;
+	}
+	v->n = i;
+	ks_introsort(mem_seed_q, v->n - n0, v->a + n0); // in the order of query positions, similar to SMEMs
+	free(mini.a); free(hits.a);
+}
+
+mem_chain_v mem_chain(const mem_opt_t *opt, const bwt_t *bwt, const mzidx_t *mz, int64_t l_pac, int len, const uint8_t *seq)
 {
 	mem_chain_v chain;
-	smem_i *itr;
+	mem_seed_v seeds;
 	kbtree_t(chn) *tree;
 
 	kv_init(chain);
 	if (len < opt->min_seed_len) return chain; // if the query is shorter than the seed length, no match
+	kv_init(seeds);
+	if (mz && opt->mz_len > 0 && len >= opt->mz_len) {
+		mem_collect_seeds_mz(opt, mz, l_pac, len, seq, &seeds);
+	} else {
+		smem_i *itr;
+		itr = smem_itr_init(bwt);
+		smem_set_query(itr, len, seq);
+		mem_collect_seeds(opt, l_pac, itr, &seeds);
+		smem_itr_destroy(itr);
+	}
+	if (opt->dp_chain_len > 0 && len >= opt->dp_chain_len) { // long query
+		mem_chain_dp(opt, l_pac, seeds.n, seeds.a, &chain);
+		free(seeds.a);
+		return chain;
+	}
 	tree = kb_init(chn, KB_DEFAULT_SIZE);
-	itr = smem_itr_init(bwt);
-	smem_set_query(itr, len, seq);
-	mem_insert_seed(opt, l_pac, tree, itr);
+	mem_insert_seed(opt, l_pac, tree, seeds.n, seeds.a);
+	free(seeds.a);
 
 	kv_resize(mem_chain_t, chain, kb_size(tree));
 
@@ -289,7 +444,6 @@ mem_chain_v mem_chain(const mem_opt_t *opt, const bwt_t *bwt, int64_t l_pac, int
 	__kb_traverse(mem_chain_t, tree, traverse_func);
 	#undef traverse_func
 
-	smem_itr_destroy(itr);
 	kb_destroy(chn, tree);
 	return chain;
 }
@@ -410,7 +564,7 @@ int mem_sort_and_dedup(int n, mem_alnreg_t *a, float mask_level_redun)
 		if (a[i].qe > a[i].qb) {
 			if (m != i) a[m++] = a[i];
 			else ++m;
-		}
+		} else free(a[i].cigar);
 	n = m;
 	ks_introsort(mem_ars, n, a);
 	for (i = 1; i < n; ++i) { // mark identical hits
@@ -421,38 +575,135 @@ int mem_sort_and_dedup(int n, mem_alnreg_t *a, float mask_level_redun)
 		if (a[i].qe > a[i].qb) {
 			if (m != i) a[m++] = a[i];
 			else ++m;
-		}
+		} else free(a[i].cigar);
 	return m;
 }
 
+/* Interval trees
+ *
+ * An AVL tree of intervals keyed by the start, where each node also keeps
+ * the largest end in its subtree. Inserting is O(log n). Finding the
+ * intervals overlapping [b,e) skips subtrees that end before b or start
+ * after e, so it takes O(log n) per reported interval. Nodes live in an
+ * array and link by index plus one, such that a zeroed tree is empty and a
+ * tree is freed with its array.
+ */
+
+typedef struct {
+	int64_t b, e, max_e; // interval [b,e) and the largest end in the subtree
+	uint32_t y;          // value of the interval
+	int32_t h, c[2];     // height and children; 0 for none
+} mem_inode_t;
+
+typedef struct {
+	size_t n, m;
+	mem_inode_t *a;
+	int32_t root;
+} mem_itree_t;
+
+#define mem_it_node(t, x) (&(t)->a[(x) - 1])
+#define mem_it_h(t, x) ((x)? mem_it_node(t, x)->h : 0)
+
+static inline void mem_it_update(mem_itree_t *t, int32_t x)
+{
+	mem_inode_t *p = mem_it_node(t, x);
+	int k, hl = mem_it_h(t, p->c[0]), hr = mem_it_h(t, p->c[1]);
+	p->h = (hl > hr? hl : hr) + 1;
+	p->max_e = p->e;
+	for (k = 0; k < 2; ++k)
+		if (p->c[k] && mem_it_node(t, p->c[k])->max_e > p->max_e)
+			p->max_e = mem_it_node(t, p->c[k])->max_e;
+}
+
+static int32_t mem_it_rotate(mem_itree_t *t, int32_t x, int d) // move child $d of $x up
+{
+	int32_t y = mem_it_node(t, x)->c[d];
+	mem_it_node(t, x)->c[d] = mem_it_node(t, y)->c[!d];
+	mem_it_node(t, y)->c[!d] = x;
+	mem_it_update(t, x); mem_it_update(t, y);
+	return y;
+}
+
+static int32_t mem_it_insert1(mem_itree_t *t, int32_t x, int32_t z)
+{
+	int d, bf;
+	if (x == 0) return z;
+	d = mem_it_node(t, z)->b >= mem_it_node(t, x)->b;
+	mem_it_node(t, x)->c[d] = mem_it_insert1(t, mem_it_node(t, x)->c[d], z);
+	mem_it_update(t, x);
+	bf = mem_it_h(t, mem_it_node(t, x)->c[1]) - mem_it_h(t, mem_it_node(t, x)->c[0]);
+	if (bf > 1 || bf < -1) {
+		int32_t y;
+		d = bf > 0; // the taller side
+		y = mem_it_node(t, x)->c[d];
+		if (mem_it_h(t, mem_it_node(t, y)->c[!d]) > mem_it_h(t, mem_it_node(t, y)->c[d])) // zig-zag
+			mem_it_node(t, x)->c[d] = mem_it_rotate(t, y, !d);
+		x = mem_it_rotate(t, x, d);
+	}
+	return x;
+}
+
+static void mem_itree_insert(mem_itree_t *t, int64_t b, int64_t e, uint32_t y)
+{
+	mem_inode_t *p;
+	p = kv_pushp(mem_inode_t, *t);
+	p->b = b, p->e = p->max_e = e, p->y = y;
+	p->h = 1, p->c[0] = p->c[1] = 0;
+	t->root = mem_it_insert1(t, t->root, t->n);
+}
+
+static void mem_it_overlap1(const mem_itree_t *t, int32_t x, int64_t b, int64_t e, uint64_v *out)
+{
+	while (x) {
+		const mem_inode_t *p = mem_it_node(t, x);
+		if (p->max_e <= b) return; // nothing in this subtree ends after $b
+		mem_it_overlap1(t, p->c[0], b, e, out);
+		if (p->b >= e) return; // this node and its right subtree start at or after $e
+		if (p->e > b) kv_push(uint64_t, *out, p->y);
+		x = p->c[1];
+	}
+}
+
+static inline void mem_itree_overlap(const mem_itree_t *t, int64_t b, int64_t e, uint64_v *out) // values of the intervals overlapping [b,e), in no particular order
+{
+	out->n = 0;
+	mem_it_overlap1(t, t->root, b, e, out);
+}
+
 void mem_mark_primary_se(const mem_opt_t *opt, int n, mem_alnreg_t *a, int64_t id) // IMPORTANT: must run mem_sort_and_dedup() before calling this function
 { // similar to the loop in mem_chain_flt()
-	int i, k, tmp;
-	kvec_t(int) z;
+	int i, tmp;
+	mem_itree_t z; // primary hits
+	uint64_v hit = {0,0,0};
 	if (n == 0) return;
-	kv_init(z);
+	memset(&z, 0, sizeof(mem_itree_t));
 	for (i = 0; i < n; ++i) a[i].sub = 0, a[i].secondary = -1, a[i].hash = hash_64(id+i);
 	ks_introsort(mem_ars_hash, n, a);
 	tmp = opt->a + opt->b > opt->q + opt->r? opt->a + opt->b : opt->q + opt->r;
-	kv_push(int, z, 0);
+	mem_itree_insert(&z, a[0].qb, a[0].qe, 0);
 	for (i = 1; i < n; ++i) {
-		for (k = 0; k < z.n; ++k) {
-			int j = z.a[k];
-			int b_max = a[j].qb > a[i].qb? a[j].qb : a[i].qb;
-			int e_min = a[j].qe < a[i].qe? a[j].qe : a[i].qe;
+		size_t k;
+		int j = -1;
+		mem_itree_overlap(&z, a[i].qb, a[i].qe, &hit);
+		for (k = 0; k < hit.n; ++k) { // the first primary in the score order with significant overlap
+			int jj = hit.a[k];
+			int b_max = a[jj].qb > a[i].qb? a[jj].qb : a[i].qb;
+			int e_min = a[jj].qe < a[i].qe? a[jj].qe : a[i].qe;
+			if (jj > j && j >= 0) continue;
 			if (e_min > b_max) { // have overlap
-				int min_l = a[i].qe - a[i].qb < a[j].qe - a[j].qb? a[i].qe - a[i].qb : a[j].qe - a[j].qb;
-				if (e_min - b_max >= min_l * opt->mask_level) { // significant overlap
-					if (a[j].sub == 0) a[j].sub = a[i].score;
-					if (a[j].score - a[i].score <= tmp) ++a[j].sub_n;
-					break;
-				}
+				int min_l = a[i].qe - a[i].qb < a[jj].qe - a[jj].qb? a[i].qe - a[i].qb : a[jj].qe - a[jj].qb;
+				if (e_min - b_max >= min_l * opt->mask_level) j = jj; // significant overlap
 			}
 		}
-		if (k == z.n) kv_push(int, z, i);
-		else a[i].secondary = z.a[k];
+		if (j < 0) {
+			mem_itree_insert(&z, a[i].qb, a[i].qe, i);
+		} else {
+			if (a[j].sub == 0) a[j].sub = a[i].score;
+			if (a[j].score - a[i].score <= tmp) ++a[j].sub_n;
+			a[i].secondary = j;
+		}
 	}
-	free(z.a);
+	free(z.a); free(hit.a);
 }
 
 /****************************************
@@ -473,7 +724,7 @@ void mem_mark_primary_se(const mem_opt_t *opt, int n, mem_alnreg_t *a, int64_t i
 #define MEM_SHORT_LEN 200
 #define MAX_BAND_TRY  2
 
-int mem_chain2aln_short(const mem_opt_t *opt, int64_t l_pac, const uint8_t *pac, int l_query, const uint8_t *query, const mem_chain_t *c, mem_alnreg_v *av)
+int mem_chain2aln_short(const mem_opt_t *opt, int64_t l_pac, const uint8_t *pac, bns_seqcache_t *sc, int l_query, const uint8_t *query, const mem_chain_t *c, mem_alnreg_v *av)
 {
 	int i, qb, qe, xtra;
 	int64_t rb, re, rlen;
@@ -506,7 +757,7 @@ int mem_chain2aln_short(const mem_opt_t *opt, int64_t l_pac, const uint8_t *pac,
 	if (qe - qb >= opt->w * 4 || re - rb >= opt->w * 4) return 1;
 	if (qe - qb >= MEM_SHORT_LEN || re - rb >= MEM_SHORT_LEN) return 1;
 
-	rseq = bns_get_seq(l_pac, pac, rb, re, &rlen);
+	rseq = bns_get_seq2(sc, l_pac, pac, rb, re, &rlen);
 	assert(rlen == re - rb);
 	xtra = KSW_XSUBO | KSW_XSTART | ((qe - qb) * opt->a < 250? KSW_XBYTE : 0) | (opt->min_seed_len * opt->a);
 	x = ksw_align(qe - qb, (uint8_t*)query + qb, re - rb, rseq, 5, opt->mat, opt->q, opt->r, xtra, 0);
@@ -529,154 +780,311 @@ static inline int cal_max_gap(const mem_opt_t *opt, int qlen)
 	return l < opt->w<<1? l : opt->w<<1;
 }
 
-void mem_chain2aln(const mem_opt_t *opt, int64_t l_pac, const uint8_t *pac, int l_query, const uint8_t *query, const mem_chain_t *c, mem_alnreg_v *av)
-{
-	int i, k, max_off[2], aw[2]; // aw: actual bandwidth used in extension
-	int64_t rlen, rmax[2], tmp, max = 0;
-	const mem_seed_t *s;
-	uint8_t *rseq = 0;
+/* mem_chain2aln() as a resumable procedure
+ *
+ * Extension is the most expensive step in the alignment of short reads, but
+ * each ksw_extend() call is small. To solve extensions from many reads with
+ * ksw_extend_batch(), mem_chain2aln() is written as a state machine:
+ * mem_c2a_next() runs until an extension is needed, writes the job to *e and
+ * returns 1. The caller solves the job and calls mem_c2a_next() again with
+ * the result in *e. mem_c2a_next() returns 0 when the chain is finished.
+ */
+
+enum { C2A_SEED, C2A_LEFT, C2A_RIGHT_BEG, C2A_RIGHT, C2A_SEED_END };
+
+typedef mem_itree_t mem_regidx_t; // [rb,re) of the alignment regions of one query; values are indices in the region list
+
+typedef struct {
+	const mem_opt_t *opt;
+	int64_t l_pac;
+	const uint8_t *pac;
+	int l_query;
+	const uint8_t *query;
+	const mem_chain_t *c;
+	mem_alnreg_v *av;
+	mem_regidx_t *ri;
+	// internal states
+	int state, k, i, aw[2], sc0;
+	mem_itree_t es;       // query intervals of extended seeds; values are seed indices
+	uint64_v hit;         // buffer for interval queries
+	size_t ia;            // index of the current alignment region in av
+	int64_t rmax[2];
+	uint8_t *rseq, *qs, *rs;
 	uint64_t *srt;
+	ksw_extck_t ck;       // checkpoint of the current extension, such that a retry with a larger band does not start over
+	int n_cigar[2];
+	uint32_t *cigar[2];   // CIGARs of the left and the right extensions with MEM_F_EXT_CIGAR
+} mem_c2a_t;
+
+static void mem_c2a_init(mem_c2a_t *z, const mem_opt_t *opt, int64_t l_pac, const uint8_t *pac, bns_seqcache_t *sc, int l_query, const uint8_t *query, const mem_chain_t *c, mem_alnreg_v *av, mem_regidx_t *ri)
+{
+	int i;
+	int64_t rlen, max = 0;
 
+	memset(z, 0, sizeof(mem_c2a_t));
+	z->opt = opt, z->l_pac = l_pac, z->pac = pac, z->l_query = l_query, z->query = query, z->c = c, z->av = av, z->ri = ri;
+	z->state = C2A_SEED, z->k = c->n - 1;
 	if (c->n == 0) return;
 	// get the max possible span
-	rmax[0] = l_pac<<1; rmax[1] = 0;
+	z->rmax[0] = l_pac<<1; z->rmax[1] = 0;
 	for (i = 0; i < c->n; ++i) {
 		int64_t b, e;
 		const mem_seed_t *t = &c->seeds[i];
 		b = t->rbeg - (t->qbeg + cal_max_gap(opt, t->qbeg));
 		e = t->rbeg + t->len + ((l_query - t->qbeg - t->len) + cal_max_gap(opt, l_query - t->qbeg - t->len));
-		rmax[0] = rmax[0] < b? rmax[0] : b;
-		rmax[1] = rmax[1] > e? rmax[1] : e;
+		z->rmax[0] = z->rmax[0] < b? z->rmax[0] : b;
+		z->rmax[1] = z->rmax[1] > e? z->rmax[1] : e;
 		if (t->len > max) max = t->len;
 	}
-	rmax[0] = rmax[0] > 0? rmax[0] : 0;
-	rmax[1] = rmax[1] < l_pac<<1? rmax[1] : l_pac<<1;
-	if (rmax[0] < l_pac && l_pac < rmax[1]) { // crossing the forward-reverse boundary; then choose one side
-		if (c->seeds[0].rbeg < l_pac) rmax[1] = l_pac; // this works because all seeds are guaranteed to be on the same strand
-		else rmax[0] = l_pac;
+	z->rmax[0] = z->rmax[0] > 0? z->rmax[0] : 0;
+	z->rmax[1] = z->rmax[1] < l_pac<<1? z->rmax[1] : l_pac<<1;
+	if (z->rmax[0] < l_pac && l_pac < z->rmax[1]) { // crossing the forward-reverse boundary; then choose one side
+		if (c->seeds[0].rbeg < l_pac) z->rmax[1] = l_pac; // this works because all seeds are guaranteed to be on the same strand
+		else z->rmax[0] = l_pac;
 	}
 	// retrieve the reference sequence
-	rseq = bns_get_seq(l_pac, pac, rmax[0], rmax[1], &rlen);
-	assert(rlen == rmax[1] - rmax[0]);
+	z->rseq = bns_get_seq2(sc, l_pac, pac, z->rmax[0], z->rmax[1], &rlen);
+	assert(rlen == z->rmax[1] - z->rmax[0]);
 
-	srt = malloc(c->n * 8);
+	z->srt = malloc(c->n * 8);
 	for (i = 0; i < c->n; ++i)
-		srt[i] = (uint64_t)c->seeds[i].len<<32 | i;
-	ks_introsort_64(c->n, srt);
-
-	for (k = c->n - 1; k >= 0; --k) {
-		mem_alnreg_t *a;
-		s = &c->seeds[(uint32_t)srt[k]];
-
-		for (i = 0; i < av->n; ++i) { // test whether extension has been made before
-			mem_alnreg_t *p = &av->a[i];
-			int64_t rd;
-			int qd, w, max_gap;
-			if (s->rbeg < p->rb || s->rbeg + s->len > p->re || s->qbeg < p->qb || s->qbeg + s->len > p->qe) continue; // not fully contained
-			// qd: distance ahead of the seed on query; rd: on reference
-			qd = s->qbeg - p->qb; rd = s->rbeg - p->rb;
-			max_gap = cal_max_gap(opt, qd < rd? qd : rd); // the maximal gap allowed in regions ahead of the seed
-			w = max_gap < opt->w? max_gap : opt->w; // bounded by the band width
-			if (qd - rd < w && rd - qd < w) break; // the seed is "around" a previous hit
-			// similar to the previous four lines, but this time we look at the region behind
-			qd = p->qe - (s->qbeg + s->len); rd = p->re - (s->rbeg + s->len);
-			max_gap = cal_max_gap(opt, qd < rd? qd : rd);
-			w = max_gap < opt->w? max_gap : opt->w;
-			if (qd - rd < w && rd - qd < w) break;
+		z->srt[i] = (uint64_t)c->seeds[i].len<<32 | i;
+	ks_introsort_64(c->n, z->srt);
+}
+
+static int mem_c2a_skip_seed(mem_c2a_t *z, const mem_seed_t *s) // test whether extension has been made before
+{
+	const mem_opt_t *opt = z->opt;
+	const mem_chain_t *c = z->c;
+	const mem_alnreg_v *av = z->av;
+	mem_regidx_t *ri = z->ri;
+	int k = z->k;
+	size_t i, end;
+	for (i = ri->n; i < av->n; ++i) { // index regions added since the last call; they are all finished
+		const mem_alnreg_t *p = &av->a[i];
+		mem_itree_insert(ri, p->rb, p->re, i);
+	}
+	mem_itree_overlap(ri, s->rbeg, s->rbeg + s->len, &z->hit);
+	for (i = 0, end = z->hit.n; i < end; ++i) { // regions overlapping the seed may contain it
+		const mem_alnreg_t *p = &av->a[z->hit.a[i]];
+		int64_t rd;
+		int qd, w, max_gap;
+		if (s->rbeg < p->rb || s->rbeg + s->len > p->re || s->qbeg < p->qb || s->qbeg + s->len > p->qe) continue; // not fully contained
+		// qd: distance ahead of the seed on query; rd: on reference
+		qd = s->qbeg - p->qb; rd = s->rbeg - p->rb;
+		max_gap = cal_max_gap(opt, qd < rd? qd : rd); // the maximal gap allowed in regions ahead of the seed
+		w = max_gap < opt->w? max_gap : opt->w; // bounded by the band width
+		if (qd - rd < w && rd - qd < w) break; // the seed is "around" a previous hit
+		// similar to the previous four lines, but this time we look at the region behind
+		qd = p->qe - (s->qbeg + s->len); rd = p->re - (s->rbeg + s->len);
+		max_gap = cal_max_gap(opt, qd < rd? qd : rd);
+		w = max_gap < opt->w? max_gap : opt->w;
+		if (qd - rd < w && rd - qd < w) break;
+	}
+	if (i == end) return 0;
+	// the seed is (almost) contained in an existing alignment; further testing is needed to confirm it is not leading to a different aln
+	if (bwa_verbose >= 4)
+		printf("** Seed(%d) [%ld;%ld,%ld] is almost contained in an existing alignment. Confirming whether extension is needed...\n", k, (long)s->len, (long)s->qbeg, (long)s->rbeg);
+	mem_itree_overlap(&z->es, s->qbeg, s->qbeg + s->len, &z->hit);
+	for (i = 0, end = z->hit.n; i < end; ++i) { // check seeds extended before in the same chain that may overlap with s
+		const mem_seed_t *t = &c->seeds[z->hit.a[i]];
+		if (t->len < s->len * .95) continue; // only check overlapping if t is long enough
+		if (s->qbeg <= t->qbeg && s->qbeg + s->len - t->qbeg >= s->len>>2 && t->qbeg - s->qbeg != t->rbeg - s->rbeg) break;
+		if (t->qbeg <= s->qbeg && t->qbeg + t->len - s->qbeg >= s->len>>2 && s->qbeg - t->qbeg != s->rbeg - t->rbeg) break;
+	}
+	if (i == end) return 1; // no overlapping seeds; then skip extension
+	if (bwa_verbose >= 4)
+		printf("** Seed(%d) might lead to a different alignment even though it is contained. Extension will be performed.\n", k);
+	return 0;
+}
+
+static void mem_c2a_set_job(mem_c2a_t *z, int is_right, ksw_ext_t *e)
+{
+	const mem_opt_t *opt = z->opt;
+	const mem_seed_t *s = &z->c->seeds[(uint32_t)z->srt[z->k]];
+	if (z->i == 0) z->ck.set = 0; // a new extension
+	e->tb = !!(opt->flag & MEM_F_EXT_CIGAR), e->z = 0;
+	e->ck = e->tb? 0 : &z->ck;
+	if (!is_right) {
+		e->qlen = s->qbeg, e->query = z->qs;
+		e->tlen = s->rbeg - z->rmax[0], e->target = z->rs;
+		e->w = z->aw[0] = opt->w << z->i;
+		e->end_bonus = opt->pen_clip5, e->h0 = s->len * opt->a;
+	} else {
+		int qe = s->qbeg + s->len, re = s->rbeg + s->len - z->rmax[0];
+		e->qlen = z->l_query - qe, e->query = z->query + qe;
+		e->tlen = z->rmax[1] - z->rmax[0] - re, e->target = z->rseq + re;
+		e->w = z->aw[1] = opt->w << z->i;
+		e->end_bonus = opt->pen_clip3, e->h0 = z->sc0;
+	}
+	if (bwa_verbose >= 4) {
+		int j;
+		printf("*** %s ref:   ", is_right? "Right" : "Left"); for (j = 0; j < e->tlen; ++j) putchar("ACGTN"[(int)e->target[j]]); putchar('\n');
+		printf("*** %s query: ", is_right? "Right" : "Left"); for (j = 0; j < e->qlen; ++j) putchar("ACGTN"[(int)e->query[j]]); putchar('\n');
+	}
+}
+
+static void mem_c2a_backtrack(mem_c2a_t *z, int is_right, ksw_ext_t *e, int to_end)
+{
+	if (e->z == 0) return;
+	z->cigar[is_right] = ksw_extend_cigar(e->qlen, e->zw, e->z, (to_end? e->gtle : e->tle) - 1, to_end? e->qlen - 1 : e->qle - 1, &z->n_cigar[is_right]);
+	free(e->z); e->z = 0;
+}
+
+static void mem_c2a_set_cigar(mem_c2a_t *z, const mem_seed_t *s, mem_alnreg_t *a) // left CIGAR in reverse + seed + right CIGAR
+{
+	int i, n = 0;
+	uint32_t *c;
+	if (!(z->opt->flag & MEM_F_EXT_CIGAR)) return;
+	c = malloc((z->n_cigar[0] + z->n_cigar[1] + 1) * 4);
+	for (i = z->n_cigar[0] - 1; i >= 0; --i) c[n++] = z->cigar[0][i];
+	if (n && (c[n-1]&0xf) == 0) c[n-1] += s->len<<4;
+	else c[n++] = s->len<<4;
+	for (i = 0; i < z->n_cigar[1]; ++i) {
+		if ((c[n-1]&0xf) == (z->cigar[1][i]&0xf)) c[n-1] += z->cigar[1][i]>>4<<4;
+		else c[n++] = z->cigar[1][i];
+	}
+	a->n_cigar = n, a->cigar = c;
+	free(z->cigar[0]); free(z->cigar[1]);
+	z->cigar[0] = z->cigar[1] = 0, z->n_cigar[0] = z->n_cigar[1] = 0;
+}
+
+static int mem_c2a_next(mem_c2a_t *z, ksw_ext_t *e)
+{
+	const mem_opt_t *opt = z->opt;
+	const mem_chain_t *c = z->c;
+	const mem_seed_t *s;
+	mem_alnreg_t *a;
+	int i;
+
+	if (c->n == 0) return 0;
+	for (;;) {
+		if (z->k < 0) { // all seeds have been processed
+			free(z->srt); free(z->rseq); free(z->ck.eh); free(z->es.a); free(z->hit.a);
+			z->srt = 0, z->rseq = 0, z->es.a = 0, z->hit.a = 0;
+			memset(&z->ck, 0, sizeof(ksw_extck_t));
+			return 0;
 		}
-		if (i < av->n) { // the seed is (almost) contained in an existing alignment; further testing is needed to confirm it is not leading to a different aln
-			if (bwa_verbose >= 4)
-				printf("** Seed(%d) [%ld;%ld,%ld] is almost contained in an existing alignment. Confirming whether extension is needed...\n", k, (long)s->len, (long)s->qbeg, (long)s->rbeg);
-			for (i = k + 1; i < c->n; ++i) { // check overlapping seeds in the same chain
-				const mem_seed_t *t;
-				if (srt[i] == 0) continue;
-				t = &c->seeds[(uint32_t)srt[i]];
-				if (t->len < s->len * .95) continue; // only check overlapping if t is long enough; TODO: more efficient by early stopping
-				if (s->qbeg <= t->qbeg && s->qbeg + s->len - t->qbeg >= s->len>>2 && t->qbeg - s->qbeg != t->rbeg - s->rbeg) break;
-				if (t->qbeg <= s->qbeg && t->qbeg + t->len - s->qbeg >= s->len>>2 && s->qbeg - t->qbeg != s->rbeg - t->rbeg) break;
-			}
-			if (i == c->n) { // no overlapping seeds; then skip extension
-				srt[k] = 0; // mark that seed extension has not been performed
+		s = &c->seeds[(uint32_t)z->srt[z->k]];
+		a = z->state == C2A_SEED? 0 : &z->av->a[z->ia];
+		if (z->state == C2A_SEED) {
+			if (mem_c2a_skip_seed(z, s)) {
+				z->srt[z->k--] = 0; // mark that seed extension has not been performed
 				continue;
 			}
-			if (bwa_verbose >= 4)
-				printf("** Seed(%d) might lead to a different alignment even though it is contained. Extension will be performed.\n", k);
-		}
-
-		a = kv_pushp(mem_alnreg_t, *av);
-		memset(a, 0, sizeof(mem_alnreg_t));
-		a->w = aw[0] = aw[1] = opt->w;
-		a->score = a->truesc = -1;
-
-		if (bwa_verbose >= 4) err_printf("** ---> Extending from seed(%d) [%ld;%ld,%ld] <---\n", k, (long)s->len, (long)s->qbeg, (long)s->rbeg);
-		if (s->qbeg) { // left extension
-			uint8_t *rs, *qs;
-			int qle, tle, gtle, gscore;
-			qs = malloc(s->qbeg);
-			for (i = 0; i < s->qbeg; ++i) qs[i] = query[s->qbeg - 1 - i];
-			tmp = s->rbeg - rmax[0];
-			rs = malloc(tmp);
-			for (i = 0; i < tmp; ++i) rs[i] = rseq[tmp - 1 - i];
-			for (i = 0; i < MAX_BAND_TRY; ++i) {
-				int prev = a->score;
-				aw[0] = opt->w << i;
-				if (bwa_verbose >= 4) {
-					int j;
-					printf("*** Left ref:   "); for (j = 0; j < tmp; ++j) putchar("ACGTN"[(int)rs[j]]); putchar('\n');
-					printf("*** Left query: "); for (j = 0; j < s->qbeg; ++j) putchar("ACGTN"[(int)qs[j]]); putchar('\n');
-				}
-				a->score = ksw_extend(s->qbeg, qs, tmp, rs, 5, opt->mat, opt->q, opt->r, aw[0], opt->pen_clip5, opt->zdrop, s->len * opt->a, &qle, &tle, &gtle, &gscore, &max_off[0]);
-				if (bwa_verbose >= 4) { printf("*** Left extension: prev_score=%d; score=%d; bandwidth=%d; max_off_diagonal_dist=%d\n", prev, a->score, aw[0], max_off[0]); fflush(stdout); }
-				if (a->score == prev || max_off[0] < (aw[0]>>1) + (aw[0]>>2)) break;
+			mem_itree_insert(&z->es, s->qbeg, s->qbeg + s->len, (uint32_t)z->srt[z->k]);
+			z->ia = z->av->n;
+			a = kv_pushp(mem_alnreg_t, *z->av);
+			memset(a, 0, sizeof(mem_alnreg_t));
+			a->w = z->aw[0] = z->aw[1] = opt->w;
+			a->score = a->truesc = -1;
+			if (bwa_verbose >= 4) err_printf("** ---> Extending from seed(%d) [%ld;%ld,%ld] <---\n", z->k, (long)s->len, (long)s->qbeg, (long)s->rbeg);
+			if (s->qbeg) { // left extension
+				int64_t tmp = s->rbeg - z->rmax[0];
+				z->qs = malloc(s->qbeg);
+				for (i = 0; i < s->qbeg; ++i) z->qs[i] = z->query[s->qbeg - 1 - i];
+				z->rs = malloc(tmp);
+				for (i = 0; i < tmp; ++i) z->rs[i] = z->rseq[tmp - 1 - i];
+				z->i = 0, z->state = C2A_LEFT;
+				mem_c2a_set_job(z, 0, e);
+				return 1;
+			} else a->score = a->truesc = s->len * opt->a, a->qb = 0, a->rb = s->rbeg;
+			z->state = C2A_RIGHT_BEG;
+		} else if (z->state == C2A_LEFT) { // a left extension has been solved
+			int prev = a->score;
+			a->score = e->score;
+			if (bwa_verbose >= 4) { printf("*** Left extension: prev_score=%d; score=%d; bandwidth=%d; max_off_diagonal_dist=%d\n", prev, a->score, z->aw[0], e->max_off); fflush(stdout); }
+			if (a->score != prev && e->max_off >= (z->aw[0]>>1) + (z->aw[0]>>2) && ++z->i < MAX_BAND_TRY) { // try a larger band
+				free(e->z);
+				mem_c2a_set_job(z, 0, e);
+				return 1;
 			}
 			// check whether we prefer to reach the end of the query
-			if (gscore <= 0 || gscore <= a->score - opt->pen_clip5) { // local extension
-				a->qb = s->qbeg - qle, a->rb = s->rbeg - tle;
+			if (e->gscore <= 0 || e->gscore <= a->score - opt->pen_clip5) { // local extension
+				a->qb = s->qbeg - e->qle, a->rb = s->rbeg - e->tle;
 				a->truesc = a->score;
+				mem_c2a_backtrack(z, 0, e, 0);
 			} else { // to-end extension
-				a->qb = 0, a->rb = s->rbeg - gtle;
-				a->truesc = gscore;
+				a->qb = 0, a->rb = s->rbeg - e->gtle;
+				a->truesc = e->gscore;
+				mem_c2a_backtrack(z, 0, e, 1);
 			}
-			free(qs); free(rs);
-		} else a->score = a->truesc = s->len * opt->a, a->qb = 0, a->rb = s->rbeg;
-
-		if (s->qbeg + s->len != l_query) { // right extension
-			int qle, tle, qe, re, gtle, gscore, sc0 = a->score;
-			qe = s->qbeg + s->len;
-			re = s->rbeg + s->len - rmax[0];
-			assert(re >= 0);
-			for (i = 0; i < MAX_BAND_TRY; ++i) {
-				int prev = a->score;
-				aw[1] = opt->w << i;
-				if (bwa_verbose >= 4) {
-					int j;
-					printf("*** Right ref:   "); for (j = 0; j < rmax[1] - rmax[0] - re; ++j) putchar("ACGTN"[(int)rseq[re+j]]); putchar('\n');
-					printf("*** Right query: "); for (j = 0; j < l_query - qe; ++j) putchar("ACGTN"[(int)query[qe+j]]); putchar('\n');
-				}
-				a->score = ksw_extend(l_query - qe, query + qe, rmax[1] - rmax[0] - re, rseq + re, 5, opt->mat, opt->q, opt->r, aw[1], opt->pen_clip3, opt->zdrop, sc0, &qle, &tle, &gtle, &gscore, &max_off[1]);
-				if (bwa_verbose >= 4) { printf("*** Right extension: prev_score=%d; score=%d; bandwidth=%d; max_off_diagonal_dist=%d\n", prev, a->score, aw[1], max_off[1]); fflush(stdout); }
-				if (a->score == prev || max_off[1] < (aw[1]>>1) + (aw[1]>>2)) break;
+			free(z->qs); free(z->rs);
+			z->qs = z->rs = 0;
+			z->state = C2A_RIGHT_BEG;
+		} else if (z->state == C2A_RIGHT_BEG) {
+			if (s->qbeg + s->len != z->l_query) { // right extension
+				z->sc0 = a->score;
+				z->i = 0, z->state = C2A_RIGHT;
+				mem_c2a_set_job(z, 1, e);
+				return 1;
+			} else a->qe = z->l_query, a->re = s->rbeg + s->len;
+			z->state = C2A_SEED_END;
+		} else if (z->state == C2A_RIGHT) { // a right extension has been solved
+			int prev = a->score, qe = s->qbeg + s->len;
+			int64_t re = s->rbeg + s->len - z->rmax[0];
+			a->score = e->score;
+			if (bwa_verbose >= 4) { printf("*** Right extension: prev_score=%d; score=%d; bandwidth=%d; max_off_diagonal_dist=%d\n", prev, a->score, z->aw[1], e->max_off); fflush(stdout); }
+			if (a->score != prev && e->max_off >= (z->aw[1]>>1) + (z->aw[1]>>2) && ++z->i < MAX_BAND_TRY) {
+				free(e->z);
+				mem_c2a_set_job(z, 1, e);
+				return 1;
 			}
 			// similar to the above
-			if (gscore <= 0 || gscore <= a->score - opt->pen_clip3) { // local extension
-				a->qe = qe + qle, a->re = rmax[0] + re + tle;
-				a->truesc += a->score - sc0;
+			if (e->gscore <= 0 || e->gscore <= a->score - opt->pen_clip3) { // local extension
+				a->qe = qe + e->qle, a->re = z->rmax[0] + re + e->tle;
+				a->truesc += a->score - z->sc0;
+				mem_c2a_backtrack(z, 1, e, 0);
 			} else { // to-end extension
-				a->qe = l_query, a->re = rmax[0] + re + gtle;
-				a->truesc += gscore - sc0;
+				a->qe = z->l_query, a->re = z->rmax[0] + re + e->gtle;
+				a->truesc += e->gscore - z->sc0;
+				mem_c2a_backtrack(z, 1, e, 1);
+			}
+			z->state = C2A_SEED_END;
+		} else if (z->state == C2A_SEED_END) {
+			if (bwa_verbose >= 4) printf("*** Added alignment region: [%d,%d) <=> [%ld,%ld); score=%d; {left,right}_bandwidth={%d,%d}\n", a->qb, a->qe, (long)a->rb, (long)a->re, a->score, z->aw[0], z->aw[1]);
+			// compute seedcov
+			for (i = 0, a->seedcov = 0; i < c->n; ++i) {
+				const mem_seed_t *t = &c->seeds[i];
+				if (t->qbeg >= a->qb && t->qbeg + t->len <= a->qe && t->rbeg >= a->rb && t->rbeg + t->len <= a->re) // seed fully contained
+					a->seedcov += t->len; // this is not very accurate, but for approx. mapQ, this is good enough
 			}
-		} else a->qe = l_query, a->re = s->rbeg + s->len;
-		if (bwa_verbose >= 4) printf("*** Added alignment region: [%d,%d) <=> [%ld,%ld); score=%d; {left,right}_bandwidth={%d,%d}\n", a->qb, a->qe, (long)a->rb, (long)a->re, a->score, aw[0], aw[1]);
-
-		// compute seedcov
-		for (i = 0, a->seedcov = 0; i < c->n; ++i) {
-			const mem_seed_t *t = &c->seeds[i];
-			if (t->qbeg >= a->qb && t->qbeg + t->len <= a->qe && t->rbeg >= a->rb && t->rbeg + t->len <= a->re) // seed fully contained
-				a->seedcov += t->len; // this is not very accurate, but for approx. mapQ, this is good enough
+			a->w = z->aw[0] > z->aw[1]? z->aw[0] : z->aw[1];
+			mem_c2a_set_cigar(z, s, a);
+			--z->k, z->state = C2A_SEED;
 		}
-		a->w = aw[0] > aw[1]? aw[0] : aw[1];
 	}
-	free(srt); free(rseq);
+}
+
+/* Exact full-length hits
+ *
+ * If the only chain consists of one seed covering the entire query, the seed
+ * is a unique SMEM and no other MEM is long and frequent enough to be a seed
+ * after reseeding. mem_chain2aln_short() always rejects such a chain and
+ * mem_chain2aln() would produce one hit without extension. We add this hit
+ * directly.
+ */
+
+static int mem_chain_exact(const mem_opt_t *opt, int l_query, mem_chain_v *chn, mem_alnreg_v *av)
+{
+	const mem_seed_t *s;
+	mem_alnreg_t *a;
+	if (chn->n != 1 || chn->a[0].n != 1) return 0;
+	s = &chn->a[0].seeds[0];
+	if (s->qbeg != 0 || s->len != l_query) return 0;
+	a = kv_pushp(mem_alnreg_t, *av);
+	memset(a, 0, sizeof(mem_alnreg_t));
+	a->qb = 0, a->qe = l_query, a->rb = s->rbeg, a->re = s->rbeg + s->len;
+	a->score = a->truesc = s->len * opt->a;
+	a->seedcov = s->len, a->w = opt->w;
+	if (opt->flag & MEM_F_EXT_CIGAR) {
+		a->n_cigar = 1, a->cigar = malloc(4);
+		a->cigar[0] = s->len<<4;
+	}
+	if (bwa_verbose >= 4) printf("** Added exact alignment region: [%d,%d) <=> [%ld,%ld)\n", a->qb, a->qe, (long)a->rb, (long)a->re);
+	free(chn->a[0].seeds);
+	chn->n = 0;
+	return 1;
 }
 
 /*****************************
@@ -703,13 +1111,8 @@ static inline int get_rlen(int n_cigar, const uint32_t *cigar)
 	return l;
 }
 
-void mem_aln2sam(const bntseq_t *bns, kstring_t *str, bseq1_t *s, int n, const mem_aln_t *list, int which, const mem_aln_t *m_)
-{
-	int i;
-	mem_aln_t ptmp = list[which], *p = &ptmp, mtmp, *m = 0; // make a copy of the alignment to convert
-
-	if (m_) mtmp = *m_, m = &mtmp;
-	// set flag
+static void mem_aln_setflag(mem_aln_t *p, mem_aln_t *m)
+{ // set the SAM flag; an unmapped end takes the position of its mapped mate
 	p->flag |= m? 0x1 : 0; // is paired in sequencing
 	p->flag |= p->rid < 0? 0x4 : 0; // is mapped
 	p->flag |= m && m->rid < 0? 0x8 : 0; // is mate mapped
@@ -719,6 +1122,52 @@ void mem_aln2sam(const bntseq_t *bns, kstring_t *str, bseq1_t *s, int n, const m
 		m->rid = p->rid, m->pos = p->pos, m->is_rev = p->is_rev, m->n_cigar = 0;
 	p->flag |= p->is_rev? 0x10 : 0; // is on the reverse strand
 	p->flag |= m && m->is_rev? 0x20 : 0; // is mate on the reverse strand
+}
+
+static inline int64_t mem_aln_tlen(const mem_aln_t *p, const mem_aln_t *m)
+{
+	int64_t p0 = p->pos + (p->is_rev? get_rlen(p->n_cigar, p->cigar) - 1 : 0);
+	int64_t p1 = m->pos + (m->is_rev? get_rlen(m->n_cigar, m->cigar) - 1 : 0);
+	if (m->n_cigar == 0 || p->n_cigar == 0) return 0;
+	return -(p0 - p1 + (p0 > p1? 1 : p0 < p1? -1 : 0));
+}
+
+static inline void mem_aln_qrange(const mem_aln_t *p, int which, int l_seq, int *qb, int *qe)
+{ // the part of the query in SEQ, which excludes hard clips of supplementary alignments; on the original strand of the query
+	*qb = 0, *qe = l_seq;
+	if (p->n_cigar && which) {
+		int c0 = p->cigar[0]&0xf, c1 = p->cigar[p->n_cigar-1]&0xf;
+		int l0 = c0 == 3 || c0 == 4? p->cigar[0]>>4 : 0, l1 = c1 == 3 || c1 == 4? p->cigar[p->n_cigar-1]>>4 : 0;
+		if (!p->is_rev) *qb += l0, *qe -= l1;
+		else *qe -= l0, *qb += l1;
+	}
+}
+
+static void mem_aln2sa(const bntseq_t *bns, kstring_t *str, int n, const mem_aln_t *list, int which)
+{ // the SA tag value listing the other primary hits; empty if there are none
+	int i, k;
+	for (i = 0; i < n; ++i) {
+		const mem_aln_t *r = &list[i];
+		if (i == which || (list[i].flag&0x100)) continue; // proceed if: 1) different from the current; 2) not shadowed multi hit
+		kputs(bns->anns[r->rid].name, str); kputc(',', str);
+		kputl(r->pos+1, str); kputc(',', str);
+		kputc("+-"[r->is_rev], str); kputc(',', str);
+		for (k = 0; k < r->n_cigar; ++k) {
+			kputw(r->cigar[k]>>4, str); kputc("MIDSH"[r->cigar[k]&0xf], str);
+		}
+		kputc(',', str); kputw(r->mapq, str);
+		kputc(',', str); kputw(r->NM, str);
+		kputc(';', str);
+	}
+}
+
+void mem_aln2sam(const bntseq_t *bns, kstring_t *str, bseq1_t *s, int n, const mem_aln_t *list, int which, const mem_aln_t *m_)
+{
+	int i;
+	mem_aln_t ptmp = list[which], *p = &ptmp, mtmp, *m = 0; // make a copy of the alignment to convert
+
+	if (m_) mtmp = *m_, m = &mtmp;
+	mem_aln_setflag(p, m);
 
 	// print up to CIGAR
 	kputs(s->name, str); kputc('\t', str); // QNAME
@@ -743,44 +1192,27 @@ void mem_aln2sam(const bntseq_t *bns, kstring_t *str, bseq1_t *s, int n, const m
 		else kputs(bns->anns[m->rid].name, str);
 		kputc('\t', str);
 		kputl(m->pos + 1, str); kputc('\t', str);
-		if (p->rid == m->rid) {
-			int64_t p0 = p->pos + (p->is_rev? get_rlen(p->n_cigar, p->cigar) - 1 : 0);
-			int64_t p1 = m->pos + (m->is_rev? get_rlen(m->n_cigar, m->cigar) - 1 : 0);
-			if (m->n_cigar == 0 || p->n_cigar == 0) kputc('0', str);
-			else kputl(-(p0 - p1 + (p0 > p1? 1 : p0 < p1? -1 : 0)), str);
-		} else kputc('0', str);
+		if (p->rid == m->rid) kputl(mem_aln_tlen(p, m), str);
+		else kputc('0', str);
 	} else kputsn("*\t0\t0", 5, str);
 	kputc('\t', str);
 
 	// print SEQ and QUAL
 	if (p->flag & 0x100) { // for secondary alignments, don't write SEQ and QUAL
 		kputsn("*\t*", 3, str);
-	} else if (!p->is_rev) { // the forward strand
-		int i, qb = 0, qe = s->l_seq;
-		if (p->n_cigar) {
-			if (which && ((p->cigar[0]&0xf) == 4 || (p->cigar[0]&0xf) == 3)) qb += p->cigar[0]>>4;
-			if (which && ((p->cigar[p->n_cigar-1]&0xf) == 4 || (p->cigar[p->n_cigar-1]&0xf) == 3)) qe -= p->cigar[p->n_cigar-1]>>4;
-		}
-		ks_resize(str, str->l + (qe - qb) + 1);
-		for (i = qb; i < qe; ++i) str->s[str->l++] = "ACGTN"[(int)s->seq[i]];
-		kputc('\t', str);
-		if (s->qual) { // printf qual
-			ks_resize(str, str->l + (qe - qb) + 1);
-			for (i = qb; i < qe; ++i) str->s[str->l++] = s->qual[i];
-			str->s[str->l] = 0;
-		} else kputc('*', str);
-	} else { // the reverse strand
-		int i, qb = 0, qe = s->l_seq;
-		if (p->n_cigar) {
-			if (which && ((p->cigar[0]&0xf) == 4 || (p->cigar[0]&0xf) == 3)) qe -= p->cigar[0]>>4;
-			if (which && ((p->cigar[p->n_cigar-1]&0xf) == 4 || (p->cigar[p->n_cigar-1]&0xf) == 3)) qb += p->cigar[p->n_cigar-1]>>4;
-		}
+	} else {
+		int qb, qe;
+		mem_aln_qrange(p, which, s->l_seq, &qb, &qe);
 		ks_resize(str, str->l + (qe - qb) + 1);
-		for (i = qe-1; i >= qb; --i) str->s[str->l++] = "TGCAN"[(int)s->seq[i]];
+		if (!p->is_rev) // the forward strand
+			for (i = qb; i < qe; ++i) str->s[str->l++] = "ACGTN"[(int)s->seq[i]];
+		else for (i = qe-1; i >= qb; --i) str->s[str->l++] = "TGCAN"[(int)s->seq[i]]; // the reverse strand
 		kputc('\t', str);
 		if (s->qual) { // printf qual
 			ks_resize(str, str->l + (qe - qb) + 1);
-			for (i = qe-1; i >= qb; --i) str->s[str->l++] = s->qual[i];
+			if (!p->is_rev)
+				for (i = qb; i < qe; ++i) str->s[str->l++] = s->qual[i];
+			else for (i = qe-1; i >= qb; --i) str->s[str->l++] = s->qual[i];
 			str->s[str->l] = 0;
 		} else kputc('*', str);
 	}
@@ -798,26 +1230,180 @@ void mem_aln2sam(const bntseq_t *bns, kstring_t *str, bseq1_t *s, int n, const m
 			if (i != which && !(list[i].flag&0x100)) break;
 		if (i < n) { // there are other primary hits; output them
 			kputsn("\tSA:Z:", 6, str);
-			for (i = 0; i < n; ++i) {
-				const mem_aln_t *r = &list[i];
-				int k;
-				if (i == which || (list[i].flag&0x100)) continue; // proceed if: 1) different from the current; 2) not shadowed multi hit
-				kputs(bns->anns[r->rid].name, str); kputc(',', str);
-				kputl(r->pos+1, str); kputc(',', str);
-				kputc("+-"[r->is_rev], str); kputc(',', str);
-				for (k = 0; k < r->n_cigar; ++k) {
-					kputw(r->cigar[k]>>4, str); kputc("MIDSH"[r->cigar[k]&0xf], str);
-				}
-				kputc(',', str); kputw(r->mapq, str);
-				kputc(',', str); kputw(r->NM, str);
-				kputc(';', str);
-			}
+			mem_aln2sa(bns, str, n, list, which);
 		}
 	}
 	if (s->comment) { kputc('\t', str); kputs(s->comment, str); }
 	kputc('\n', str);
 }
 
+/* BAM output
+ *
+ * mem_aln2bam() writes the same record as mem_aln2sam() in the binary BAM
+ * encoding, such that the output can be compressed directly without being
+ * parsed again. Integers are written in the host byte order, which is
+ * little-endian on all platforms BWA-MEM runs on (it requires SSE2).
+ */
+
+static inline void kput_u32(uint32_t x, kstring_t *s) { kputsn((char*)&x, 4, s); }
+static inline void kput_u16(uint16_t x, kstring_t *s) { kputsn((char*)&x, 2, s); }
+
+static inline int mem_reg2bin(int64_t beg, int64_t end)
+{ // the BAI bin of [beg,end), as in the SAM spec
+	--end;
+	if (beg>>14 == end>>14) return ((1<<15)-1)/7 + (beg>>14);
+	if (beg>>17 == end>>17) return ((1<<12)-1)/7 + (beg>>17);
+	if (beg>>20 == end>>20) return ((1<<9)-1)/7  + (beg>>20);
+	if (beg>>23 == end>>23) return ((1<<6)-1)/7  + (beg>>23);
+	if (beg>>26 == end>>26) return ((1<<3)-1)/7  + (beg>>26);
+	return 0;
+}
+
+static void mem_put_tag_int(const char *tag, int64_t x, kstring_t *s)
+{ // the smallest integer type holding $x
+	kputsn(tag, 2, s);
+	if (x >= 0) {
+		if (x <= 0xff) { kputc('C', s); kputc(x, s); }
+		else if (x <= 0xffff) { kputc('S', s); kput_u16(x, s); }
+		else { kputc('I', s); kput_u32(x, s); }
+	} else {
+		if (x >= -0x80) { kputc('c', s); kputc((int8_t)x, s); }
+		else if (x >= -0x8000) { kputc('s', s); kput_u16((int16_t)x, s); }
+		else { kputc('i', s); kput_u32((int32_t)x, s); }
+	}
+}
+
+static inline void mem_put_tag_str(const char *tag, int type, const char *str, int len, kstring_t *s)
+{
+	kputsn(tag, 2, s); kputc(type, s); kputsn(str, len, s); kputc(0, s);
+}
+
+static void mem_comment2bam(const char *comment, kstring_t *s)
+{ // convert SAM tags in the FASTA/FASTQ comment; other fields are dropped
+	const char *p, *q;
+	for (p = comment; *p; p = *q? q + 1 : q) {
+		for (q = p; *q && *q != '\t'; ++q);
+		if (q - p < 5 || p[2] != ':' || p[4] != ':') continue;
+		if (p[3] == 'A' && q - p == 6) {
+			kputsn(p, 2, s); kputc('A', s); kputc(p[5], s);
+		} else if (p[3] == 'i') {
+			mem_put_tag_int(p, strtol(p + 5, 0, 10), s);
+		} else if (p[3] == 'f') {
+			float f = strtod(p + 5, 0);
+			kputsn(p, 2, s); kputc('f', s); kputsn((char*)&f, 4, s);
+		} else if (p[3] == 'Z' || p[3] == 'H') {
+			mem_put_tag_str(p, p[3], p + 5, q - p - 5, s);
+		}
+	}
+}
+
+void mem_aln2bam(const bntseq_t *bns, kstring_t *str, bseq1_t *s, int n, const mem_aln_t *list, int which, const mem_aln_t *m_)
+{
+	static const uint8_t nt16[2][5] = { {1, 2, 4, 8, 15}, {8, 4, 2, 1, 15} }; // ACGTN and its complement in the BAM 4-bit encoding
+	int i, l_name, l_seq = 0, qb = 0, qe = 0;
+	size_t beg = str->l;
+	int64_t end;
+	mem_aln_t ptmp = list[which], *p = &ptmp, mtmp, *m = 0;
+
+	if (m_) mtmp = *m_, m = &mtmp;
+	mem_aln_setflag(p, m);
+	if (!(p->flag & 0x100)) {
+		mem_aln_qrange(p, which, s->l_seq, &qb, &qe);
+		l_seq = qe - qb;
+	}
+	l_name = strlen(s->name) + 1;
+	end = p->rid >= 0? p->pos + (p->n_cigar? get_rlen(p->n_cigar, p->cigar) : 1) : 0;
+	kput_u32(0, str); // block_size; filled in the end
+	kput_u32(p->rid, str);
+	kput_u32(p->rid >= 0? p->pos : -1, str);
+	kputc(l_name, str);
+	kputc(p->rid >= 0? p->mapq : 0, str);
+	kput_u16(mem_reg2bin(p->rid >= 0? p->pos : -1, p->rid >= 0? end : 0), str);
+	kput_u16(p->rid >= 0? p->n_cigar : 0, str);
+	kput_u16((p->flag&0xffff) | (p->flag&0x10000? 0x100 : 0), str);
+	kput_u32(l_seq, str);
+	kput_u32(m && m->rid >= 0? m->rid : -1, str);
+	kput_u32(m && m->rid >= 0? m->pos : -1, str);
+	kput_u32(m && m->rid >= 0 && p->rid == m->rid? mem_aln_tlen(p, m) : 0, str);
+	kputsn(s->name, l_name, str);
+	if (p->rid >= 0)
+		for (i = 0; i < p->n_cigar; ++i) {
+			static const uint8_t op[5] = { 0, 1, 2, 4, 5 }; // MIDSH
+			int c = p->cigar[i]&0xf;
+			if (c == 3 || c == 4) c = which? 4 : 3; // use hard clipping for supplementary alignments
+			kput_u32((p->cigar[i]>>4)<<4 | op[c], str);
+		}
+	if (l_seq > 0) {
+		const uint8_t *t = nt16[p->is_rev];
+		ks_resize(str, str->l + ((l_seq + 1) >> 1) + l_seq + 1);
+		memset(str->s + str->l, 0, (l_seq + 1) >> 1);
+		for (i = 0; i < l_seq; ++i) {
+			int c = p->is_rev? s->seq[qe - 1 - i] : s->seq[qb + i];
+			str->s[str->l + (i>>1)] |= t[c < 4? c : 4] << ((~i&1)<<2);
+		}
+		str->l += (l_seq + 1) >> 1;
+		for (i = 0; i < l_seq; ++i)
+			str->s[str->l + i] = s->qual? (p->is_rev? s->qual[qe - 1 - i] : s->qual[qb + i]) - 33 : 0xff;
+		str->l += l_seq;
+	}
+	if (p->n_cigar) {
+		mem_put_tag_int("NM", p->NM, str);
+		mem_put_tag_str("MD", 'Z', (char*)(p->cigar + p->n_cigar), strlen((char*)(p->cigar + p->n_cigar)), str);
+	}
+	if (p->score >= 0) mem_put_tag_int("AS", p->score, str);
+	if (p->sub >= 0) mem_put_tag_int("XS", p->sub, str);
+	if (bwa_rg_id[0]) mem_put_tag_str("RG", 'Z', bwa_rg_id, strlen(bwa_rg_id), str);
+	if (!(p->flag & 0x100)) {
+		for (i = 0; i < n; ++i)
+			if (i != which && !(list[i].flag&0x100)) break;
+		if (i < n) {
+			kputsn("SAZ", 3, str);
+			mem_aln2sa(bns, str, n, list, which);
+			kputc(0, str);
+		}
+	}
+	if (s->comment) mem_comment2bam(s->comment, str);
+	i = str->l - beg - 4;
+	memcpy(str->s + beg, &i, 4);
+}
+
+void mem_aln2bwr(kstring_t *str, bseq1_t *s, const mem_aln_t *list, int which, const mem_aln_t *m_)
+{ // the compact binary record described in bwr.h
+	int i, l_name = strlen(s->name) + 1;
+	size_t beg = str->l;
+	mem_aln_t ptmp = list[which], *p = &ptmp, mtmp, *m = 0;
+
+	if (m_) mtmp = *m_, m = &mtmp;
+	mem_aln_setflag(p, m);
+	if (l_name > 255) l_name = 255; // l_name is one byte; longer names are truncated
+	kput_u32(0, str); // block_size; filled in the end
+	kput_u32(p->rid, str);
+	kput_u32(p->rid >= 0? p->pos : -1, str);
+	kput_u16((p->flag&0xffff) | (p->flag&0x10000? 0x100 : 0), str);
+	kputc(p->rid >= 0? p->mapq : 0, str);
+	kputc(l_name, str);
+	kput_u32(p->score >= 0? p->score : -1, str);
+	kput_u32(p->sub >= 0? p->sub : -1, str);
+	kput_u32(p->NM, str);
+	kput_u32(p->rid >= 0? p->n_cigar : 0, str);
+	kputsn(s->name, l_name - 1, str); kputc(0, str);
+	if (p->rid >= 0)
+		for (i = 0; i < p->n_cigar; ++i) {
+			int c = p->cigar[i]&0xf;
+			if (c == 3 || c == 4) c = which? 4 : 3; // use hard clipping for supplementary alignments
+			kput_u32((p->cigar[i]>>4)<<4 | c, str);
+		}
+	i = str->l - beg - 4;
+	memcpy(str->s + beg, &i, 4);
+}
+
+void mem_aln2str(const mem_opt_t *opt, const bntseq_t *bns, kstring_t *str, bseq1_t *s, int n, const mem_aln_t *list, int which, const mem_aln_t *m)
+{ // SAM, BAM or BWR, depending on MEM_F_BAM and MEM_F_BWR
+	if (opt->flag & MEM_F_BAM) mem_aln2bam(bns, str, s, n, list, which, m);
+	else if (opt->flag & MEM_F_BWR) mem_aln2bwr(str, s, list, which, m);
+	else mem_aln2sam(bns, str, s, n, list, which, m);
+}
+
 /************************
  * Integrated interface *
  ************************/
@@ -848,8 +1434,9 @@ int mem_approx_mapq_se(const mem_opt_t *opt, const mem_alnreg_t *a)
 }
 
 // TODO (future plan): group hits into a uint64_t[] array. This will be cleaner and more flexible
-void mem_reg2sam_se(const mem_opt_t *opt, const bntseq_t *bns, const uint8_t *pac, bseq1_t *s, mem_alnreg_v *a, int extra_flag, const mem_aln_t *m)
+void mem_reg2sam_se(const mem_opt_t *opt, const bntseq_t *bns, const uint8_t *pac, bns_seqcache_t *sc, bseq1_t *s, mem_alnreg_v *a, int extra_flag, const mem_aln_t *m)
 {
+	extern mem_aln_t mem_reg2aln2(const mem_opt_t *opt, const bntseq_t *bns, const uint8_t *pac, bns_seqcache_t *sc, int l_query, const char *query_, const mem_alnreg_t *ar);
 	kstring_t str;
 	kvec_t(mem_aln_t) aa;
 	int k;
@@ -863,7 +1450,7 @@ void mem_reg2sam_se(const mem_opt_t *opt, const bntseq_t *bns, const uint8_t *pa
 		if (p->secondary >= 0 && !(opt->flag&MEM_F_ALL)) continue;
 		if (p->secondary >= 0 && p->score < a->a[p->secondary].score * .5) continue;
 		q = kv_pushp(mem_aln_t, aa);
-		*q = mem_reg2aln(opt, bns, pac, s->l_seq, s->seq, p);
+		*q = mem_reg2aln2(opt, bns, pac, sc, s->l_seq, s->seq, p);
 		q->flag |= extra_flag; // flag secondary
 		if (p->secondary >= 0) q->sub = -1; // don't output sub-optimal score
 		if (k && p->secondary < 0) // if supplementary
@@ -872,42 +1459,86 @@ void mem_reg2sam_se(const mem_opt_t *opt, const bntseq_t *bns, const uint8_t *pa
 	}
 	if (aa.n == 0) { // no alignments good enough; then write an unaligned record
 		mem_aln_t t;
-		t = mem_reg2aln(opt, bns, pac, s->l_seq, s->seq, 0);
+		t = mem_reg2aln2(opt, bns, pac, sc, s->l_seq, s->seq, 0);
 		t.flag |= extra_flag;
-		mem_aln2sam(bns, &str, s, 1, &t, 0, m);
+		mem_aln2str(opt, bns, &str, s, 1, &t, 0, m);
 	} else {
 		for (k = 0; k < aa.n; ++k)
-			mem_aln2sam(bns, &str, s, aa.n, aa.a, k, m);
+			mem_aln2str(opt, bns, &str, s, aa.n, aa.a, k, m);
 		for (k = 0; k < aa.n; ++k) free(aa.a[k].cigar);
 		free(aa.a);
 	}
-	s->sam = str.s;
+	s->sam = str.s, s->l_sam = str.l;
+}
+
+typedef struct {
+	mem_chain_v chn;
+	int ci, active;  // index of the current chain; whether mem_c2a_t is active on the chain
+	mem_c2a_t z;
+	ksw_ext_t e;     // the pending extension job
+	mem_regidx_t ri; // index of the regions found so far
+} mem_batch1_t;
+
+static void mem_align_batch_core(const mem_opt_t *opt, const bwt_t *bwt, const mzidx_t *mz, const bntseq_t *bns, const uint8_t *pac, bns_seqcache_t *sc, int n, bseq1_t *seqs, mem_alnreg_v *regs)
+{ // find the alignment regions of $n sequences, with extensions from all sequences solved together
+	int i, j, n_job;
+	mem_batch1_t *b;
+	ksw_ext_t *jobs;
+	int *job_id;
+
+	b = calloc(n, sizeof(mem_batch1_t));
+	jobs = malloc(n * sizeof(ksw_ext_t));
+	job_id = malloc(n * sizeof(int));
+	for (i = 0; i < n; ++i) {
+		bseq1_t *s = &seqs[i];
+		if (bwa_verbose >= 4) printf("=====> Processing read '%s' <=====\n", s->name);
+		for (j = 0; j < s->l_seq; ++j) // convert to 2-bit encoding if we have not done so
+			s->seq[j] = s->seq[j] < 4? s->seq[j] : nst_nt4_table[(int)s->seq[j]];
+		b[i].chn = mem_chain(opt, bwt, mz, bns->l_pac, s->l_seq, (uint8_t*)s->seq);
+		b[i].chn.n = mem_chain_flt(opt, b[i].chn.n, b[i].chn.a);
+		if (bwa_verbose >= 4) mem_print_chain(bns, &b[i].chn);
+		kv_init(regs[i]);
+		mem_chain_exact(opt, s->l_seq, &b[i].chn, &regs[i]); // no extension is needed for an exact full-length hit
+	}
+	for (;;) {
+		for (i = n_job = 0; i < n; ++i) { // advance each sequence until it needs an extension or all chains are processed
+			mem_batch1_t *p = &b[i];
+			bseq1_t *s = &seqs[i];
+			while (p->ci < p->chn.n) {
+				mem_chain_t *c = &p->chn.a[p->ci];
+				if (!p->active) {
+					if (bwa_verbose >= 4) err_printf("* ---> Processing chain(%d) <---\n", p->ci);
+					if (mem_chain2aln_short(opt, bns->l_pac, pac, sc, s->l_seq, (uint8_t*)s->seq, c, &regs[i]) > 0) {
+						mem_c2a_init(&p->z, opt, bns->l_pac, pac, sc, s->l_seq, (uint8_t*)s->seq, c, &regs[i], &p->ri);
+						p->active = 1;
+					}
+				}
+				if (p->active && mem_c2a_next(&p->z, &p->e)) {
+					jobs[n_job] = p->e, job_id[n_job++] = i;
+					break;
+				}
+				free(c->seeds);
+				p->active = 0, ++p->ci;
+			}
+		}
+		if (n_job == 0) break;
+		ksw_extend_batch(n_job, jobs, 5, opt->mat, opt->q, opt->r, opt->zdrop);
+		for (j = 0; j < n_job; ++j) b[job_id[j]].e = jobs[j];
+	}
+	for (i = 0; i < n; ++i) {
+		free(b[i].chn.a); free(b[i].ri.a);
+		regs[i].n = mem_sort_and_dedup(regs[i].n, regs[i].a, opt->mask_level_redun);
+	}
+	free(b); free(jobs); free(job_id);
 }
 
 mem_alnreg_v mem_align1_core(const mem_opt_t *opt, const bwt_t *bwt, const bntseq_t *bns, const uint8_t *pac, int l_seq, char *seq)
 {
-	int i;
-	mem_chain_v chn;
+	bseq1_t s;
 	mem_alnreg_v regs;
-
-	for (i = 0; i < l_seq; ++i) // convert to 2-bit encoding if we have not done so
-		seq[i] = seq[i] < 4? seq[i] : nst_nt4_table[(int)seq[i]];
-
-	chn = mem_chain(opt, bwt, bns->l_pac, l_seq, (uint8_t*)seq);
-	chn.n = mem_chain_flt(opt, chn.n, chn.a);
-	if (bwa_verbose >= 4) mem_print_chain(bns, &chn);
-
-	kv_init(regs);
-	for (i = 0; i < chn.n; ++i) {
-		mem_chain_t *p = &chn.a[i];
-		int ret;
-		if (bwa_verbose >= 4) err_printf("* ---> Processing chain(%d) <---\n", i);
-		ret = mem_chain2aln_short(opt, bns->l_pac, pac, l_seq, (uint8_t*)seq, p, &regs);
-		if (ret > 0) mem_chain2aln(opt, bns->l_pac, pac, l_seq, (uint8_t*)seq, p, &regs);
-		free(chn.a[i].seeds);
-	}
-	free(chn.a);
-	regs.n = mem_sort_and_dedup(regs.n, regs.a, opt->mask_level_redun);
+	memset(&s, 0, sizeof(bseq1_t));
+	s.l_seq = l_seq, s.seq = seq, s.name = "";
+	mem_align_batch_core(opt, bwt, 0, bns, pac, 0, 1, &s, &regs);
 	return regs;
 }
 
@@ -923,9 +1554,8 @@ mem_alnreg_v mem_align1(const mem_opt_t *opt, const bwt_t *bwt, const bntseq_t *
 	return ar;
 }
 
-// This routine is only used for the API purpose
-mem_aln_t mem_reg2aln(const mem_opt_t *opt, const bntseq_t *bns, const uint8_t *pac, int l_query, const char *query_, const mem_alnreg_t *ar)
-{
+mem_aln_t mem_reg2aln2(const mem_opt_t *opt, const bntseq_t *bns, const uint8_t *pac, bns_seqcache_t *sc, int l_query, const char *query_, const mem_alnreg_t *ar)
+{ // the same as mem_reg2aln(), except that the reference is retrieved via $sc
 	mem_aln_t a;
 	int i, w2, qb, qe, NM, score, is_rev, last_sc = -(1<<30), l_MD;
 	int64_t pos, rb, re;
@@ -951,10 +1581,19 @@ mem_aln_t mem_reg2aln(const mem_opt_t *opt, const bntseq_t *bns, const uint8_t *
 	if (bwa_verbose >= 4) printf("* Band width: inferred=%d, cmd_opt=%d, alnreg=%d\n", w2, opt->w, ar->w);
 	if (w2 > opt->w) w2 = w2 < ar->w? w2 : ar->w;
 //	else w2 = opt->w; // TODO: check if we need this line on long reads. On 1-800bp reads, it does not matter and it should be.
+	if (w2 > 0 && qe - qb == re - rb) { // if the ungapped alignment achieves the score found in extension, use it and skip DP
+		int64_t rlen;
+		uint8_t *rseq = bns_get_seq2(sc, bns->l_pac, pac, rb, re, &rlen);
+		if (rlen == re - rb && bwa_ungapped_score(opt->mat, qe - qb, &query[qb], rseq) == ar->truesc) w2 = 0;
+		free(rseq);
+	}
 	i = 0; a.cigar = 0;
-	do {
+	if (ar->n_cigar > 0 && w2 > 0 && qb == ar->qb && qe == ar->qe && rb == ar->rb && re == ar->re) { // CIGAR has been generated in extension
+		a.cigar = bwa_gen_cigar2(opt->mat, opt->q, opt->r, w2, bns->l_pac, pac, qe - qb, (uint8_t*)&query[qb], rb, re, &score, &a.n_cigar, &NM, ar->n_cigar, ar->cigar, sc);
+		if (bwa_verbose >= 4) printf("* Final alignment from extension: ext_sc=%d, local_sc=%d\n", score, ar->truesc);
+	} else do {
 		free(a.cigar);
-		a.cigar = bwa_gen_cigar(opt->mat, opt->q, opt->r, w2, bns->l_pac, pac, qe - qb, (uint8_t*)&query[qb], rb, re, &score, &a.n_cigar, &NM);
+		a.cigar = bwa_gen_cigar2(opt->mat, opt->q, opt->r, w2, bns->l_pac, pac, qe - qb, (uint8_t*)&query[qb], rb, re, &score, &a.n_cigar, &NM, 0, 0, sc);
 		if (bwa_verbose >= 4) printf("* Final alignment: w2=%d, global_sc=%d, local_sc=%d\n", w2, score, ar->truesc);
 		if (score == last_sc) break; // it is possible that global alignment and local alignment give different scores
 		last_sc = score;
@@ -996,67 +1635,350 @@ mem_aln_t mem_reg2aln(const mem_opt_t *opt, const bntseq_t *bns, const uint8_t *
 	return a;
 }
 
+// This routine is only used for the API purpose
+mem_aln_t mem_reg2aln(const mem_opt_t *opt, const bntseq_t *bns, const uint8_t *pac, int l_query, const char *query_, const mem_alnreg_t *ar)
+{
+	return mem_reg2aln2(opt, bns, pac, 0, l_query, query_, ar);
+}
+
+#define MEM_BATCH_SIZE 32 // number of sequences aligned together in one worker1() call
+
+/* Ordered writer
+ *
+ * The output of each group of MEM_BATCH_SIZE reads is collected in the
+ * buffer of the thread processing it and handed to the writer, which only
+ * queues it under the lock. A dedicated thread writes the queued groups in
+ * order, outside of the lock, such that compressing or spilling the output
+ * neither runs on the aligning threads nor blocks them. Groups are numbered
+ * from 0 in each call to mem_process_seqs2(), which waits for all of them to
+ * be written before it returns.
+ */
+struct mem_writer_s {
+	void (*write)(void *data, const void *buf, size_t len);
+	void *data;
+	pthread_t tid;
+	pthread_mutex_t lock;
+	pthread_cond_t cv_put, cv_written; // a group is queued; a group is written
+	int n, next, stop; // number of groups in the current call, the next group to write and whether to quit
+	uint8_t *done;     // done[i] is set when group i is queued
+	kstring_t *pend;   // queued output of each group
+};
+
+static void *mem_writer_thread(void *data)
+{
+	mem_writer_t *wr = (mem_writer_t*)data;
+	pthread_mutex_lock(&wr->lock);
+	for (;;) {
+		kstring_t p;
+		while (!wr->stop && !(wr->next < wr->n && wr->done[wr->next]))
+			pthread_cond_wait(&wr->cv_put, &wr->lock);
+		if (wr->stop) break;
+		p = wr->pend[wr->next];
+		pthread_mutex_unlock(&wr->lock);
+		wr->write(wr->data, p.s, p.l);
+		free(p.s);
+		pthread_mutex_lock(&wr->lock);
+		++wr->next;
+		pthread_cond_signal(&wr->cv_written);
+	}
+	pthread_mutex_unlock(&wr->lock);
+	return 0;
+}
+
+mem_writer_t *mem_writer_init(void (*write)(void *data, const void *buf, size_t len), void *data)
+{
+	mem_writer_t *wr;
+	wr = calloc(1, sizeof(mem_writer_t));
+	wr->write = write, wr->data = data;
+	pthread_mutex_init(&wr->lock, 0);
+	pthread_cond_init(&wr->cv_put, 0);
+	pthread_cond_init(&wr->cv_written, 0);
+	pthread_create(&wr->tid, 0, mem_writer_thread, wr);
+	return wr;
+}
+
+void mem_writer_destroy(mem_writer_t *wr)
+{
+	if (wr == 0) return;
+	pthread_mutex_lock(&wr->lock);
+	wr->stop = 1;
+	pthread_cond_signal(&wr->cv_put);
+	pthread_mutex_unlock(&wr->lock);
+	pthread_join(wr->tid, 0);
+	pthread_cond_destroy(&wr->cv_put);
+	pthread_cond_destroy(&wr->cv_written);
+	pthread_mutex_destroy(&wr->lock);
+	free(wr);
+}
+
+static void mem_writer_start(mem_writer_t *wr, int n)
+{
+	pthread_mutex_lock(&wr->lock);
+	wr->n = n, wr->next = 0;
+	wr->done = calloc(n, 1);
+	wr->pend = calloc(n, sizeof(kstring_t));
+	pthread_mutex_unlock(&wr->lock);
+}
+
+static void mem_writer_end(mem_writer_t *wr)
+{ // wait for all groups to be written
+	pthread_mutex_lock(&wr->lock);
+	while (wr->next < wr->n)
+		pthread_cond_wait(&wr->cv_written, &wr->lock);
+	free(wr->done); free(wr->pend);
+	wr->done = 0, wr->pend = 0, wr->n = wr->next = 0;
+	pthread_mutex_unlock(&wr->lock);
+}
+
+static void mem_writer_put(mem_writer_t *wr, int i, kstring_t *s)
+{ // queue the output of group $i; $s is emptied
+	pthread_mutex_lock(&wr->lock);
+	wr->pend[i] = *s, wr->done[i] = 1;
+	s->s = 0, s->l = s->m = 0;
+	if (i == wr->next) pthread_cond_signal(&wr->cv_put);
+	pthread_mutex_unlock(&wr->lock);
+}
+
 typedef struct {
 	const mem_opt_t *opt;
 	const bwt_t *bwt;
+	const mzidx_t *mz;
 	const bntseq_t *bns;
 	const uint8_t *pac;
 	const mem_pestat_t *pes;
 	bseq1_t *seqs;
 	mem_alnreg_v *regs;
+	bns_seqcache_t *sc; // one reference cache per thread
+	int64_t *isz;       // insert sizes of unique pairs, collected in the single-pass mode for the persistent model
+	mem_writer_t *wr;
+	kstring_t *out;     // one output buffer per thread
+	const bwa_numa_t *numa; // per-node index replicas; NULL to use $bwt and $pac
 	int64_t n_processed;
+	int n;
 } worker_t;
 
+static inline const bwt_t *worker_bwt(const worker_t *w, int tid) { return w->numa? w->numa->bwt[tid % w->numa->n_node] : w->bwt; }
+static inline const uint8_t *worker_pac(const worker_t *w, int tid) { return w->numa? w->numa->pac[tid % w->numa->n_node] : w->pac; }
+
+static inline void mem_free_regs(mem_alnreg_v *r)
+{
+	size_t i;
+	for (i = 0; i < r->n; ++i) free(r->a[i].cigar);
+	free(r->a);
+}
+
 static void worker1(void *data, int i, int tid)
 {
 	worker_t *w = (worker_t*)data;
+	int beg = i * MEM_BATCH_SIZE, end = beg + MEM_BATCH_SIZE < w->n? beg + MEM_BATCH_SIZE : w->n;
+	mem_align_batch_core(w->opt, worker_bwt(w, tid), w->mz, w->bns, worker_pac(w, tid), &w->sc[tid], end - beg, &w->seqs[beg], &w->regs[beg]);
+}
+
+static void mem_finalize(worker_t *w, int i, int tid, mem_alnreg_v *regs)
+{ // generate SAM for the i-th read, or the i-th read pair in the paired-end mode
+	extern int mem_sam_pe(const mem_opt_t *opt, const bntseq_t *bns, const uint8_t *pac, bns_seqcache_t *sc, const mem_pestat_t pes[4], uint64_t id, bseq1_t s[2], mem_alnreg_v a[2]);
 	if (!(w->opt->flag&MEM_F_PE)) {
-		if (bwa_verbose >= 4) printf("=====> Processing read '%s' <=====\n", w->seqs[i].name);
-		w->regs[i] = mem_align1_core(w->opt, w->bwt, w->bns, w->pac, w->seqs[i].l_seq, w->seqs[i].seq);
+		if (bwa_verbose >= 4) printf("=====> Finalizing read '%s' <=====\n", w->seqs[i].name);
+		mem_mark_primary_se(w->opt, regs->n, regs->a, w->n_processed + i);
+		mem_reg2sam_se(w->opt, w->bns, worker_pac(w, tid), &w->sc[tid], &w->seqs[i], regs, 0, 0);
+		mem_free_regs(regs);
 	} else {
-		if (bwa_verbose >= 4) printf("=====> Processing read '%s'/1 <=====\n", w->seqs[i<<1|0].name);
-		w->regs[i<<1|0] = mem_align1_core(w->opt, w->bwt, w->bns, w->pac, w->seqs[i<<1|0].l_seq, w->seqs[i<<1|0].seq);
-		if (bwa_verbose >= 4) printf("=====> Processing read '%s'/2 <=====\n", w->seqs[i<<1|1].name);
-		w->regs[i<<1|1] = mem_align1_core(w->opt, w->bwt, w->bns, w->pac, w->seqs[i<<1|1].l_seq, w->seqs[i<<1|1].seq);
+		if (bwa_verbose >= 4) printf("=====> Finalizing read pair '%s' <=====\n", w->seqs[i<<1|0].name);
+		mem_sam_pe(w->opt, w->bns, worker_pac(w, tid), &w->sc[tid], w->pes, (w->n_processed>>1) + i, &w->seqs[i<<1], regs);
+		mem_free_regs(&regs[0]); mem_free_regs(&regs[1]);
 	}
 }
 
+static void mem_output(worker_t *w, int i, int tid)
+{ // pass the output of the i-th group of reads to the writer
+	int j, beg = i * MEM_BATCH_SIZE, end = beg + MEM_BATCH_SIZE < w->n? beg + MEM_BATCH_SIZE : w->n;
+	kstring_t *s = &w->out[tid];
+	for (j = beg; j < end; ++j) {
+		kputsn(w->seqs[j].sam, w->seqs[j].l_sam, s);
+		free(w->seqs[j].sam); w->seqs[j].sam = 0;
+	}
+	mem_writer_put(w->wr, i, s);
+}
+
 static void worker2(void *data, int i, int tid)
 {
-	extern int mem_sam_pe(const mem_opt_t *opt, const bntseq_t *bns, const uint8_t *pac, const mem_pestat_t pes[4], uint64_t id, bseq1_t s[2], mem_alnreg_v a[2]);
 	worker_t *w = (worker_t*)data;
+	int j, beg = i * MEM_BATCH_SIZE, end = beg + MEM_BATCH_SIZE < w->n? beg + MEM_BATCH_SIZE : w->n;
 	if (!(w->opt->flag&MEM_F_PE)) {
-		if (bwa_verbose >= 4) printf("=====> Finalizing read '%s' <=====\n", w->seqs[i].name);
-		mem_mark_primary_se(w->opt, w->regs[i].n, w->regs[i].a, w->n_processed + i);
-		mem_reg2sam_se(w->opt, w->bns, w->pac, &w->seqs[i], &w->regs[i], 0, 0);
-		free(w->regs[i].a);
+		for (j = beg; j < end; ++j)
+			mem_finalize(w, j, tid, &w->regs[j]);
 	} else {
-		if (bwa_verbose >= 4) printf("=====> Finalizing read pair '%s' <=====\n", w->seqs[i<<1|0].name);
-		mem_sam_pe(w->opt, w->bns, w->pac, w->pes, (w->n_processed>>1) + i, &w->seqs[i<<1], &w->regs[i<<1]);
-		free(w->regs[i<<1|0].a); free(w->regs[i<<1|1].a);
+		for (j = beg; j < end; j += 2)
+			mem_finalize(w, j>>1, tid, &w->regs[j]);
 	}
+	if (w->wr) mem_output(w, i, tid);
 }
 
-void mem_process_seqs(const mem_opt_t *opt, const bwt_t *bwt, const bntseq_t *bns, const uint8_t *pac, int64_t n_processed, int n, bseq1_t *seqs, const mem_pestat_t *pes0)
+static void worker12(void *data, int i, int tid)
+{ // align and finalize a batch in one pass; only used when pairing does not depend on the rest of the reads
+	extern int mem_pestat_pair(const mem_opt_t *opt, int64_t l_pac, const mem_alnreg_v r[2], int64_t *is);
+	worker_t *w = (worker_t*)data;
+	int j, beg = i * MEM_BATCH_SIZE, end = beg + MEM_BATCH_SIZE < w->n? beg + MEM_BATCH_SIZE : w->n;
+	mem_alnreg_v regs[MEM_BATCH_SIZE];
+	mem_align_batch_core(w->opt, worker_bwt(w, tid), w->mz, w->bns, worker_pac(w, tid), &w->sc[tid], end - beg, &w->seqs[beg], regs);
+	if (!(w->opt->flag&MEM_F_PE)) {
+		for (j = beg; j < end; ++j)
+			mem_finalize(w, j, tid, &regs[j - beg]);
+	} else { // MEM_BATCH_SIZE is even, so a pair is never split between batches
+		for (j = beg; j < end; j += 2) {
+			if (w->isz) {
+				int64_t is;
+				int d = mem_pestat_pair(w->opt, w->bns->l_pac, &regs[j - beg], &is);
+				w->isz[j>>1] = d >= 0? (int64_t)d<<32 | is : -1;
+			}
+			mem_finalize(w, j>>1, tid, &regs[j - beg]);
+		}
+	}
+	if (w->wr) mem_output(w, i, tid);
+}
+
+static int mem_find_dups(int n, const bseq1_t *seqs, int is_pe, int *dup)
+{ // set dup[i] to the index of the first identical sequence (or pair) if i is a duplicate, or -1 otherwise
+	int i, j, k, m = is_pe? n>>1 : n, n_dup = 0, t = is_pe? 2 : 1;
+	pair64_t *a;
+	a = malloc(m * sizeof(pair64_t));
+	for (i = 0; i < m; ++i) {
+		uint64_t h = 1469598103934665603ULL; // FNV-1a
+		for (k = 0; k < t; ++k) {
+			const bseq1_t *s = &seqs[i*t+k];
+			for (j = 0; j < s->l_seq; ++j)
+				h = (h ^ (uint8_t)s->seq[j]) * 1099511628211ULL;
+			h = (h ^ 0xff) * 1099511628211ULL; // separate the two ends
+		}
+		a[i].x = h, a[i].y = i;
+	}
+	ks_introsort_128(m, a);
+	for (i = 0; i < n; ++i) dup[i] = -1;
+	for (i = 0; i < m; i = j) {
+		const bseq1_t *p = &seqs[a[i].y * t];
+		for (j = i + 1; j < m && a[j].x == a[i].x; ++j) {
+			const bseq1_t *q = &seqs[a[j].y * t];
+			for (k = 0; k < t; ++k)
+				if (p[k].l_seq != q[k].l_seq || memcmp(p[k].seq, q[k].seq, p[k].l_seq) != 0) break;
+			if (k < t) continue; // hash collision
+			for (k = 0; k < t; ++k) dup[a[j].y * t + k] = a[i].y * t + k;
+			n_dup += t;
+		}
+	}
+	free(a);
+	return n_dup;
+}
+
+static void mem_copy_regs(mem_alnreg_v *dst, const mem_alnreg_v *src)
 {
+	size_t i;
+	dst->n = dst->m = src->n;
+	if (src->n == 0) { // no memcpy() from a NULL $src->a
+		dst->a = 0;
+		return;
+	}
+	dst->a = malloc(src->n * sizeof(mem_alnreg_t));
+	memcpy(dst->a, src->a, src->n * sizeof(mem_alnreg_t));
+	for (i = 0; i < src->n; ++i) {
+		mem_alnreg_t *p = &dst->a[i];
+		if (p->n_cigar == 0) continue;
+		p->cigar = malloc(p->n_cigar * 4);
+		memcpy(p->cigar, src->a[i].cigar, p->n_cigar * 4);
+	}
+}
+
+static void mem_for(const mem_opt_t *opt, void (*func)(void*,int,int), void *data, int n)
+{ // run $func with the persistent pool in $opt if present
 	extern void kt_for(int n_threads, void (*func)(void*,int,int), void *data, int n);
-	worker_t w;
+	extern void kt_forpool(void *fp, void (*func)(void*,int,int), void *data, int n);
+	if (opt->pool) kt_forpool(opt->pool, func, data, n);
+	else kt_for(opt->n_threads, func, data, n);
+}
+
+static void mem_process_2pass(worker_t *w, int n_dup, const int *dup, const mem_pestat_t *pes0, mem_pesmod_t *pm, mem_pestat_t pes[4])
+{ // align all reads, infer the insert size distribution if needed, and then generate SAM
+	const mem_opt_t *opt = w->opt;
+	bseq1_t *seqs = w->seqs;
 	mem_alnreg_v *regs;
+	int i, j, n = w->n;
+
+	w->regs = regs = malloc(n * sizeof(mem_alnreg_v));
+	if (n_dup > 0) { // only align unique sequences; the rest get copies of the regions
+		w->seqs = malloc((n - n_dup) * sizeof(bseq1_t));
+		for (i = w->n = 0; i < n; ++i)
+			if (dup[i] < 0) w->seqs[w->n++] = seqs[i];
+	}
+	mem_for(opt, worker1, w, (w->n + MEM_BATCH_SIZE - 1) / MEM_BATCH_SIZE); // find mapping positions
+	if (n_dup > 0) {
+		for (i = n - 1, j = w->n - 1; i >= 0; --i) // move the unique ones to their own positions; j <= i always holds
+			if (dup[i] < 0) regs[i] = regs[j--];
+		for (i = 0; i < n; ++i) {
+			if (dup[i] < 0) continue;
+			mem_copy_regs(&regs[i], &regs[dup[i]]);
+			memcpy(seqs[i].seq, seqs[dup[i]].seq, seqs[i].l_seq); // already converted to the 2-bit encoding
+		}
+		free(w->seqs);
+		w->seqs = seqs, w->n = n;
+		if (bwa_verbose >= 3)
+			fprintf(stderr, "[M::%s] %d out of %d reads are identical to an earlier read in the batch\n", __func__, n_dup, n);
+	}
+	if (opt->flag&MEM_F_PE) { // infer insert sizes if not provided
+		if (pm) { // use the model from earlier batches; only the first batch without a prior is paired with its own estimate
+			int ready = mem_pesmod_ready(pm);
+			if (ready) memcpy(pes, pm->pes, 4 * sizeof(mem_pestat_t));
+			mem_pesmod_add(opt, w->bns->l_pac, n, regs, pm);
+			if (!ready) memcpy(pes, pm->pes, 4 * sizeof(mem_pestat_t));
+		} else if (pes0) memcpy(pes, pes0, 4 * sizeof(mem_pestat_t)); // if pes0 != NULL, set the insert-size distribution as pes0
+		else mem_pestat(opt, w->bns->l_pac, n, regs, pes); // otherwise, infer the insert size distribution from data
+	}
+	mem_for(opt, worker2, w, (n + MEM_BATCH_SIZE - 1) / MEM_BATCH_SIZE); // generate alignment
+	free(regs);
+}
+
+void mem_process_seqs2(const mem_opt_t *opt, const bwt_t *bwt, const mzidx_t *mz, const bntseq_t *bns, const uint8_t *pac, int64_t n_processed, int n, bseq1_t *seqs, const mem_pestat_t *pes0, mem_pesmod_t *pm, mem_writer_t *wr)
+{
+	worker_t w;
 	mem_pestat_t pes[4];
 	double ctime, rtime;
+	int i, n_dup = 0, *dup = 0;
 
 	ctime = cputime(); rtime = realtime();
-	regs = malloc(n * sizeof(mem_alnreg_v));
-	w.opt = opt; w.bwt = bwt; w.bns = bns; w.pac = pac;
-	w.seqs = seqs; w.regs = regs; w.n_processed = n_processed;
-	w.pes = &pes[0];
-	kt_for(opt->n_threads, worker1, &w, (opt->flag&MEM_F_PE)? n>>1 : n); // find mapping positions
-	if (opt->flag&MEM_F_PE) { // infer insert sizes if not provided
-		if (pes0) memcpy(pes, pes0, 4 * sizeof(mem_pestat_t)); // if pes0 != NULL, set the insert-size distribution as pes0
-		else mem_pestat(opt, bns->l_pac, n, regs, pes); // otherwise, infer the insert size distribution from data
+	w.opt = opt; w.bwt = bwt; w.mz = mz; w.bns = bns; w.pac = pac;
+	w.seqs = seqs; w.regs = 0; w.n_processed = n_processed; w.n = n;
+	w.pes = &pes[0]; w.isz = 0; w.wr = wr; w.out = 0; w.numa = opt->numa;
+	w.sc = calloc(opt->n_threads, sizeof(bns_seqcache_t));
+	if (wr) {
+		w.out = calloc(opt->n_threads, sizeof(kstring_t));
+		mem_writer_start(wr, (n + MEM_BATCH_SIZE - 1) / MEM_BATCH_SIZE);
+	}
+	if (opt->flag&MEM_F_DEDUP) {
+		dup = malloc(n * sizeof(int));
+		n_dup = mem_find_dups(n, seqs, opt->flag&MEM_F_PE, dup);
+	}
+	if (n_dup == 0 && (!(opt->flag&MEM_F_PE) || (pm && mem_pesmod_ready(pm)) || (!pm && pes0))) {
+		// Pairing does not depend on this batch, so each group of reads is finalized right after it is aligned,
+		// without keeping the regions of all reads or waiting for the slowest read in the batch.
+		if (opt->flag&MEM_F_PE) {
+			memcpy(pes, pm? pm->pes : pes0, 4 * sizeof(mem_pestat_t));
+			if (pm) w.isz = malloc((n>>1) * sizeof(int64_t));
+		}
+		mem_for(opt, worker12, &w, (n + MEM_BATCH_SIZE - 1) / MEM_BATCH_SIZE);
+		if (pm && w.isz) mem_pesmod_push(pm, n>>1, w.isz);
+		free(w.isz);
+	} else mem_process_2pass(&w, n_dup, dup, pes0, pm, pes);
+	free(dup);
+	for (i = 0; i < opt->n_threads; ++i) bns_seqcache_clear(&w.sc[i]);
+	free(w.sc);
+	if (wr) {
+		mem_writer_end(wr);
+		for (i = 0; i < opt->n_threads; ++i) free(w.out[i].s);
+		free(w.out);
 	}
-	kt_for(opt->n_threads, worker2, &w, (opt->flag&MEM_F_PE)? n>>1 : n); // generate alignment
-	free(regs);
 	if (bwa_verbose >= 3)
 		fprintf(stderr, "[M::%s] Processed %d reads in %.3f CPU sec, %.3f real sec\n", __func__, n, cputime() - ctime, realtime() - rtime);
 }
+
+void mem_process_seqs(const mem_opt_t *opt, const bwt_t *bwt, const bntseq_t *bns, const uint8_t *pac, int64_t n_processed, int n, bseq1_t *seqs, const mem_pestat_t *pes0)
+{
+	mem_process_seqs2(opt, bwt, 0, bns, pac, n_processed, n, seqs, pes0, 0, 0);
+}
@@ -16,6 +16,10 @@ typedef struct __smem_i smem_i;
 #define MEM_F_ALL       0x8
 #define MEM_F_NO_MULTI  0x10
 #define MEM_F_NO_RESCUE 0x20
+#define MEM_F_EXT_CIGAR 0x40
+#define MEM_F_DEDUP     0x80
+#define MEM_F_BAM       0x100
+#define MEM_F_BWR       0x200
 
 typedef struct {
 	int a, b, q, r;         // match score, mismatch penalty and gap open/extension penalty. A gap of size k costs q+k*r
@@ -31,6 +35,8 @@ typedef struct {
 	int split_width;        // split into a seed if its occurence is smaller than this value
 	int max_occ;            // skip a seed if its occurence is larger than this value
 	int max_chain_gap;      // do not chain seed if it is max_chain_gap-bp away from the closest seed
+	int dp_chain_len;       // chain seeds by dynamic programming for queries at least this long; 0 to disable
+	int mz_len;             // seed queries at least this long with minimizers instead of SMEMs; 0 to disable
 	int n_threads;          // number of threads
 	int chunk_size;         // process chunk_size-bp sequences in a batch
 	float mask_level;       // regard a hit as redundant if the overlap with another better hit is over mask_level times the min length of the two hits
@@ -41,6 +47,8 @@ typedef struct {
 	int max_ins;            // when estimating insert size distribution, skip pairs with insert longer than this value
 	int max_matesw;         // perform maximally max_matesw rounds of mate-SW for each end
 	int8_t mat[25];         // scoring matrix; mat[0] == 0 if unset
+	void *pool;             // persistent threads from kt_forpool_init(n_threads); NULL to start threads for each batch
+	const bwa_numa_t *numa; // index replicas from bwa_numa_init(); thread tid uses those on node tid % numa->n_node
 } mem_opt_t;
 
 typedef struct {
@@ -55,6 +63,8 @@ typedef struct {
 	int seedcov;    // length of regions coverged by seeds
 	int secondary;  // index of the parent hit shadowing the current hit; <0 if primary
 	uint64_t hash;
+	int n_cigar;    // number of CIGAR operations from the extension; only with MEM_F_EXT_CIGAR
+	uint32_t *cigar; // CIGAR on the strand of [rb,re), owned by the hit; free() it when the hit is discarded
 } mem_alnreg_t;
 
 typedef struct { size_t n, m; mem_alnreg_t *a; } mem_alnreg_v;
@@ -65,6 +75,16 @@ typedef struct {
 	double avg, std; // mean and stddev of the insert size distribution
 } mem_pestat_t;
 
+typedef struct { // insert size distribution learned from all batches processed so far
+	int max_ins;       // insert sizes larger than this are not counted
+	int n_batches;     // number of batches added to the model
+	uint64_t *cnt[4];  // cnt[d][i]: number of unique pairs in orientation d with insert size i
+	uint64_t n[4];     // number of unique pairs in each orientation
+	mem_pestat_t pes[4]; // current estimate; the prior if there are not enough pairs yet
+} mem_pesmod_t;
+
+typedef struct mem_writer_s mem_writer_t; // output in the input order while reads are being aligned
+
 typedef struct { // This struct is only used for the convenience of API.
 	int64_t pos;     // forward strand 5'-end mapping position
 	int rid;         // reference sequence index in bntseq_t; <0 for unmapped
@@ -112,11 +132,37 @@ extern "C" {
 	 */
 	void mem_process_seqs(const mem_opt_t *opt, const bwt_t *bwt, const bntseq_t *bns, const uint8_t *pac, int64_t n_processed, int n, bseq1_t *seqs, const mem_pestat_t *pes0);
 
+	/**
+	 * Same as mem_process_seqs(), but with a minimizer index and a persistent insert size model
+	 *
+	 * Queries of $opt->mz_len bp or longer are seeded with the minimizer index
+	 * $mz. In the paired-end mode, if $pm is not NULL, pairs are resolved with
+	 * the model learned from earlier calls (or the prior it is initialized
+	 * with), and then the unique pairs in $seqs are added to $pm. $pes0 is
+	 * ignored in this case. If $wr is not NULL, the output of each group of
+	 * reads is passed to $wr as soon as the output of all reads before it is,
+	 * and $seqs[i].sam is set to NULL. If $mz, $pm and $wr are all NULL, this
+	 * routine is identical to mem_process_seqs().
+	 */
+	void mem_process_seqs2(const mem_opt_t *opt, const bwt_t *bwt, const mzidx_t *mz, const bntseq_t *bns, const uint8_t *pac, int64_t n_processed, int n, bseq1_t *seqs, const mem_pestat_t *pes0, mem_pesmod_t *pm, mem_writer_t *wr);
+
+	/**
+	 * Initialize an ordered writer
+	 *
+	 * @param write  function called on each piece of output, in the input
+	 *               order and from a thread of the writer
+	 * @param data   the first argument to $write
+	 */
+	mem_writer_t *mem_writer_init(void (*write)(void *data, const void *buf, size_t len), void *data);
+	void mem_writer_destroy(mem_writer_t *wr);
+
 	/**
 	 * Find the aligned regions for one query sequence
 	 *
 	 * Note that this routine does not generate CIGAR. CIGAR should be
-	 * generated later by mem_reg2aln() below.
+	 * generated later by mem_reg2aln() below. With MEM_F_EXT_CIGAR, the
+	 * CIGAR is kept from the extension in mem_alnreg_t::cigar, which should
+	 * be freed along with the list.
 	 *
 	 * @param opt    alignment parameters
 	 * @param bwt    FM-index of the reference sequence
@@ -157,6 +203,24 @@ extern "C" {
 	 */
 	void mem_pestat(const mem_opt_t *opt, int64_t l_pac, int n, const mem_alnreg_v *regs, mem_pestat_t pes[4]);
 
+	/**
+	 * Initialize a persistent insert size model
+	 *
+	 * @param prior  insert size distribution used until enough pairs have been
+	 *               added; NULL for no prior. An array of 4 elements as in mem_pestat().
+	 */
+	mem_pesmod_t *mem_pesmod_init(const mem_opt_t *opt, const mem_pestat_t *prior);
+	void mem_pesmod_destroy(mem_pesmod_t *pm);
+
+	/** Add the unique pairs in interleaved $regs to the model and update $pm->pes */
+	void mem_pesmod_add(const mem_opt_t *opt, int64_t l_pac, int n, const mem_alnreg_v *regs, mem_pesmod_t *pm);
+
+	/** Add $n insert sizes to the model, each as orientation<<32|size, or negative to be skipped */
+	void mem_pesmod_push(mem_pesmod_t *pm, int n, const int64_t *isz);
+
+	/** Whether the model has an estimate (or a prior) for at least one orientation */
+	int mem_pesmod_ready(const mem_pesmod_t *pm);
+
 #ifdef __cplusplus
 }
 #endif
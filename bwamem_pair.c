@@ -43,6 +43,25 @@ static int cal_sub(const mem_opt_t *opt, mem_alnreg_v *r)
 	return j < r->n? r->a[j].score : opt->min_seed_len * opt->a;
 }
 
+int mem_pestat_pair(const mem_opt_t *opt, int64_t l_pac, const mem_alnreg_v r[2], int64_t *is)
+{ // return the orientation of a pair with both ends uniquely mapped, or -1 if the pair is not informative
+	int dir;
+	if (r[0].n == 0 || r[1].n == 0) return -1;
+	if (cal_sub(opt, (mem_alnreg_v*)&r[0]) > MIN_RATIO * r[0].a[0].score) return -1;
+	if (cal_sub(opt, (mem_alnreg_v*)&r[1]) > MIN_RATIO * r[1].a[0].score) return -1;
+	dir = mem_infer_dir(l_pac, r[0].a[0].rb, r[1].a[0].rb, is);
+	return *is && *is <= opt->max_ins? dir : -1;
+}
+
+static void mem_pes_bounds(mem_pestat_t *r, int p25, int p75)
+{ // boundaries for proper pairs, given the mean and std.dev
+	r->low  = (int)(p25 - MAPPING_BOUND * (p75 - p25) + .499);
+	r->high = (int)(p75 + MAPPING_BOUND * (p75 - p25) + .499);
+	if (r->low  > r->avg - MAX_STDDEV * r->std) r->low  = (int)(r->avg - MAX_STDDEV * r->std + .499);
+	if (r->high < r->avg - MAX_STDDEV * r->std) r->high = (int)(r->avg + MAX_STDDEV * r->std + .499);
+	if (r->low < 1) r->low = 1;
+}
+
 void mem_pestat(const mem_opt_t *opt, int64_t l_pac, int n, const mem_alnreg_v *regs, mem_pestat_t pes[4])
 {
 	int i, d, max;
@@ -52,14 +71,8 @@ void mem_pestat(const mem_opt_t *opt, int64_t l_pac, int n, const mem_alnreg_v *
 	for (i = 0; i < n>>1; ++i) {
 		int dir;
 		int64_t is;
-		mem_alnreg_v *r[2];
-		r[0] = (mem_alnreg_v*)&regs[i<<1|0];
-		r[1] = (mem_alnreg_v*)&regs[i<<1|1];
-		if (r[0]->n == 0 || r[1]->n == 0) continue;
-		if (cal_sub(opt, r[0]) > MIN_RATIO * r[0]->a[0].score) continue;
-		if (cal_sub(opt, r[1]) > MIN_RATIO * r[1]->a[0].score) continue;
-		dir = mem_infer_dir(l_pac, r[0]->a[0].rb, r[1]->a[0].rb, &is);
-		if (is && is <= opt->max_ins) kv_push(uint64_t, isize[dir], is);
+		if ((dir = mem_pestat_pair(opt, l_pac, &regs[i<<1], &is)) >= 0)
+			kv_push(uint64_t, isize[dir], is);
 	}
 	if (bwa_verbose >= 3) fprintf(stderr, "[M::%s] # candidate unique pairs for (FF, FR, RF, RR): (%ld, %ld, %ld, %ld)\n", __func__, isize[0].n, isize[1].n, isize[2].n, isize[3].n);
 	for (d = 0; d < 4; ++d) { // TODO: this block is nearly identical to the one in bwtsw2_pair.c. It would be better to merge these two.
@@ -89,11 +102,7 @@ void mem_pestat(const mem_opt_t *opt, int64_t l_pac, int n, const mem_alnreg_v *
 				r->std += (q->a[i] - r->avg) * (q->a[i] - r->avg);
 		r->std = sqrt(r->std / x);
 		fprintf(stderr, "[M::%s] mean and std.dev: (%.2f, %.2f)\n", __func__, r->avg, r->std);
-		r->low  = (int)(p25 - MAPPING_BOUND * (p75 - p25) + .499);
-		r->high = (int)(p75 + MAPPING_BOUND * (p75 - p25) + .499);
-		if (r->low  > r->avg - MAX_STDDEV * r->std) r->low  = (int)(r->avg - MAX_STDDEV * r->std + .499);
-		if (r->high < r->avg - MAX_STDDEV * r->std) r->high = (int)(r->avg + MAX_STDDEV * r->std + .499);
-		if (r->low < 1) r->low = 1;
+		mem_pes_bounds(r, p25, p75);
 		fprintf(stderr, "[M::%s] low and high boundaries for proper pairs: (%d, %d)\n", __func__, r->low, r->high);
 		free(q->a);
 	}
@@ -106,7 +115,133 @@ void mem_pestat(const mem_opt_t *opt, int64_t l_pac, int n, const mem_alnreg_v *
 		}
 }
 
-int mem_matesw(const mem_opt_t *opt, int64_t l_pac, const uint8_t *pac, const mem_pestat_t pes[4], const mem_alnreg_t *a, int l_ms, const uint8_t *ms, mem_alnreg_v *ma)
+/* Persistent insert size model
+ *
+ * mem_pestat() infers the distribution from one batch only. The model below
+ * instead keeps the insert sizes of all unique pairs seen so far in a
+ * histogram, one bin per bp up to opt->max_ins, from which the quartiles are
+ * read exactly without sorting. A batch can thus be paired with the model
+ * learned from earlier batches, and a small last batch does not get its own
+ * noisy estimate.
+ */
+
+mem_pesmod_t *mem_pesmod_init(const mem_opt_t *opt, const mem_pestat_t *prior)
+{
+	mem_pesmod_t *pm;
+	int d;
+	pm = calloc(1, sizeof(mem_pesmod_t));
+	pm->max_ins = opt->max_ins;
+	for (d = 0; d < 4; ++d) {
+		pm->cnt[d] = calloc(pm->max_ins + 1, sizeof(uint64_t));
+		pm->pes[d].failed = 1;
+	}
+	if (prior) memcpy(pm->pes, prior, 4 * sizeof(mem_pestat_t));
+	return pm;
+}
+
+void mem_pesmod_destroy(mem_pesmod_t *pm)
+{
+	int d;
+	if (pm == 0) return;
+	for (d = 0; d < 4; ++d) free(pm->cnt[d]);
+	free(pm);
+}
+
+int mem_pesmod_ready(const mem_pesmod_t *pm)
+{
+	int d;
+	for (d = 0; d < 4; ++d)
+		if (!pm->pes[d].failed) return 1;
+	return 0;
+}
+
+static int mem_pes_quantile(const uint64_t *cnt, int max, uint64_t k)
+{ // the k-th smallest insert size, 0-based
+	int i;
+	uint64_t acc = 0;
+	for (i = 0; i <= max; ++i)
+		if ((acc += cnt[i]) > k) break;
+	return i;
+}
+
+void mem_pesmod_push(mem_pesmod_t *pm, int n, const int64_t *isz)
+{
+	int i, d;
+	uint64_t max = 0, m[4] = {0,0,0,0};
+	mem_pestat_t pes[4];
+	for (i = 0; i < n; ++i) {
+		int64_t is = isz[i] & 0xffffffffLL;
+		if (isz[i] < 0 || is > pm->max_ins) continue;
+		d = isz[i]>>32;
+		++pm->cnt[d][is], ++pm->n[d], ++m[d];
+	}
+	++pm->n_batches;
+	memset(pes, 0, 4 * sizeof(mem_pestat_t));
+	for (d = 0; d < 4; ++d) {
+		mem_pestat_t *r = &pes[d];
+		const uint64_t *c = pm->cnt[d];
+		int p25, p50, p75;
+		uint64_t x;
+		max = max > pm->n[d]? max : pm->n[d];
+		if (pm->n[d] < MIN_DIR_CNT) {
+			r->failed = 1;
+			continue;
+		}
+		p25 = mem_pes_quantile(c, pm->max_ins, (uint64_t)(.25 * pm->n[d] + .499));
+		p50 = mem_pes_quantile(c, pm->max_ins, (uint64_t)(.50 * pm->n[d] + .499));
+		p75 = mem_pes_quantile(c, pm->max_ins, (uint64_t)(.75 * pm->n[d] + .499));
+		r->low  = (int)(p25 - OUTLIER_BOUND * (p75 - p25) + .499);
+		if (r->low < 1) r->low = 1;
+		r->high = (int)(p75 + OUTLIER_BOUND * (p75 - p25) + .499);
+		if (r->high > pm->max_ins) r->high = pm->max_ins;
+		for (i = r->low, x = 0, r->avg = 0; i <= r->high; ++i)
+			r->avg += (double)c[i] * i, x += c[i];
+		r->avg /= x;
+		for (i = r->low, r->std = 0; i <= r->high; ++i)
+			r->std += c[i] * (i - r->avg) * (i - r->avg);
+		r->std = sqrt(r->std / x);
+		mem_pes_bounds(r, p25, p75);
+		if (bwa_verbose >= 4)
+			fprintf(stderr, "[M::%s] %c%c: (25, 50, 75) percentile: (%d, %d, %d); mean and std.dev: (%.2f, %.2f)\n",
+					__func__, "FR"[d>>1&1], "FR"[d&1], p25, p50, p75, r->avg, r->std);
+	}
+	for (d = 0; d < 4; ++d)
+		if (pes[d].failed == 0 && pm->n[d] < max * MIN_DIR_RATIO)
+			pes[d].failed = 1;
+	for (d = 0; d < 4; ++d)
+		if (!pes[d].failed) break;
+	if (d < 4) memcpy(pm->pes, pes, 4 * sizeof(mem_pestat_t)); // otherwise keep the prior, if there is one
+	if (bwa_verbose >= 3) {
+		fprintf(stderr, "[M::%s] %ld, %ld, %ld and %ld unique pairs added for (FF, FR, RF, RR)\n", __func__, (long)m[0], (long)m[1], (long)m[2], (long)m[3]);
+		for (d = 0; d < 4; ++d)
+			if (!pm->pes[d].failed)
+				fprintf(stderr, "[M::%s] %c%c: mean and std.dev: (%.2f, %.2f); boundaries for proper pairs: (%d, %d)\n",
+						__func__, "FR"[d>>1&1], "FR"[d&1], pm->pes[d].avg, pm->pes[d].std, pm->pes[d].low, pm->pes[d].high);
+	}
+}
+
+void mem_pesmod_add(const mem_opt_t *opt, int64_t l_pac, int n, const mem_alnreg_v *regs, mem_pesmod_t *pm)
+{
+	int i, d;
+	int64_t *isz, is;
+	isz = malloc((n>>1) * sizeof(int64_t));
+	for (i = 0; i < n>>1; ++i)
+		isz[i] = (d = mem_pestat_pair(opt, l_pac, &regs[i<<1], &is)) >= 0? (int64_t)d<<32 | is : -1;
+	mem_pesmod_push(pm, n>>1, isz);
+	free(isz);
+}
+
+typedef struct { // the mate in both orientations with query profiles, built on demand and shared by all rescues of a read pair
+	uint8_t *rev;  // reverse complement of the mate
+	kswq_t *qp[2]; // query profiles of the mate and of its reverse complement
+} mem_mprof_t;
+
+static void mem_mprof_destroy(mem_mprof_t *mp)
+{
+	free(mp->rev); free(mp->qp[0]); free(mp->qp[1]);
+}
+
+int mem_matesw(const mem_opt_t *opt, int64_t l_pac, const uint8_t *pac, bns_seqcache_t *sc, const mem_pestat_t pes[4], const mem_alnreg_t *a, int l_ms, const uint8_t *ms, mem_alnreg_v *ma, mem_mprof_t *mp)
 {
 	extern int mem_sort_and_dedup(int n, mem_alnreg_t *a, float mask_level_redun);
 	int i, r, skip[4], n = 0;
@@ -121,15 +256,17 @@ int mem_matesw(const mem_opt_t *opt, int64_t l_pac, const uint8_t *pac, const me
 	if (skip[0] + skip[1] + skip[2] + skip[3] == 4) return 0; // consistent pair exist; no need to perform SW
 	for (r = 0; r < 4; ++r) {
 		int is_rev, is_larger;
-		uint8_t *seq, *rev = 0, *ref;
+		uint8_t *seq, *ref;
 		int64_t rb, re, len;
 		if (skip[r]) continue;
 		is_rev = (r>>1 != (r&1)); // whether to reverse complement the mate
 		is_larger = !(r>>1); // whether the mate has larger coordinate
 		if (is_rev) {
-			rev = malloc(l_ms); // this is the reverse complement of $ms
-			for (i = 0; i < l_ms; ++i) rev[l_ms - 1 - i] = ms[i] < 4? 3 - ms[i] : 4;
-			seq = rev;
+			if (mp->rev == 0) {
+				mp->rev = malloc(l_ms); // this is the reverse complement of $ms
+				for (i = 0; i < l_ms; ++i) mp->rev[l_ms - 1 - i] = ms[i] < 4? 3 - ms[i] : 4;
+			}
+			seq = mp->rev;
 		} else seq = (uint8_t*)ms;
 		if (!is_rev) {
 			rb = is_larger? a->rb + pes[r].low : a->rb - pes[r].high;
@@ -140,12 +277,12 @@ int mem_matesw(const mem_opt_t *opt, int64_t l_pac, const uint8_t *pac, const me
 		}
 		if (rb < 0) rb = 0;
 		if (re > l_pac<<1) re = l_pac<<1;
-		ref = bns_get_seq(l_pac, pac, rb, re, &len);
+		ref = bns_get_seq2(sc, l_pac, pac, rb, re, &len);
 		if (len == re - rb) { // no funny things happening
 			kswr_t aln;
 			mem_alnreg_t b;
 			int tmp, xtra = KSW_XSUBO | KSW_XSTART | (l_ms * opt->a < 250? KSW_XBYTE : 0) | opt->min_seed_len;
-			aln = ksw_align(l_ms, seq, len, ref, 5, opt->mat, opt->q, opt->r, xtra, 0);
+			aln = ksw_align(l_ms, seq, len, ref, 5, opt->mat, opt->q, opt->r, xtra, &mp->qp[is_rev]); // the profile is built at the first call
 			memset(&b, 0, sizeof(mem_alnreg_t));
 			if (aln.score >= opt->min_seed_len && aln.qb >= 0) { // something goes wrong if aln.qb < 0
 				b.qb = is_rev? l_ms - (aln.qe + 1) : aln.qb;                                                                                                                                                                              
@@ -168,7 +305,6 @@ int mem_matesw(const mem_opt_t *opt, int64_t l_pac, const uint8_t *pac, const me
 			++n;
 		}
 		if (n) ma->n = mem_sort_and_dedup(ma->n, ma->a, opt->mask_level_redun);
-		if (rev) free(rev);
 		free(ref);
 	}
 	return n;
@@ -233,12 +369,13 @@ int mem_pair(const mem_opt_t *opt, int64_t l_pac, const uint8_t *pac, const mem_
 	return ret;
 }
 
-int mem_sam_pe(const mem_opt_t *opt, const bntseq_t *bns, const uint8_t *pac, const mem_pestat_t pes[4], uint64_t id, bseq1_t s[2], mem_alnreg_v a[2])
+int mem_sam_pe(const mem_opt_t *opt, const bntseq_t *bns, const uint8_t *pac, bns_seqcache_t *sc, const mem_pestat_t pes[4], uint64_t id, bseq1_t s[2], mem_alnreg_v a[2])
 {
 	extern void mem_mark_primary_se(const mem_opt_t *opt, int n, mem_alnreg_t *a, int64_t id);
 	extern int mem_approx_mapq_se(const mem_opt_t *opt, const mem_alnreg_t *a);
-	extern void mem_reg2sam_se(const mem_opt_t *opt, const bntseq_t *bns, const uint8_t *pac, bseq1_t *s, mem_alnreg_v *a, int extra_flag, const mem_aln_t *m);
-	extern void mem_aln2sam(const bntseq_t *bns, kstring_t *str, bseq1_t *s, int n, const mem_aln_t *list, int which, const mem_aln_t *m);
+	extern mem_aln_t mem_reg2aln2(const mem_opt_t *opt, const bntseq_t *bns, const uint8_t *pac, bns_seqcache_t *sc, int l_query, const char *query_, const mem_alnreg_t *ar);
+	extern void mem_reg2sam_se(const mem_opt_t *opt, const bntseq_t *bns, const uint8_t *pac, bns_seqcache_t *sc, bseq1_t *s, mem_alnreg_v *a, int extra_flag, const mem_aln_t *m);
+	extern void mem_aln2str(const mem_opt_t *opt, const bntseq_t *bns, kstring_t *str, bseq1_t *s, int n, const mem_aln_t *list, int which, const mem_aln_t *m);
 
 	int n = 0, i, j, z[2], o, subo, n_sub, extra_flag = 1;
 	kstring_t str;
@@ -247,14 +384,17 @@ int mem_sam_pe(const mem_opt_t *opt, const bntseq_t *bns, const uint8_t *pac, co
 	str.l = str.m = 0; str.s = 0;
 	if (!(opt->flag & MEM_F_NO_RESCUE)) { // then perform SW for the best alignment
 		mem_alnreg_v b[2];
+		mem_mprof_t mp[2];
 		kv_init(b[0]); kv_init(b[1]);
+		memset(mp, 0, 2 * sizeof(mem_mprof_t));
 		for (i = 0; i < 2; ++i)
 			for (j = 0; j < a[i].n; ++j)
 				if (a[i].a[j].score >= a[i].a[0].score  - opt->pen_unpaired)
 					kv_push(mem_alnreg_t, b[i], a[i].a[j]);
 		for (i = 0; i < 2; ++i)
 			for (j = 0; j < b[i].n && j < opt->max_matesw; ++j)
-				n += mem_matesw(opt, bns->l_pac, pac, pes, &b[i].a[j], s[!i].l_seq, (uint8_t*)s[!i].seq, &a[!i]);
+				n += mem_matesw(opt, bns->l_pac, pac, sc, pes, &b[i].a[j], s[!i].l_seq, (uint8_t*)s[!i].seq, &a[!i], &mp[!i]);
+		mem_mprof_destroy(&mp[0]); mem_mprof_destroy(&mp[1]);
 		free(b[0].a); free(b[1].a);
 	}
 	mem_mark_primary_se(opt, a[0].n, a[0].a, id<<1|0);
@@ -299,10 +439,12 @@ int mem_sam_pe(const mem_opt_t *opt, const bntseq_t *bns, const uint8_t *pac, co
 			q_se[1] = mem_approx_mapq_se(opt, &a[1].a[0]);
 		}
 		// write SAM
-		h[0] = mem_reg2aln(opt, bns, pac, s[0].l_seq, s[0].seq, &a[0].a[z[0]]); h[0].mapq = q_se[0]; h[0].flag |= 0x40 | extra_flag;
-		h[1] = mem_reg2aln(opt, bns, pac, s[1].l_seq, s[1].seq, &a[1].a[z[1]]); h[1].mapq = q_se[1]; h[1].flag |= 0x80 | extra_flag;
-		mem_aln2sam(bns, &str, &s[0], 1, &h[0], 0, &h[1]); s[0].sam = strdup(str.s); str.l = 0;
-		mem_aln2sam(bns, &str, &s[1], 1, &h[1], 0, &h[0]); s[1].sam = str.s;
+		h[0] = mem_reg2aln2(opt, bns, pac, sc, s[0].l_seq, s[0].seq, &a[0].a[z[0]]); h[0].mapq = q_se[0]; h[0].flag |= 0x40 | extra_flag;
+		h[1] = mem_reg2aln2(opt, bns, pac, sc, s[1].l_seq, s[1].seq, &a[1].a[z[1]]); h[1].mapq = q_se[1]; h[1].flag |= 0x80 | extra_flag;
+		mem_aln2str(opt, bns, &str, &s[0], 1, &h[0], 0, &h[1]);
+		s[0].sam = malloc(str.l + 1), s[0].l_sam = str.l;
+		memcpy(s[0].sam, str.s, str.l + 1); str.l = 0;
+		mem_aln2str(opt, bns, &str, &s[1], 1, &h[1], 0, &h[0]); s[1].sam = str.s, s[1].l_sam = str.l;
 		if (strcmp(s[0].name, s[1].name) != 0) err_fatal(__func__, "paired reads have different names: \"%s\", \"%s\"\n", s[0].name, s[1].name);
 		free(h[0].cigar); free(h[1].cigar);
 	} else goto no_pairing;
@@ -311,8 +453,8 @@ int mem_sam_pe(const mem_opt_t *opt, const bntseq_t *bns, const uint8_t *pac, co
 no_pairing:
 	for (i = 0; i < 2; ++i) {
 		if (a[i].n && a[i].a[0].score >= opt->T)
-			h[i] = mem_reg2aln(opt, bns, pac, s[i].l_seq, s[i].seq, &a[i].a[0]);
-		else h[i] = mem_reg2aln(opt, bns, pac, s[i].l_seq, s[i].seq, 0);
+			h[i] = mem_reg2aln2(opt, bns, pac, sc, s[i].l_seq, s[i].seq, &a[i].a[0]);
+		else h[i] = mem_reg2aln2(opt, bns, pac, sc, s[i].l_seq, s[i].seq, 0);
 	}
 	if (!(opt->flag & MEM_F_NOPAIRING) && h[0].rid == h[1].rid && h[0].rid >= 0) { // if the top hits from the two ends constitute a proper pair, flag it.
 		int64_t dist;
@@ -320,8 +462,8 @@ no_pairing:
 		d = mem_infer_dir(bns->l_pac, a[0].a[0].rb, a[1].a[0].rb, &dist);
 		if (!pes[d].failed && dist >= pes[d].low && dist <= pes[d].high) extra_flag |= 2;
 	}
-	mem_reg2sam_se(opt, bns, pac, &s[0], &a[0], 0x41|extra_flag, &h[1]);
-	mem_reg2sam_se(opt, bns, pac, &s[1], &a[1], 0x81|extra_flag, &h[0]);
+	mem_reg2sam_se(opt, bns, pac, sc, &s[0], &a[0], 0x41|extra_flag, &h[1]);
+	mem_reg2sam_se(opt, bns, pac, sc, &s[1], &a[1], 0x81|extra_flag, &h[0]);
 	if (strcmp(s[0].name, s[1].name) != 0) err_fatal(__func__, "paired reads have different names: \"%s\", \"%s\"\n", s[0].name, s[1].name);
 	free(h[0].cigar); free(h[1].cigar);
 	return n;
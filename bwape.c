@@ -424,8 +424,8 @@ bwa_cigar_t *bwa_sw_core(bwtint_t l_pac, const ubyte_t *pacseq, int len, const u
 
 	// get reference subsequence
 	ref_seq = (ubyte_t*)calloc(reglen, 1);
-	for (k = *beg, l = 0; l < reglen && k < l_pac; ++k)
-		ref_seq[l++] = pacseq[k>>2] >> ((~k&3)<<1) & 3;
+	l = (int64_t)l_pac - *beg < reglen? l_pac - *beg : reglen;
+	bns_unpack(pacseq, *beg, *beg + l, 0, ref_seq);
 
 	// do alignment
 	xtra = KSW_XSUBO | KSW_XSTART | (len < 250? KSW_XBYTE : 0);
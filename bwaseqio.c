@@ -2,6 +2,7 @@
 #include <ctype.h>
 #include "bwtaln.h"
 #include "utils.h"
+#include "bgzfr.h"
 #include "bamlite.h"
 
 #include "kseq.h"
@@ -41,7 +42,7 @@ bwa_seqio_t *bwa_seq_open(const char *fn)
 	gzFile fp;
 	bwa_seqio_t *bs;
 	bs = (bwa_seqio_t*)calloc(1, sizeof(bwa_seqio_t));
-	fp = xzopen(fn, "r");
+	fp = bgzfr_open(fn, 1);
 	bs->ks = kseq_init(fp);
 	return bs;
 }
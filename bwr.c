@@ -0,0 +1,152 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <zlib.h>
+#include "bwr.h"
+#include "utils.h"
+
+#ifdef USE_MALLOC_WRAPPERS
+#  include "malloc_wrap.h"
+#endif
+
+static inline int32_t bwr_i32(const uint8_t *p) { return (int32_t)(p[0] | p[1]<<8 | p[2]<<16 | (uint32_t)p[3]<<24); }
+
+static int bwr_gzread(gzFile fp, void *buf, int len)
+{ // 1 if all $len bytes are read, 0 at the end of the file, -1 if truncated
+	int l = gzread(fp, buf, len);
+	return l == len? 1 : l == 0? 0 : -1;
+}
+
+bwr_file_t *bwr_open(const char *fn)
+{
+	bwr_file_t *f;
+	uint8_t b[8];
+	int i;
+	gzFile fp;
+	fp = strcmp(fn, "-")? gzopen(fn, "r") : gzdopen(fileno(stdin), "r");
+	if (fp == 0) return 0;
+	if (bwr_gzread(fp, b, 8) <= 0 || strncmp((char*)b, "BWR", 3) != 0 || b[3] == 0 || b[3] > BWR_VERSION) {
+		fprintf(stderr, "[E::%s] '%s' is not a BWR file of version %d or lower\n", __func__, fn, BWR_VERSION);
+		gzclose(fp);
+		return 0;
+	}
+	f = calloc(1, sizeof(bwr_file_t));
+	f->fp = fp, f->version = b[3];
+	f->n_ref = bwr_i32(b + 4);
+	f->name = calloc(f->n_ref, sizeof(char*));
+	f->len = calloc(f->n_ref, 8);
+	for (i = 0; i < f->n_ref; ++i) {
+		int l;
+		if (bwr_gzread(fp, b, 4) <= 0 || (l = bwr_i32(b)) <= 0) break;
+		f->name[i] = calloc(l, 1);
+		if (bwr_gzread(fp, f->name[i], l) <= 0 || bwr_gzread(fp, b, 8) <= 0) break;
+		f->len[i] = (int64_t)((uint64_t)(uint32_t)bwr_i32(b) | (uint64_t)(uint32_t)bwr_i32(b + 4) << 32);
+	}
+	if (i < f->n_ref) {
+		fprintf(stderr, "[E::%s] truncated BWR header in '%s'\n", __func__, fn);
+		bwr_close(f);
+		return 0;
+	}
+	return f;
+}
+
+void bwr_close(bwr_file_t *f)
+{
+	int i;
+	if (f == 0) return;
+	gzclose(f->fp);
+	for (i = 0; i < f->n_ref; ++i) free(f->name[i]);
+	free(f->name); free(f->len); free(f);
+}
+
+int bwr_read(bwr_file_t *f, bwr1_t *r)
+{
+	uint8_t b[4], *p;
+	int ret, i;
+	if ((ret = bwr_gzread(f->fp, b, 4)) <= 0) return ret;
+	r->l_data = bwr_i32(b);
+	if (r->l_data < 28) return -1;
+	if (r->l_data > r->m_data) {
+		r->m_data = r->l_data;
+		kroundup32(r->m_data);
+		r->data = realloc(r->data, r->m_data);
+	}
+	if (bwr_gzread(f->fp, r->data, r->l_data) <= 0) return -1;
+	p = r->data;
+	r->rid = bwr_i32(p), r->pos = bwr_i32(p + 4);
+	r->flag = p[8] | p[9]<<8;
+	r->mapq = p[10], r->l_name = p[11];
+	r->score = bwr_i32(p + 12), r->sub = bwr_i32(p + 16), r->NM = bwr_i32(p + 20);
+	r->n_cigar = bwr_i32(p + 24);
+	if (28 + r->l_name + 4 * (int64_t)r->n_cigar > r->l_data || r->l_name == 0 || p[28 + r->l_name - 1] != 0) return -1;
+	r->name = (char*)p + 28;
+	if (r->n_cigar > r->m_cigar) {
+		r->m_cigar = r->n_cigar;
+		kroundup32(r->m_cigar);
+		r->cigar = realloc(r->cigar, r->m_cigar * 4);
+	}
+	for (i = 0, p += 28 + r->l_name; i < r->n_cigar; ++i, p += 4)
+		r->cigar[i] = bwr_i32(p);
+	return 1;
+}
+
+void bwr_format_sam(const bwr_file_t *f, const bwr1_t *r, kstring_t *s)
+{
+	int i;
+	kputs(r->name, s); kputc('\t', s);
+	kputw(r->flag & ~(0x2|0x8|0x20), s); kputc('\t', s); // no mate fields; drop the flags about the mate
+	if (r->rid >= 0 && r->rid < f->n_ref) {
+		kputs(f->name[r->rid], s); kputc('\t', s);
+		kputw(r->pos + 1, s); kputc('\t', s);
+	} else kputsn("*\t0\t", 4, s);
+	kputw(r->mapq, s); kputc('\t', s);
+	if (r->n_cigar) {
+		for (i = 0; i < r->n_cigar; ++i) {
+			kputw(r->cigar[i]>>4, s); kputc("MIDSH"[r->cigar[i]&0xf], s);
+		}
+	} else kputc('*', s);
+	kputsn("\t*\t0\t0\t*\t*", 10, s);
+	if (r->n_cigar) { kputsn("\tNM:i:", 6, s); kputw(r->NM, s); }
+	if (r->score >= 0) { kputsn("\tAS:i:", 6, s); kputw(r->score, s); }
+	if (r->sub >= 0) { kputsn("\tXS:i:", 6, s); kputw(r->sub, s); }
+}
+
+int main_bwr2sam(int argc, char *argv[])
+{
+	bwr_file_t *f;
+	bwr1_t r;
+	kstring_t s = {0,0,0};
+	int i, c, ret, no_hdr = 0;
+	while ((c = getopt(argc, argv, "H")) >= 0) {
+		if (c == 'H') no_hdr = 1;
+		else return 1;
+	}
+	if (optind + 1 != argc) {
+		fprintf(stderr, "\n");
+		fprintf(stderr, "Usage: bwa bwr2sam [-H] <in.bwr>\n\n");
+		fprintf(stderr, "Options: -H       do not output the header\n\n");
+		fprintf(stderr, "Note: BWR does not keep the sequences, qualities and mate positions, so\n");
+		fprintf(stderr, "      the flags 0x2, 0x8 and 0x20 are cleared in the output.\n\n");
+		return 1;
+	}
+	if ((f = bwr_open(argv[optind])) == 0) {
+		fprintf(stderr, "[E::%s] fail to open file '%s'\n", __func__, argv[optind]);
+		return 1;
+	}
+	if (!no_hdr)
+		for (i = 0; i < f->n_ref; ++i)
+			err_printf("@SQ\tSN:%s\tLN:%ld\n", f->name[i], (long)f->len[i]);
+	memset(&r, 0, sizeof(bwr1_t));
+	while ((ret = bwr_read(f, &r)) > 0) {
+		s.l = 0;
+		bwr_format_sam(f, &r, &s);
+		kputc('\n', &s);
+		err_fwrite(s.s, 1, s.l, stdout);
+	}
+	if (ret < 0) fprintf(stderr, "[E::%s] truncated or malformed record\n", __func__);
+	free(r.data); free(r.cigar); free(s.s);
+	bwr_close(f);
+	err_fflush(stdout);
+	return ret < 0? 1 : 0;
+}
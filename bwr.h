@@ -0,0 +1,91 @@
+#ifndef BWA_BWR_H
+#define BWA_BWR_H
+
+#include <stdint.h>
+#include <zlib.h>
+#include "kstring.h"
+
+/* BWR: a compact binary format of alignment records
+ *
+ * BWR keeps the fields of mem_aln_t that most downstream tools need and
+ * nothing else: no sequence, quality or mate fields. It is written by
+ * `bwa mem -f bwr`. All integers are little-endian.
+ *
+ * Header:
+ *   char     magic[4]   "BWR\1"; the last byte is the format version
+ *   int32_t  n_ref      number of reference sequences
+ *   then for each reference sequence:
+ *     int32_t  l_name   length of the name including the NULL
+ *     char     name[l_name]
+ *     int64_t  len      length of the sequence
+ *
+ * Record:
+ *   int32_t  block_size length of the rest of the record
+ *   int32_t  rid        reference index; -1 if unmapped. An unmapped read
+ *                       with a mapped mate takes the mate's rid and pos,
+ *                       as in SAM
+ *   int32_t  pos        0-based leftmost position; -1 if unmapped
+ *   uint16_t flag       SAM FLAG as in the SAM output. Without the mate
+ *                       fields, a SAM converter should clear the mate bits
+ *                       0x2, 0x8 and 0x20, as `bwa bwr2sam` does
+ *   uint8_t  mapq       mapping quality
+ *   uint8_t  l_name     length of the read name including the NULL
+ *   int32_t  score      alignment score (AS); -1 if not available
+ *   int32_t  sub        suboptimal alignment score (XS); -1 if not available
+ *   int32_t  NM         edit distance
+ *   uint32_t n_cigar    number of CIGAR operations; 0 if unmapped
+ *   char     name[l_name]
+ *   uint32_t cigar[n_cigar]  len<<4|op, where op 0..4 stands for MIDSH
+ *
+ * Readers should skip the bytes of a record beyond the fields they know
+ * about, such that fields may be appended without changing the version.
+ */
+
+#define BWR_VERSION 1
+
+typedef struct {
+	int32_t rid, pos;
+	uint16_t flag;
+	uint8_t mapq, l_name;
+	int32_t score, sub, NM;
+	uint32_t n_cigar, m_cigar;
+	uint32_t *cigar;
+	char *name;       // points into $data
+	int l_data, m_data;
+	uint8_t *data;    // the raw record without block_size
+} bwr1_t;
+
+typedef struct {
+	gzFile fp;
+	int version;
+	int32_t n_ref;
+	char **name;
+	int64_t *len;
+} bwr_file_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+	/** Open a BWR file, possibly gzip'd, and read its header; "-" for stdin. Return NULL on failure. */
+	bwr_file_t *bwr_open(const char *fn);
+	void bwr_close(bwr_file_t *f);
+
+	/**
+	 * Read the next record
+	 *
+	 * The memory of $r is reused across calls; initialize $r with zeros and
+	 * free $r->data and $r->cigar in the end.
+	 *
+	 * @return  1 on success, 0 at the end of the file and -1 on a truncated or malformed record
+	 */
+	int bwr_read(bwr_file_t *f, bwr1_t *r);
+
+	/** Append $r as a SAM line, without SEQ, QUAL and the mate fields, to $s */
+	void bwr_format_sam(const bwr_file_t *f, const bwr1_t *r, kstring_t *s);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -34,6 +34,7 @@
 #include "bntseq.h"
 #include "bwt.h"
 #include "utils.h"
+#include "mzidx.h"
 
 #ifdef _DIVBWT
 #include "divsufsort.h"
@@ -184,16 +185,53 @@ int bwa_bwt2sa(int argc, char *argv[]) // the "bwt2sa" command
 	return 0;
 }
 
+static void bwa_idx_build_mz(const char *prefix) // write $prefix.mzi from $prefix.pac and $prefix.ann
+{
+	bntseq_t *bns;
+	uint8_t *pac;
+	mzidx_t *mz;
+	char *fn;
+	clock_t t = clock();
+	fprintf(stderr, "[bwa_index] Collect minimizers... ");
+	bns = bns_restore(prefix);
+	pac = calloc(bns->l_pac/4+1, 1);
+	err_fread_noeof(pac, 1, bns->l_pac/4+1, bns->fp_pac);
+	mz = mz_build(bns, pac, MZ_DEF_K, MZ_DEF_W);
+	fn = calloc(strlen(prefix) + 5, 1);
+	strcat(strcpy(fn, prefix), ".mzi");
+	mz_dump(fn, mz);
+	fprintf(stderr, "%ld minimizers in %.2f sec\n", (long)mz->n, (float)(clock() - t) / CLOCKS_PER_SEC);
+	mz_destroy(mz); free(pac); bns_destroy(bns); free(fn);
+}
+
+int bwa_mzindex(int argc, char *argv[]) // the "mzindex" command
+{
+	char *prefix;
+	extern char *bwa_idx_infer_prefix(const char *hint);
+	if (argc < 2) {
+		fprintf(stderr, "Usage: bwa mzindex <idxbase>\n\n");
+		fprintf(stderr, "Collect the minimizers (k=%d, w=%d) of an existing index into <idxbase>.mzi for `bwa mem -z'.\n", MZ_DEF_K, MZ_DEF_W);
+		return 1;
+	}
+	if ((prefix = bwa_idx_infer_prefix(argv[1])) == 0) {
+		fprintf(stderr, "[E::%s] fail to locate the index files\n", __func__);
+		return 1;
+	}
+	bwa_idx_build_mz(prefix);
+	free(prefix);
+	return 0;
+}
+
 int bwa_index(int argc, char *argv[]) // the "index" command
 {
 	extern void bwa_pac_rev_core(const char *fn, const char *fn_rev);
 
 	char *prefix = 0, *str, *str2, *str3;
-	int c, algo_type = 0, is_64 = 0;
+	int c, algo_type = 0, is_64 = 0, build_mz = 0;
 	clock_t t;
 	int64_t l_pac;
 
-	while ((c = getopt(argc, argv, "6a:p:")) >= 0) {
+	while ((c = getopt(argc, argv, "6a:p:M")) >= 0) {
 		switch (c) {
 		case 'a': // if -a is not set, algo_type will be determined later
 			if (strcmp(optarg, "div") == 0) algo_type = 1;
@@ -203,16 +241,19 @@ int bwa_index(int argc, char *argv[]) // the "index" command
 			break;
 		case 'p': prefix = strdup(optarg); break;
 		case '6': is_64 = 1; break;
+		case 'M': build_mz = 1; break;
 		default: return 1;
 		}
 	}
 
 	if (optind + 1 > argc) {
 		fprintf(stderr, "\n");
-		fprintf(stderr, "Usage:   bwa index [-a bwtsw|is] [-c] <in.fasta>\n\n");
+		fprintf(stderr, "Usage:   bwa index [-a bwtsw|is] [-M] <in.fasta>\n\n");
 		fprintf(stderr, "Options: -a STR    BWT construction algorithm: bwtsw or is [auto]\n");
 		fprintf(stderr, "         -p STR    prefix of the index [same as fasta name]\n");
 		fprintf(stderr, "         -6        index files named as <in.fasta>.64.* instead of <in.fasta>.* \n");
+		fprintf(stderr, "         -M        also build the minimizer index (k=%d, w=%d) for `bwa mem -z';\n", MZ_DEF_K, MZ_DEF_W);
+		fprintf(stderr, "                   `bwa mzindex' adds it to an existing index\n");
 		fprintf(stderr, "\n");
 		fprintf(stderr,	"Warning: `-a bwtsw' does not work for short genomes, while `-a is' and\n");
 		fprintf(stderr, "         `-a div' do not work not for long genomes. Please choose `-a'\n");
@@ -282,6 +323,7 @@ int bwa_index(int argc, char *argv[]) // the "index" command
 		bwt_destroy(bwt);
 		fprintf(stderr, "%.2f sec\n", (float)(clock() - t) / CLOCKS_PER_SEC);
 	}
+	if (build_mz) bwa_idx_build_mz(prefix);
 	free(str3); free(str2); free(str); free(prefix);
 	return 0;
 }
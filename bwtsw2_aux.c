@@ -13,6 +13,7 @@
 #include "bwtsw2.h"
 #include "kstring.h"
 #include "bwa.h"
+#include "bgzfr.h"
 #include "ksw.h"
 
 #include "kseq.h"
@@ -127,9 +128,9 @@ void bsw2_extend_left(const bsw2opt_t *opt, bwtsw2_t *b, uint8_t *_query, int lq
 		}
 		if (score) continue;
 		if (lt > p->k) lt = p->k;
-		for (k = p->k - 1, j = 0; k > 0 && j < lt; --k) // FIXME: k=0 not considered!
-			target[j++] = pac[k>>2] >> (~k&3)*2 & 0x3;
-		lt = j;
+		k = p->k - lt > 0? p->k - lt : 1; // FIXME: k=0 not considered!
+		bns_unpack(pac, k, p->k, 1, target);
+		lt = p->k - k;
 		score = ksw_extend(p->beg, &query[lq - p->beg], lt, target, 5, mat, opt->q, opt->r, opt->bw, 0, -1, p->G, &qle, &tle, 0, 0, 0);
 		if (score > p->G) { // extensible
 			p->G = score;
@@ -144,7 +145,6 @@ void bsw2_extend_left(const bsw2opt_t *opt, bwtsw2_t *b, uint8_t *_query, int lq
 void bsw2_extend_rght(const bsw2opt_t *opt, bwtsw2_t *b, uint8_t *query, int lq, uint8_t *pac, bwtint_t l_pac, uint8_t *_mem)
 {
 	int i;
-	bwtint_t k;
 	uint8_t *target;
 	int8_t mat[25];
 
@@ -153,11 +153,10 @@ void bsw2_extend_rght(const bsw2opt_t *opt, bwtsw2_t *b, uint8_t *query, int lq,
 	for (i = 0; i < b->n; ++i) {
 		bsw2hit_t *p = b->hits + i;
 		int lt = ((lq - p->beg + 1) / 2 * opt->a + opt->r) / opt->r + lq;
-		int j, score, qle, tle;
+		int score, qle, tle;
 		if (p->l) continue;
-		for (k = p->k, j = 0; k < p->k + lt && k < l_pac; ++k)
-			target[j++] = pac[k>>2] >> (~k&3)*2 & 0x3;
-		lt = j;
+		if (p->k + lt > l_pac) lt = p->k < l_pac? l_pac - p->k : 0;
+		bns_unpack(pac, p->k, p->k + lt, 0, target);
 		score = ksw_extend(lq - p->beg, &query[p->beg], lt, target, 5, mat, opt->q, opt->r, opt->bw, 0, -1, 1, &qle, &tle, 0, 0, 0) - 1;
 //		if (score < p->G) fprintf(stderr, "[bsw2_extend_hits] %d < %d\n", score, p->G);
 		if (score >= p->G) {
@@ -473,7 +472,7 @@ static void update_mate_aux(bwtsw2_t *b, const bwtsw2_t *m)
 }
 
 /* generate SAM lines for a sequence in ks with alignment stored in
- * b. ks->name and ks->seq will be freed and set to NULL in the end. */
+ * b. ks->name and ks->seq will be set to NULL in the end. */
 static void print_hits(const bntseq_t *bns, const bsw2opt_t *opt, bsw2seq1_t *ks, bwtsw2_t *b, int is_pe, bwtsw2_t *bmate)
 {
 	int i, k;
@@ -537,9 +536,7 @@ static void print_hits(const bntseq_t *bns, const bsw2opt_t *opt, bsw2seq1_t *ks
 		kputc('\n', &str);
 	}
 	ks->sam = str.s;
-	free(ks->seq); ks->seq = 0;
-	free(ks->qual); ks->qual = 0;
-	free(ks->name); ks->name = 0;
+	ks->seq = ks->qual = ks->name = 0; // allocated by bseq_read() and freed in bsw2_aln()
 }
 
 static void update_opt(bsw2opt_t *dst, const bsw2opt_t *src, int qlen)
@@ -716,7 +713,7 @@ static void process_seqs(bsw2seq_t *_seq, const bsw2opt_t *opt, const bntseq_t *
 	for (i = 0; i < _seq->n; ++i) {
 		bsw2seq1_t *p = _seq->seq + i;
 		if (p->sam) err_printf("%s", p->sam);
-		free(p->name); free(p->seq); free(p->qual); free(p->sam);
+		free(p->sam);
 		p->tid = -1; p->l = 0;
 		p->name = p->seq = p->qual = p->sam = 0;
 	}
@@ -737,11 +734,11 @@ void bsw2_aln(const bsw2opt_t *opt, const bntseq_t *bns, bwt_t * const target, c
 	for (l = 0; l < bns->n_seqs; ++l)
 		err_printf("@SQ\tSN:%s\tLN:%d\n", bns->anns[l].name, bns->anns[l].len);
 	err_fread_noeof(pac, 1, bns->l_pac/4+1, bns->fp_pac);
-	fp = xzopen(fn, "r");
+	fp = bgzfr_open(fn, opt->n_threads);
 	ks = kseq_init(fp);
 	_seq = calloc(1, sizeof(bsw2seq_t));
 	if (fn2) {
-		fp2 = xzopen(fn2, "r");
+		fp2 = bgzfr_open(fn2, opt->n_threads);
 		ks2 = kseq_init(fp2);
 		is_pe = 1;
 	} else fp2 = 0, ks2 = 0, is_pe = 0;
@@ -761,8 +758,8 @@ void bsw2_aln(const bsw2opt_t *opt, const bntseq_t *bns, bwt_t * const target, c
 			size += p->l;
 		}
 		fprintf(stderr, "[bsw2_aln] read %d sequences/pairs (%d bp) ...\n", n, size);
-		free(bseq);
 		process_seqs(_seq, opt, bns, pac, target, is_pe);
+		free(bseq);
 	}
 	// free
 	free(pac);
@@ -4,9 +4,22 @@
 #include <stdlib.h>
 #include <ctype.h>
 #include <math.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
 #include "bwa.h"
 #include "bwamem.h"
+#include "bgzfw.h"
+#include "bamsort.h"
+#include "bgzfr.h"
 #include "kvec.h"
+#include "kstring.h"
 #include "utils.h"
 #include "kseq.h"
 #include "utils.h"
@@ -17,20 +30,756 @@ extern unsigned char nst_nt4_table[256];
 void *kopen(const char *fn, int *_fd);
 int kclose(void *a);
 
+static void write_sam(void *data, const void *buf, size_t len) { err_fwrite(buf, 1, len, (FILE*)data); }
+static void write_bam(void *data, const void *buf, size_t len) { bgzfw_write((bgzfw_t*)data, buf, len); }
+static void write_sort(void *data, const void *buf, size_t len) { bamsort_add((bamsort_t*)data, (const uint8_t*)buf, len); }
+
+static void write_str(void *data, const void *buf, size_t len) { kputsn((const char*)buf, len, (kstring_t*)data); }
+
+typedef struct { // options not in mem_opt_t
+	int copy_comment, use_pm, bam_level, bam_sort, sort_mem;
+	int n_workers; // number of worker processes; 0 to align in this process
+	const mem_pestat_t *pes0;
+} mem_io_t;
+
+static int mem_write_fd(int fd, const void *buf, size_t len)
+{ // write all of $buf; -1 on error
+	const char *p = (const char*)buf;
+	while (len > 0) {
+		ssize_t l = write(fd, p, len);
+		if (l < 0 && errno == EINTR) continue;
+		if (l <= 0) return -1;
+		p += l, len -= l;
+	}
+	return 0;
+}
+
+static int mem_read_fd(int fd, void *buf, size_t len)
+{ // read exactly $len bytes; -1 on error or at the end of the stream
+	char *p = (char*)buf;
+	while (len > 0) {
+		ssize_t l = read(fd, p, len);
+		if (l < 0 && errno == EINTR) continue;
+		if (l <= 0) return -1;
+		p += l, len -= l;
+	}
+	return 0;
+}
+
+static gzFile mem_open(mem_opt_t *opt, const mem_io_t *io, int fd, kseq_t **ks, bseq_bam_t **bam)
+{ // open $fd as FASTA/Q or BAM, with decompression in the background; MEM_F_PE follows the flags of BAM input
+	gzFile fp;
+	int c;
+	*ks = 0, *bam = 0;
+	fp = gzdopen(bgzfr_dopen(fd, opt->n_threads), "r");
+	if ((c = gzgetc(fp)) >= 0) gzungetc(c, fp);
+	if (c == 'B') { // BAM input; FASTA/Q starts with '>' or '@'
+		if ((*bam = bseq_bam_init(fp, io->copy_comment)) == 0) {
+			err_gzclose(fp);
+			return 0;
+		}
+		if (bseq_bam_is_paired(*bam)) {
+			if (bwa_verbose >= 3)
+				fprintf(stderr, "[M::%s] pairing BAM records by the READ1/READ2 flags\n", __func__);
+			opt->flag |= MEM_F_PE;
+		} else opt->flag &= ~MEM_F_PE;
+	} else *ks = kseq_init(fp);
+	return fp;
+}
+
+static void mem_numa_bind(void *data, int tid) { bwa_numa_bind((const bwa_numa_t*)data, tid); }
+
+static void *mem_pool_init(const mem_opt_t *opt)
+{ // persistent threads, each pinned to the NUMA node of its index replica if there are replicas
+	extern void *kt_forpool_init(int n_threads, void (*init)(void*,int), void *init_data);
+	return kt_forpool_init(opt->n_threads, opt->numa? mem_numa_bind : 0, (void*)opt->numa);
+}
+
+static bseq1_t *mem_read(const mem_opt_t *opt, const mem_io_t *io, kseq_t *ks, kseq_t *ks2, bseq_bam_t *bam, int *n_)
+{ // read the next batch from $bam, or $ks and $ks2
+	bseq1_t *seqs;
+	int64_t size = 0;
+	int i, n;
+	seqs = bam? bseq_read_bam(opt->chunk_size * opt->n_threads, &n, bam, opt->flag&MEM_F_PE) : bseq_read(opt->chunk_size * opt->n_threads, &n, ks, ks2);
+	if (seqs == 0) return 0;
+	if ((opt->flag & MEM_F_PE) && (n&1) == 1) {
+		if (bwa_verbose >= 2)
+			fprintf(stderr, "[W::%s] odd number of reads in the PE mode; last read dropped\n", __func__);
+		n = n>>1<<1;
+	}
+	if (!io->copy_comment)
+		for (i = 0; i < n; ++i) {
+			seqs[i].comment = 0;
+		}
+	for (i = 0; i < n; ++i) size += seqs[i].l_seq;
+	if (bwa_verbose >= 3)
+		fprintf(stderr, "[M::%s] read %d sequences (%ld bp)...\n", __func__, n, (long)size);
+	*n_ = n;
+	return seqs;
+}
+
+static void mem_align(const mem_opt_t *opt, const mem_io_t *io, const bwaidx_t *idx, kseq_t *ks, kseq_t *ks2, bseq_bam_t *bam, mem_writer_t *wr)
+{ // align all reads from $bam, or $ks and $ks2, and hand the output to $wr
+	int n;
+	bseq1_t *seqs;
+	int64_t n_processed = 0;
+	mem_pesmod_t *pm = 0;
+	if (io->use_pm) pm = mem_pesmod_init(opt, io->pes0);
+	while ((seqs = mem_read(opt, io, ks, ks2, bam, &n)) != 0) {
+		mem_process_seqs2(opt, idx->bwt, idx->mz, idx->bns, idx->pac, n_processed, n, seqs, io->pes0, pm, wr); // output is written by $wr
+		n_processed += n;
+		free(seqs);
+	}
+	mem_pesmod_destroy(pm);
+}
+
+/*************************
+ * Worker processes mode *
+ *************************/
+
+/* The parent reads batches and sends batch k to worker k % n_workers over a
+ * pipe. A worker is a child forked after the index is loaded, so all workers
+ * share the index pages copy-on-write. It aligns a batch with its own -t
+ * threads and sends the output back over another pipe. The parent collects
+ * the output of the batches in the input order, so each worker has at most
+ * one batch in flight. Workers are forked before the input is opened, such
+ * that they don't inherit the threads decompressing the input.
+ */
+
+typedef struct {
+	int64_t n_processed, len; // $len bytes of packed reads or of output follow
+	int32_t n, flag;          // number of reads and mem_opt_t::flag for the batch
+} mem_msg_t;
+
+typedef struct {
+	int n;
+	int *fd_to, *fd_from; // pipes to and from each worker
+	pid_t *pid;
+} mem_mp_t;
+
+static void mem_worker(mem_opt_t *opt, const mem_io_t *io, const bwaidx_t *idx, int fd_in, int fd_out)
+{ // align batches from $fd_in until it is closed
+	extern void kt_forpool_destroy(void *fp);
+	mem_msg_t m;
+	kstring_t out = {0,0,0};
+	char *buf = 0;
+	int64_t m_buf = 0;
+	int i, m_seqs = 0;
+	bseq1_t *seqs = 0;
+	mem_pesmod_t *pm = 0;
+	mem_writer_t *wr;
+	if (io->use_pm) pm = mem_pesmod_init(opt, io->pes0);
+	if (opt->numa) opt->pool = mem_pool_init(opt); // threads of the parent are gone after fork()
+	wr = mem_writer_init(write_str, &out);
+	while (mem_read_fd(fd_in, &m, sizeof(mem_msg_t)) == 0) {
+		char *p;
+		if (m.len > m_buf) m_buf = m.len, buf = realloc(buf, m_buf);
+		if (m.n > m_seqs) m_seqs = m.n, seqs = realloc(seqs, m_seqs * sizeof(bseq1_t));
+		if (mem_read_fd(fd_in, buf, m.len) < 0) break;
+		for (i = 0, p = buf; i < m.n; ++i) { // unpack; the strings stay in $buf
+			bseq1_t *s = &seqs[i];
+			s->name = p, p += strlen(p) + 1;
+			s->comment = *p? p : 0, p += strlen(p) + 1;
+			s->seq = p, s->l_seq = strlen(p), p += s->l_seq + 1;
+			s->qual = *p? p : 0, p += strlen(p) + 1;
+			s->sam = 0, s->l_sam = 0;
+		}
+		opt->flag = m.flag, out.l = 0;
+		mem_process_seqs2(opt, idx->bwt, idx->mz, idx->bns, idx->pac, m.n_processed, m.n, seqs, io->pes0, pm, wr);
+		m.len = out.l;
+		if (mem_write_fd(fd_out, &m, sizeof(mem_msg_t)) < 0 || mem_write_fd(fd_out, out.s, out.l) < 0) break;
+	}
+	mem_writer_destroy(wr);
+	mem_pesmod_destroy(pm);
+	kt_forpool_destroy(opt->pool);
+	free(buf); free(seqs); free(out.s);
+}
+
+static mem_mp_t *mem_mp_init(const mem_opt_t *opt, const mem_io_t *io, const bwaidx_t *idx)
+{
+	mem_mp_t *mp;
+	int i, j;
+	mp = calloc(1, sizeof(mem_mp_t));
+	mp->n = io->n_workers;
+	mp->fd_to = calloc(mp->n, sizeof(int));
+	mp->fd_from = calloc(mp->n, sizeof(int));
+	mp->pid = calloc(mp->n, sizeof(pid_t));
+	fflush(stdout); fflush(stderr); // or buffered data are written by the workers, too
+	for (i = 0; i < mp->n; ++i) {
+		int to[2], from[2];
+		if (pipe(to) < 0 || pipe(from) < 0 || (mp->pid[i] = fork()) < 0)
+			err_fatal(__func__, "fail to start worker %d: %s", i, strerror(errno));
+		if (mp->pid[i] == 0) { // the worker
+			mem_opt_t o = *opt;
+			bwa_numa_t nm;
+			if (opt->numa) { // all threads of worker $i on node i % n_node, using the replica there
+				int k = i % opt->numa->n_node;
+				nm = *opt->numa;
+				nm.n_node = 1, nm.n_cpu += k, nm.cpu += k, nm.bwt += k, nm.pac += k;
+				o.numa = &nm;
+			}
+			for (j = 0; j < i; ++j) close(mp->fd_to[j]), close(mp->fd_from[j]); // or earlier workers never see the end of their input
+			close(to[1]); close(from[0]);
+			mem_worker(&o, io, idx, to[0], from[1]);
+			_exit(0); // not exit(), which would flush the stdio buffers of the parent
+		}
+		close(to[0]); close(from[1]);
+		mp->fd_to[i] = to[1], mp->fd_from[i] = from[0];
+	}
+	if (bwa_verbose >= 3)
+		fprintf(stderr, "[M::%s] started %d worker processes with %d threads each\n", __func__, mp->n, opt->n_threads);
+	return mp;
+}
+
+static void mem_mp_destroy(mem_mp_t *mp)
+{
+	int i, status;
+	if (mp == 0) return;
+	for (i = 0; i < mp->n; ++i) close(mp->fd_to[i]), close(mp->fd_from[i]);
+	for (i = 0; i < mp->n; ++i)
+		if (waitpid(mp->pid[i], &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			fprintf(stderr, "[W::%s] worker %d did not exit normally\n", __func__, i);
+	free(mp->fd_to); free(mp->fd_from); free(mp->pid); free(mp);
+}
+
+static void mem_mp_send(mem_mp_t *mp, int w, const mem_opt_t *opt, int64_t n_processed, int n, const bseq1_t *seqs, kstring_t *str)
+{
+	mem_msg_t m;
+	int i;
+	for (i = 0, str->l = 0; i < n; ++i) { // NULL-terminated name, comment, seq and qual; an empty string stands for NULL
+		const bseq1_t *s = &seqs[i];
+		kputs(s->name, str); kputc(0, str);
+		if (s->comment) kputs(s->comment, str);
+		kputc(0, str);
+		kputsn(s->seq, s->l_seq, str); kputc(0, str);
+		if (s->qual) kputsn(s->qual, s->l_seq, str);
+		kputc(0, str);
+	}
+	m.n_processed = n_processed, m.len = str->l, m.n = n, m.flag = opt->flag;
+	if (mem_write_fd(mp->fd_to[w], &m, sizeof(mem_msg_t)) < 0 || mem_write_fd(mp->fd_to[w], str->s, str->l) < 0)
+		err_fatal(__func__, "fail to send a batch to worker %d", w);
+}
+
+static void mem_mp_recv(mem_mp_t *mp, int w, void (*write)(void*,const void*,size_t), void *data, kstring_t *str)
+{
+	mem_msg_t m;
+	if (mem_read_fd(mp->fd_from[w], &m, sizeof(mem_msg_t)) < 0)
+		err_fatal(__func__, "worker %d has quit unexpectedly", w);
+	str->l = 0;
+	ks_resize(str, m.len + 1);
+	if (mem_read_fd(mp->fd_from[w], str->s, m.len) < 0)
+		err_fatal(__func__, "truncated output from worker %d", w);
+	write(data, str->s, m.len);
+}
+
+static void mem_mp_align(mem_mp_t *mp, const mem_opt_t *opt, const mem_io_t *io, kseq_t *ks, kseq_t *ks2, bseq_bam_t *bam, void (*write)(void*,const void*,size_t), void *data)
+{ // same as mem_align() with the batches aligned by the workers
+	int n;
+	int64_t n_processed = 0, n_sent = 0, n_recv = 0;
+	bseq1_t *seqs;
+	kstring_t str = {0,0,0};
+	while ((seqs = mem_read(opt, io, ks, ks2, bam, &n)) != 0) {
+		if (n_sent - n_recv == mp->n) // the worker for this batch is busy with an earlier one
+			mem_mp_recv(mp, n_recv++ % mp->n, write, data, &str);
+		mem_mp_send(mp, n_sent++ % mp->n, opt, n_processed, n, seqs, &str);
+		n_processed += n;
+		free(seqs);
+	}
+	while (n_recv < n_sent)
+		mem_mp_recv(mp, n_recv++ % mp->n, write, data, &str);
+	free(str.s);
+}
+
+static int mem_run(const mem_opt_t *opt0, const mem_io_t *io, const bwaidx_t *idx, const char *fn1, const char *fn2, const char *rg_line)
+{ // align $fn1, and $fn2 if not NULL, and write to stdout
+	extern void kt_forpool_destroy(void *fp);
+	mem_opt_t opt_, *opt = &opt_;
+	int fd, fd2;
+	gzFile fp, fp2 = 0;
+	kseq_t *ks = 0, *ks2 = 0;
+	bseq_bam_t *bam = 0;
+	void *ko = 0, *ko2 = 0;
+	bgzfw_t *bw = 0;
+	bamsort_t *bs = 0;
+	mem_writer_t *wr = 0;
+	mem_mp_t *mp = 0;
+
+	*opt = *opt0; // the input may turn on MEM_F_PE
+	ko = kopen(fn1, &fd);
+	if (ko == 0) {
+		if (bwa_verbose >= 1) fprintf(stderr, "[E::%s] fail to open file `%s'.\n", __func__, fn1);
+		return 1;
+	}
+	if (io->n_workers > 0) mp = mem_mp_init(opt, io, idx); // before mem_open() starts threads
+	if ((fp = mem_open(opt, io, fd, &ks, &bam)) == 0) {
+		mem_mp_destroy(mp);
+		return 1;
+	}
+	if (fn2) {
+		if (bam) {
+			if (bwa_verbose >= 1)
+				fprintf(stderr, "[E::%s] a second query file can't be used with BAM input.\n", __func__);
+			mem_mp_destroy(mp);
+			return 1;
+		} else if (opt->flag&MEM_F_PE) {
+			if (bwa_verbose >= 2)
+				fprintf(stderr, "[W::%s] when '-p' is in use, the second query file will be ignored.\n", __func__);
+		} else {
+			ko2 = kopen(fn2, &fd2);
+			if (ko2 == 0) {
+				if (bwa_verbose >= 1) fprintf(stderr, "[E::%s] fail to open file `%s'.\n", __func__, fn2);
+				mem_mp_destroy(mp);
+				return 1;
+			}
+			fp2 = gzdopen(bgzfr_dopen(fd2, opt->n_threads), "r");
+			ks2 = kseq_init(fp2);
+			opt->flag |= MEM_F_PE;
+		}
+	}
+	if (opt->flag & MEM_F_BAM) {
+		char *hdr;
+		int l_hdr;
+		bw = bgzfw_open(stdout, io->bam_level, opt->n_threads);
+		hdr = bwa_bam_hdr(idx->bns, rg_line, io->bam_sort, &l_hdr);
+		bgzfw_write(bw, hdr, l_hdr);
+		bgzfw_flush(bw); // the header in its own blocks
+		free(hdr);
+		if (io->bam_sort)
+			bs = bamsort_init(getenv("TMPDIR")? getenv("TMPDIR") : "/tmp", (size_t)io->sort_mem<<20, opt->n_threads);
+	} else if (opt->flag & MEM_F_BWR) {
+		char *hdr;
+		int l_hdr;
+		hdr = bwa_bwr_hdr(idx->bns, &l_hdr);
+		err_fwrite(hdr, 1, l_hdr, stdout);
+		free(hdr);
+	} else bwa_print_sam_hdr(idx->bns, rg_line);
+	if (mp) {
+		mem_mp_align(mp, opt, io, ks, ks2, bam, bs? write_sort : bw? write_bam : write_sam, bs? (void*)bs : bw? (void*)bw : (void*)stdout);
+		mem_mp_destroy(mp);
+	} else {
+		if (opt->numa) opt->pool = mem_pool_init(opt);
+		wr = bs? mem_writer_init(write_sort, bs) : bw? mem_writer_init(write_bam, bw) : mem_writer_init(write_sam, stdout);
+		mem_align(opt, io, idx, ks, ks2, bam, wr);
+		kt_forpool_destroy(opt->pool);
+	}
+
+	mem_writer_destroy(wr);
+	if (bs) bamsort_finish(bs, bw);
+	bgzfw_close(bw);
+	kseq_destroy(ks);
+	bseq_bam_destroy(bam);
+	err_gzclose(fp); kclose(ko);
+	if (ks2) {
+		kseq_destroy(ks2);
+		err_gzclose(fp2); kclose(ko2);
+	}
+	return 0;
+}
+
+static int mem_manifest1(const mem_opt_t *opt, const mem_io_t *io, const bwaidx_t *idx, char *const *f, const char *rg_line0)
+{ // align one sample in the manifest; return 0 on success
+	char *rg_line = 0;
+	int ret, fd;
+	if (strcmp(f[2], "*") != 0) {
+		if ((rg_line = bwa_set_rg(f[2])) == 0) return 1;
+	} else if (rg_line0) {
+		rg_line = bwa_set_rg(rg_line0); // set bwa_rg_id back
+	} else bwa_rg_id[0] = 0;
+	if (bwa_verbose >= 3)
+		fprintf(stderr, "[M::%s] aligning %s%s%s to %s\n", __func__, f[0], strcmp(f[1], "*")? " and " : "", strcmp(f[1], "*")? f[1] : "", f[3]);
+	if ((fd = open(f[3], O_WRONLY|O_CREAT|O_TRUNC, 0666)) < 0) { // not xreopen(), which would stop the remaining samples
+		fprintf(stderr, "[E::%s] fail to open file '%s': %s\n", __func__, f[3], strerror(errno));
+		free(rg_line);
+		return 1;
+	}
+	err_fflush(stdout);
+	dup2(fd, fileno(stdout));
+	close(fd);
+	ret = mem_run(opt, io, idx, f[0], strcmp(f[1], "*")? f[1] : 0, rg_line);
+	err_fflush(stdout);
+	free(rg_line);
+	return ret;
+}
+
+static int mem_manifest(const mem_opt_t *opt, const mem_io_t *io, const bwaidx_t *idx, const char *fn, const char *rg_line0, int n_jobs)
+{ // align the samples in $fn back to back, or up to $n_jobs of them at the same time in child processes sharing $idx
+	FILE *fp;
+	char *line = 0, *f[4];
+	size_t m_line = 0;
+	int i, n_running = 0, n_failed = 0, status;
+	kvec_t(char*) lines = {0,0,0};
+	fp = strcmp(fn, "-")? xopen(fn, "r") : stdin;
+	while (getline(&line, &m_line, fp) >= 0) // read all lines first, so that no child process inherits unread input in $fp
+		kv_push(char*, lines, strdup(line));
+	free(line);
+	if (fp != stdin) err_fclose(fp);
+	for (i = 0; i < lines.n; ++i) {
+		char *p, *q;
+		int k, lineno = i + 1;
+		line = lines.a[i];
+		for (p = line, k = 0; k < 4; ++k) { // split into TAB-delimited fields
+			for (q = p; *q && *q != '\t' && *q != '\n' && *q != '\r'; ++q);
+			f[k] = p;
+			if (*q != '\t') { *q = 0; break; }
+			*q = 0, p = q + 1;
+		}
+		if (line[0] == 0 || line[0] == '#') continue;
+		if (k != 3 || strcmp(f[3], "-") == 0) {
+			fprintf(stderr, "[E::%s] line %d of '%s': expect four fields: <in1.fq> <in2.fq|*> <RGline|*> <out>\n", __func__, lineno, fn);
+			++n_failed;
+			continue;
+		}
+		if (n_jobs > 1) {
+			pid_t pid;
+			for (; n_running >= n_jobs; --n_running)
+				if (wait(&status) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) ++n_failed;
+			fflush(stdout); fflush(stderr); // or buffered data are written twice
+			if ((pid = fork()) < 0) err_fatal(__func__, "fork() failed: %s", strerror(errno));
+			if (pid == 0) _exit(mem_manifest1(opt, io, idx, f, rg_line0)); // the index pages are shared copy-on-write
+			++n_running;
+		} else if (mem_manifest1(opt, io, idx, f, rg_line0) != 0) ++n_failed;
+	}
+	for (; n_running > 0; --n_running)
+		if (wait(&status) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) ++n_failed;
+	for (i = 0; i < lines.n; ++i) free(lines.a[i]);
+	free(lines.a);
+	if (n_failed > 0)
+		fprintf(stderr, "[E::%s] %d sample(s) failed\n", __func__, n_failed);
+	return n_failed > 0? 1 : 0;
+}
+
+/*********************************************
+ * Alignment server on a Unix domain socket *
+ *********************************************/
+
+/* Protocol
+ *
+ * Request:  one line of TAB-delimited options out of -p, -a, -M, -C, -P, -S,
+ *           -T INT and -R STR, followed by frames of FASTA/FASTQ, possibly
+ *           gzip'd. A frame is a 32-bit little-endian length and the data; an
+ *           empty frame ends the request.
+ * Response: frames of SAM, an empty frame and then a status line, "OK\n" or
+ *           "ERR <message>\n". The server closes the connection in the end.
+ *           The output is incomplete unless the status is OK.
+ *
+ * The server forks -n server processes (1 by default) that share the index
+ * copy-on-write. Each starts its pool of -t threads once and serves one
+ * request at a time on it, so up to -n requests are aligned at the same
+ * time. An input error that is reported by a return value ends the request
+ * with an ERR status. A fatal error, such as truncated gzip input, ends the
+ * server process. Its client then sees no status, and the parent forks a
+ * new process, paying the cost of starting a pool for that request only.
+ * The input is read in a separate thread, so a client must read the
+ * response while sending its reads.
+ */
+
+#define MEM_SRV_FRAME   0x10000
+#define MEM_SRV_MAX_ARG 64
+
+typedef struct {
+	int sock, fd_out; // the deframer copies from $sock to $fd_out
+	int err;          // set when the client can't take more output
+} mem_conn_t;
+
+static void *mem_srv_deframe(void *data)
+{ // copy frames from the socket to the pipe until an empty frame
+	mem_conn_t *c = (mem_conn_t*)data;
+	uint8_t *buf, b[4];
+	buf = malloc(MEM_SRV_FRAME);
+	while (mem_read_fd(c->sock, b, 4) == 0) {
+		uint32_t l, len = b[0] | b[1]<<8 | b[2]<<16 | (uint32_t)b[3]<<24;
+		if (len == 0) break;
+		for (; len > 0; len -= l) {
+			l = len < MEM_SRV_FRAME? len : MEM_SRV_FRAME;
+			if (mem_read_fd(c->sock, buf, l) < 0 || mem_write_fd(c->fd_out, buf, l) < 0)
+				goto end_deframe; // the client is gone or the input is no longer read
+		}
+	}
+end_deframe:
+	close(c->fd_out);
+	free(buf);
+	return 0;
+}
+
+static int mem_write_frame(int fd, const void *buf, uint32_t len)
+{
+	uint8_t b[4];
+	b[0] = len, b[1] = len>>8, b[2] = len>>16, b[3] = len>>24;
+	return mem_write_fd(fd, b, 4) < 0 || (len > 0 && mem_write_fd(fd, buf, len) < 0)? -1 : 0;
+}
+
+static const char *mem_srv_opt(char *line, mem_opt_t *opt, mem_io_t *io, char **rg_line)
+{ // parse the options of a request; return an error message or NULL
+	char *a[MEM_SRV_MAX_ARG], *p;
+	int i, n = 0;
+	for (p = line; *p && n < MEM_SRV_MAX_ARG; ) {
+		a[n++] = p;
+		for (; *p && *p != '\t'; ++p);
+		if (*p) *p++ = 0;
+	}
+	for (i = 0; i < n; ++i) {
+		if (strcmp(a[i], "-p") == 0) opt->flag |= MEM_F_PE;
+		else if (strcmp(a[i], "-a") == 0) opt->flag |= MEM_F_ALL;
+		else if (strcmp(a[i], "-M") == 0) opt->flag |= MEM_F_NO_MULTI;
+		else if (strcmp(a[i], "-P") == 0) opt->flag |= MEM_F_NOPAIRING;
+		else if (strcmp(a[i], "-S") == 0) opt->flag |= MEM_F_NO_RESCUE;
+		else if (strcmp(a[i], "-C") == 0) io->copy_comment = 1;
+		else if (strcmp(a[i], "-T") == 0 && i + 1 < n) opt->T = atoi(a[++i]);
+		else if (strcmp(a[i], "-R") == 0 && i + 1 < n) {
+			free(*rg_line);
+			if ((*rg_line = bwa_set_rg(a[++i])) == 0) return "malformed read group line";
+		} else return "unknown option or missing argument";
+	}
+	return 0;
+}
+
+static void write_conn(void *data, const void *buf, size_t len)
+{ // send SAM to the client in frames; drop it once the client is gone
+	mem_conn_t *c = (mem_conn_t*)data;
+	const uint8_t *p = (const uint8_t*)buf;
+	size_t l;
+	for (; len > 0 && !c->err; p += l, len -= l) {
+		l = len < MEM_SRV_FRAME? len : MEM_SRV_FRAME;
+		if (mem_write_frame(c->sock, p, l) < 0) c->err = 1;
+	}
+}
+
+static const char *mem_srv_align(mem_opt_t *opt, const mem_io_t *io, const bwaidx_t *idx, mem_conn_t *c, const char *rg_line)
+{ // align the reads from $c->sock and send SAM back; return an error message or NULL
+	mem_writer_t *wr;
+	pthread_t tid;
+	gzFile fp;
+	kseq_t *ks;
+	bseq_bam_t *bam;
+	char *hdr;
+	int fd[2];
+	if (pipe(fd) < 0) return strerror(errno);
+	c->fd_out = fd[1];
+	pthread_create(&tid, 0, mem_srv_deframe, c);
+	if ((fp = mem_open(opt, io, fd[0], &ks, &bam)) == 0) { // mem_open() has closed $fd[0]
+		shutdown(c->sock, SHUT_RD); // stop the deframer if it is waiting for more input
+		pthread_join(tid, 0);
+		return "fail to read the input";
+	}
+	hdr = bwa_sam_hdr(idx->bns, rg_line, 0);
+	write_conn(c, hdr, strlen(hdr));
+	free(hdr);
+	wr = mem_writer_init(write_conn, c);
+	mem_align(opt, io, idx, ks, 0, bam, wr);
+	mem_writer_destroy(wr);
+	kseq_destroy(ks);
+	bseq_bam_destroy(bam);
+	err_gzclose(fp);
+	pthread_join(tid, 0);
+	return 0;
+}
+
+static void mem_serve1(const mem_opt_t *opt0, const mem_io_t *io0, const bwaidx_t *idx, int sock, const char *rg_line0)
+{ // serve one request on $sock with the thread pool of $opt0
+	mem_opt_t opt_ = *opt0, *opt = &opt_;
+	mem_io_t io = *io0;
+	mem_conn_t conn;
+	kstring_t line = {0,0,0}, str = {0,0,0};
+	const char *msg;
+	char *rg_line = 0, c;
+
+	while (mem_read_fd(sock, &c, 1) == 0 && c != '\n') kputc(c, &line);
+	if (c != '\n') goto end_serve1; // the client is gone
+	conn.sock = sock, conn.fd_out = -1, conn.err = 0;
+	if ((msg = mem_srv_opt(line.s? line.s : "", opt, &io, &rg_line)) == 0) {
+		if (rg_line == 0 && rg_line0) rg_line = bwa_set_rg(rg_line0); // bwa_rg_id is global
+		else if (rg_line == 0) bwa_rg_id[0] = 0;
+		msg = mem_srv_align(opt, &io, idx, &conn, rg_line);
+	}
+	if (msg && bwa_verbose >= 2) fprintf(stderr, "[W::%s] the request failed: %s\n", __func__, msg);
+	ksprintf(&str, msg? "ERR %s\n" : "OK\n", msg);
+	if (conn.err || mem_write_frame(sock, 0, 0) < 0 || mem_write_fd(sock, str.s, str.l) < 0)
+		if (bwa_verbose >= 2) fprintf(stderr, "[W::%s] the client disconnected before the output was complete\n", __func__);
+end_serve1:
+	free(line.s); free(str.s); free(rg_line);
+}
+
+static int mem_srv_loop(const mem_opt_t *opt0, const mem_io_t *io, const bwaidx_t *idx, int fd, const char *rg_line)
+{ // in a server process: accept and serve requests on the listening socket $fd
+	mem_opt_t opt = *opt0;
+	int64_t n_req;
+	opt.pool = mem_pool_init(&opt); // started once and reused by all requests of this process
+	for (n_req = 1;; ++n_req) {
+		int sock;
+		if ((sock = accept(fd, 0, 0)) < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) continue;
+			err_fatal(__func__, "accept() failed: %s", strerror(errno));
+		}
+		if (bwa_verbose >= 3) fprintf(stderr, "[M::%s] process %ld: request %ld\n", __func__, (long)getpid(), (long)n_req);
+		mem_serve1(&opt, io, idx, sock, rg_line);
+		close(sock);
+	}
+	return 0;
+}
+
+static int mem_serve(const mem_opt_t *opt, const mem_io_t *io, const bwaidx_t *idx, const char *path, const char *rg_line)
+{ // accept requests on the Unix socket $path until killed
+	struct sockaddr_un addr;
+	struct stat st;
+	int i, fd, n_proc = io->n_workers > 0? io->n_workers : 1;
+	pid_t *pid;
+	if (opt->flag & (MEM_F_BAM|MEM_F_BWR)) {
+		fprintf(stderr, "[E::%s] the server only writes SAM\n", __func__);
+		return 1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "[E::%s] socket path '%s' is too long\n", __func__, path);
+		return 1;
+	}
+	strcpy(addr.sun_path, path);
+	if (lstat(path, &st) == 0) {
+		if (!S_ISSOCK(st.st_mode)) {
+			fprintf(stderr, "[E::%s] '%s' exists and is not a socket\n", __func__, path);
+			return 1;
+		}
+		unlink(path); // a stale socket from an earlier server
+	}
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		err_fatal(__func__, "fail to create a socket: %s", strerror(errno));
+	if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 16) < 0)
+		err_fatal(__func__, "fail to listen on '%s': %s", path, strerror(errno));
+	signal(SIGPIPE, SIG_IGN); // a client that goes away gives EPIPE
+	if (bwa_verbose >= 3)
+		fprintf(stderr, "[M::%s] listening on %s with %d process(es) of %d threads\n", __func__, path, n_proc, opt->n_threads);
+	pid = calloc(n_proc, sizeof(pid_t));
+	for (;;) { // keep $n_proc server processes running
+		int status;
+		pid_t p;
+		for (i = 0; i < n_proc; ++i) {
+			if (pid[i] > 0) continue;
+			fflush(stdout); fflush(stderr); // or buffered data are written by the child, too
+			if ((pid[i] = fork()) < 0)
+				err_fatal(__func__, "fail to fork a server process: %s", strerror(errno));
+			if (pid[i] == 0) _exit(mem_srv_loop(opt, io, idx, fd, rg_line));
+		}
+		if ((p = wait(&status)) < 0) {
+			if (errno == EINTR) continue;
+			err_fatal(__func__, "wait() failed: %s", strerror(errno));
+		}
+		for (i = 0; i < n_proc; ++i)
+			if (pid[i] == p) pid[i] = 0;
+		if (bwa_verbose >= 2)
+			fprintf(stderr, "[W::%s] server process %ld ended on a failed request, whose error is above; starting a new one\n", __func__, (long)p);
+	}
+	return 0;
+}
+
+typedef struct {
+	int sock, fd;
+} memc_sender_t;
+
+static void *memc_send(void *data)
+{ // send the input in frames and then an empty frame
+	memc_sender_t *s = (memc_sender_t*)data;
+	uint8_t *buf;
+	buf = malloc(4 + MEM_SRV_FRAME);
+	for (;;) {
+		ssize_t l = read(s->fd, buf + 4, MEM_SRV_FRAME);
+		if (l < 0 && errno == EINTR) continue;
+		if (l < 0) fprintf(stderr, "[E::%s] fail to read the input: %s\n", __func__, strerror(errno));
+		if (l <= 0) break;
+		buf[0] = l, buf[1] = l>>8, buf[2] = l>>16, buf[3] = l>>24;
+		if (mem_write_fd(s->sock, buf, 4 + l) < 0) break;
+	}
+	memset(buf, 0, 4);
+	mem_write_fd(s->sock, buf, 4);
+	free(buf);
+	return 0;
+}
+
+int main_memc(int argc, char *argv[])
+{
+	struct sockaddr_un addr;
+	kstring_t req = {0,0,0}, line = {0,0,0};
+	memc_sender_t s;
+	pthread_t tid;
+	char *buf, ch;
+	uint8_t b[4];
+	int c, ret = 0;
+	while ((c = getopt(argc, argv, "paMCPST:R:")) >= 0) {
+		if (c == 'T' || c == 'R') ksprintf(&req, "%s-%c\t%s", req.l? "\t" : "", c, optarg);
+		else if (strchr("paMCPS", c)) ksprintf(&req, "%s-%c", req.l? "\t" : "", c);
+		else return 1;
+	}
+	if (optind + 2 != argc) {
+		fprintf(stderr, "\n");
+		fprintf(stderr, "Usage: bwa memc [options] <socket> <in.fq>\n\n");
+		fprintf(stderr, "Options: -p       the input is interleaved paired-end sequences or paired BAM\n");
+		fprintf(stderr, "         -a       output all alignments for SE or unpaired PE\n");
+		fprintf(stderr, "         -M       mark shorter split hits as secondary\n");
+		fprintf(stderr, "         -C       append FASTA/FASTQ comment to SAM output\n");
+		fprintf(stderr, "         -P       skip pairing\n");
+		fprintf(stderr, "         -S       skip mate rescue\n");
+		fprintf(stderr, "         -T INT   minimum score to output [set by the server]\n");
+		fprintf(stderr, "         -R STR   read group header line such as '@RG\\tID:foo\\tSM:bar' [set by the server]\n\n");
+		fprintf(stderr, "Note: Send the reads in <in.fq> to `bwa mem -X <socket>' and write SAM to stdout.\n\n");
+		free(req.s);
+		return 1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, argv[optind], sizeof(addr.sun_path) - 1);
+	if ((s.sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 || connect(s.sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+		fprintf(stderr, "[E::%s] fail to connect to '%s': %s\n", __func__, argv[optind], strerror(errno));
+		return 1;
+	}
+	if (strcmp(argv[optind + 1], "-") == 0) s.fd = fileno(stdin);
+	else if ((s.fd = open(argv[optind + 1], O_RDONLY)) < 0) {
+		fprintf(stderr, "[E::%s] fail to open file '%s': %s\n", __func__, argv[optind + 1], strerror(errno));
+		return 1;
+	}
+	signal(SIGPIPE, SIG_IGN);
+	kputc('\n', &req);
+	mem_write_fd(s.sock, req.s, req.l);
+	pthread_create(&tid, 0, memc_send, &s);
+	buf = malloc(MEM_SRV_FRAME);
+	while (mem_read_fd(s.sock, b, 4) == 0) { // SAM frames until an empty one
+		uint32_t l, len = b[0] | b[1]<<8 | b[2]<<16 | (uint32_t)b[3]<<24;
+		if (len == 0) break;
+		for (; len > 0; len -= l) {
+			l = len < MEM_SRV_FRAME? len : MEM_SRV_FRAME;
+			if (mem_read_fd(s.sock, buf, l) < 0) break;
+			err_fwrite(buf, 1, l, stdout);
+		}
+		if (len > 0) break;
+	}
+	while (mem_read_fd(s.sock, &ch, 1) == 0 && ch != '\n') kputc(ch, &line);
+	if (line.l != 2 || strcmp(line.s, "OK") != 0) { // the status line is missing if the connection is broken
+		fprintf(stderr, "[E::%s] request failed: %s\n", __func__, line.l > 4 && strncmp(line.s, "ERR ", 4) == 0? line.s + 4 : "incomplete response from the server");
+		ret = 1;
+	}
+	shutdown(s.sock, SHUT_RDWR); // the sender may still be blocked on a failed request
+	pthread_join(tid, 0);
+	free(buf); free(req.s); free(line.s);
+	close(s.sock);
+	if (s.fd != fileno(stdin)) close(s.fd);
+	err_fflush(stdout);
+	return ret;
+}
+
 int main_mem(int argc, char *argv[])
 {
 	mem_opt_t *opt;
-	int fd, fd2, i, c, n, copy_comment = 0;
-	gzFile fp, fp2 = 0;
-	kseq_t *ks, *ks2 = 0;
-	bseq1_t *seqs;
+	int i, c, ret, n_jobs = 1, use_numa = 0;
 	bwaidx_t *idx;
-	char *rg_line = 0;
-	void *ko = 0, *ko2 = 0;
-	int64_t n_processed = 0;
+	bwa_numa_t *numa = 0;
+	char *rg_line = 0, *manifest = 0, *sock = 0;
+	mem_pestat_t pes[4];
+	mem_io_t io;
 
+	memset(&io, 0, sizeof(mem_io_t));
+	io.bam_level = -1, io.sort_mem = 768;
 	opt = mem_opt_init();
-	while ((c = getopt(argc, argv, "paMCSPHk:c:v:s:r:t:R:A:B:O:E:U:w:L:d:T:Q:D:m:")) >= 0) {
+	memset(pes, 0, 4 * sizeof(mem_pestat_t));
+	for (i = 0; i < 4; ++i) pes[i].failed = 1;
+	while ((c = getopt(argc, argv, "paMCSPHFubk:c:v:s:r:t:R:A:B:O:E:U:w:L:d:T:Q:D:m:g:z:I:f:y:l:j:X:n:N")) >= 0) {
 		if (c == 'k') opt->min_seed_len = atoi(optarg);
 		else if (c == 'w') opt->w = atoi(optarg);
 		else if (c == 'A') opt->a = atoi(optarg);
@@ -45,13 +794,34 @@ int main_mem(int argc, char *argv[])
 		else if (c == 'p') opt->flag |= MEM_F_PE;
 		else if (c == 'M') opt->flag |= MEM_F_NO_MULTI;
 		else if (c == 'S') opt->flag |= MEM_F_NO_RESCUE;
+		else if (c == 'F') opt->flag |= MEM_F_EXT_CIGAR;
+		else if (c == 'u') opt->flag |= MEM_F_DEDUP;
+		else if (c == 'b') io.use_pm = 1;
+		else if (c == 'f') {
+			if (strcmp(optarg, "bam") == 0) opt->flag |= MEM_F_BAM;
+			else if (strcmp(optarg, "bamu") == 0) opt->flag |= MEM_F_BAM, io.bam_level = 0;
+			else if (strcmp(optarg, "sbam") == 0) opt->flag |= MEM_F_BAM, io.bam_sort = 1;
+			else if (strcmp(optarg, "bwr") == 0) opt->flag |= MEM_F_BWR;
+			else if (strcmp(optarg, "sam") != 0) {
+				fprintf(stderr, "[E::%s] unknown output format '%s'\n", __func__, optarg);
+				return 1;
+			}
+		}
 		else if (c == 'c') opt->max_occ = atoi(optarg);
 		else if (c == 'd') opt->zdrop = atoi(optarg);
 		else if (c == 'v') bwa_verbose = atoi(optarg);
 		else if (c == 'r') opt->split_factor = atof(optarg);
 		else if (c == 'D') opt->chain_drop_ratio = atof(optarg);
 		else if (c == 'm') opt->max_matesw = atoi(optarg);
-		else if (c == 'C') copy_comment = 1;
+		else if (c == 'g') opt->dp_chain_len = atoi(optarg);
+		else if (c == 'z') opt->mz_len = atoi(optarg);
+		else if (c == 'y') io.sort_mem = atoi(optarg);
+		else if (c == 'n') io.n_workers = atoi(optarg);
+		else if (c == 'N') use_numa = 1;
+		else if (c == 'C') io.copy_comment = 1;
+		else if (c == 'l') manifest = optarg;
+		else if (c == 'X') sock = optarg;
+		else if (c == 'j') n_jobs = atoi(optarg);
 		else if (c == 'Q') {
 			opt->mapQ_coef_len = atoi(optarg);
 			opt->mapQ_coef_fac = opt->mapQ_coef_len > 0? log(opt->mapQ_coef_len) : 0;
@@ -62,15 +832,42 @@ int main_mem(int argc, char *argv[])
 				opt->pen_clip3 = strtol(p+1, &p, 10);
 		} else if (c == 'R') {
 			if ((rg_line = bwa_set_rg(optarg)) == 0) return 1; // FIXME: memory leak
+		} else if (c == 'I') { // specify the insert size distribution
+			char *p;
+			io.pes0 = pes;
+			pes[1].failed = 0;
+			pes[1].avg = strtod(optarg, &p);
+			pes[1].std = pes[1].avg * .1;
+			if (*p != 0 && ispunct(*p) && isdigit(p[1]))
+				pes[1].std = strtod(p+1, &p);
+			pes[1].high = (int)(pes[1].avg + 4. * pes[1].std + .499);
+			pes[1].low  = (int)(pes[1].avg - 4. * pes[1].std + .499);
+			if (pes[1].low < 1) pes[1].low = 1;
+			if (*p != 0 && ispunct(*p) && isdigit(p[1]))
+				pes[1].high = (int)(strtod(p+1, &p) + .499);
+			if (*p != 0 && ispunct(*p) && isdigit(p[1]))
+				pes[1].low  = (int)(strtod(p+1, &p) + .499);
+			if (bwa_verbose >= 3)
+				fprintf(stderr, "[M::%s] mean insert size: %.3f, stddev: %.3f, max: %d, min: %d\n",
+						__func__, pes[1].avg, pes[1].std, pes[1].high, pes[1].low);
 		} else if (c == 's') opt->split_width = atoi(optarg);
 		else return 1;
 	}
 	if (opt->n_threads < 1) opt->n_threads = 1;
-	if (optind + 1 >= argc || optind + 3 < argc) {
+	if (io.sort_mem < BAMSORT_MIN_MEM>>20) {
+		if (bwa_verbose >= 2) fprintf(stderr, "[W::%s] -y is raised to the minimum of %d\n", __func__, BAMSORT_MIN_MEM>>20);
+		io.sort_mem = BAMSORT_MIN_MEM>>20;
+	}
+	if (manifest || sock? optind + 1 != argc : optind + 1 >= argc || optind + 3 < argc) {
 		fprintf(stderr, "\n");
-		fprintf(stderr, "Usage: bwa mem [options] <idxbase> <in1.fq> [in2.fq]\n\n");
+		fprintf(stderr, "Usage: bwa mem [options] <idxbase> <in1.fq|in.bam> [in2.fq]\n");
+		fprintf(stderr, "       bwa mem [options] -l <manifest> <idxbase>\n");
+		fprintf(stderr, "       bwa mem [options] -X <socket> <idxbase>\n\n");
 		fprintf(stderr, "Algorithm options:\n\n");
 		fprintf(stderr, "       -t INT     number of threads [%d]\n", opt->n_threads);
+		fprintf(stderr, "       -n INT     fork INT worker processes, each with {-t} threads, sharing one copy of the index,\n");
+		fprintf(stderr, "                  or with -X, INT server processes, each serving one request at a time [%d]\n", io.n_workers);
+		fprintf(stderr, "       -N         copy the index to each NUMA node and pin each thread (or worker of -n) to the node of its copy\n");
 		fprintf(stderr, "       -k INT     minimum seed length [%d]\n", opt->min_seed_len);
 		fprintf(stderr, "       -w INT     band width for banded alignment [%d]\n", opt->w);
 		fprintf(stderr, "       -d INT     off-diagonal X-dropoff [%d]\n", opt->zdrop);
@@ -78,9 +875,17 @@ int main_mem(int argc, char *argv[])
 //		fprintf(stderr, "       -s INT     look for internal seeds inside a seed with less than INT occ [%d]\n", opt->split_width);
 		fprintf(stderr, "       -c INT     skip seeds with more than INT occurrences [%d]\n", opt->max_occ);
 		fprintf(stderr, "       -D FLOAT   drop chains shorter than FLOAT fraction of the longest overlapping chain [%.2f]\n", opt->chain_drop_ratio);
+		fprintf(stderr, "       -g INT     chain seeds by dynamic programming for reads of INT bp or longer; 0 to disable [%d]\n", opt->dp_chain_len);
+		fprintf(stderr, "       -z INT     seed reads of INT bp or longer with minimizers; requires `bwa index -M' or `bwa mzindex'; 0 to disable [%d]\n", opt->mz_len);
 		fprintf(stderr, "       -m INT     perform at most INT rounds of mate rescues for each read [%d]\n", opt->max_matesw);
 		fprintf(stderr, "       -S         skip mate rescue\n");
 		fprintf(stderr, "       -P         skip pairing; mate rescue performed unless -S also in use\n");
+		fprintf(stderr, "       -F         take CIGAR from the extension instead of a second global alignment\n");
+		fprintf(stderr, "       -u         align identical reads (or read pairs) in a batch only once\n");
+		fprintf(stderr, "       -b         pair reads with the insert size distribution learned from all previous batches\n");
+		fprintf(stderr, "       -I FLOAT[,FLOAT[,INT[,INT]]]\n");
+		fprintf(stderr, "                  specify the mean, standard deviation (10%% of the mean if absent), max (4 sigma from the mean if absent)\n");
+		fprintf(stderr, "                  and min of the insert size distribution. FR orientation only. With -b, only used for the first batch [inferred]\n");
 		fprintf(stderr, "       -A INT     score for a sequence match [%d]\n", opt->a);
 		fprintf(stderr, "       -B INT     penalty for a mismatch [%d]\n", opt->b);
 		fprintf(stderr, "       -O INT     gap open penalty [%d]\n", opt->q);
@@ -89,12 +894,19 @@ int main_mem(int argc, char *argv[])
 		fprintf(stderr, "       -U INT     penalty for an unpaired read pair [%d]\n", opt->pen_unpaired);
 		fprintf(stderr, "\nInput/output options:\n\n");
 		fprintf(stderr, "       -p         first query file consists of interleaved paired-end sequences\n");
+		fprintf(stderr, "                  (BAM input is paired by the READ1/READ2 flags if its first record is paired)\n");
 		fprintf(stderr, "       -R STR     read group header line such as '@RG\\tID:foo\\tSM:bar' [null]\n");
+		fprintf(stderr, "       -f STR     output format: sam, bam, bamu (uncompressed BAM), sbam (coordinate-sorted BAM)\n                  or bwr (compact binary records; see `bwa bwr2sam') [sam]\n");
+		fprintf(stderr, "       -y INT     buffer INT megabytes of records for sorting with `-f sbam'; at least %d; temporary files go to $TMPDIR [%d]\n", BAMSORT_MIN_MEM>>20, io.sort_mem);
+		fprintf(stderr, "       -l FILE    align the samples listed in FILE, one per line: <in1.fq> <in2.fq|*> <RGline|*> <out>, TAB-delimited\n");
+		fprintf(stderr, "       -j INT     with -l, align INT samples in parallel, each with {-t} threads [%d]\n", n_jobs);
+		fprintf(stderr, "       -X FILE    keep the index loaded and serve requests from `bwa memc' on the Unix socket FILE\n");
+		fprintf(stderr, "                  with persistent server processes (see -n) and thread pools\n");
 		fprintf(stderr, "\n");
 		fprintf(stderr, "       -v INT     verbose level: 1=error, 2=warning, 3=message, 4+=debugging [%d]\n", bwa_verbose);
 		fprintf(stderr, "       -T INT     minimum score to output [%d]\n", opt->T);
 		fprintf(stderr, "       -a         output all alignments for SE or unpaired PE\n");
-		fprintf(stderr, "       -C         append FASTA/FASTQ comment to SAM output\n");
+		fprintf(stderr, "       -C         append FASTA/FASTQ comment or the tags of BAM input to SAM output\n");
 		fprintf(stderr, "       -M         mark shorter split hits as secondary (for Picard/GATK compatibility)\n");
 		fprintf(stderr, "\nNote: Please read the man page for detailed description of the command line and options.\n");
 		fprintf(stderr, "\n");
@@ -103,65 +915,19 @@ int main_mem(int argc, char *argv[])
 	}
 
 	bwa_fill_scmat(opt->a, opt->b, opt->mat);
-	if ((idx = bwa_idx_load(argv[optind], BWA_IDX_ALL)) == 0) return 1; // FIXME: memory leak
-
-	ko = kopen(argv[optind + 1], &fd);
-	if (ko == 0) {
-		if (bwa_verbose >= 1) fprintf(stderr, "[E::%s] fail to open file `%s'.\n", __func__, argv[optind + 1]);
-		return 1;
-	}
-	fp = gzdopen(fd, "r");
-	ks = kseq_init(fp);
-	if (optind + 2 < argc) {
-		if (opt->flag&MEM_F_PE) {
-			if (bwa_verbose >= 2)
-				fprintf(stderr, "[W::%s] when '-p' is in use, the second query file will be ignored.\n", __func__);
-		} else {
-			ko2 = kopen(argv[optind + 2], &fd2);
-			if (ko2 == 0) {
-				if (bwa_verbose >= 1) fprintf(stderr, "[E::%s] fail to open file `%s'.\n", __func__, argv[optind + 2]);
-				return 1;
-			}
-			fp2 = gzdopen(fd2, "r");
-			ks2 = kseq_init(fp2);
-			opt->flag |= MEM_F_PE;
-		}
-	}
-	bwa_print_sam_hdr(idx->bns, rg_line);
-	while ((seqs = bseq_read(opt->chunk_size * opt->n_threads, &n, ks, ks2)) != 0) {
-		int64_t size = 0;
-		if ((opt->flag & MEM_F_PE) && (n&1) == 1) {
-			if (bwa_verbose >= 2)
-				fprintf(stderr, "[W::%s] odd number of reads in the PE mode; last read dropped\n", __func__);
-			n = n>>1<<1;
-		}
-		if (!copy_comment)
-			for (i = 0; i < n; ++i) {
-				free(seqs[i].comment); seqs[i].comment = 0;
-			}
-		for (i = 0; i < n; ++i) size += seqs[i].l_seq;
-		if (bwa_verbose >= 3)
-			fprintf(stderr, "[M::%s] read %d sequences (%ld bp)...\n", __func__, n, (long)size);
-		mem_process_seqs(opt, idx->bwt, idx->bns, idx->pac, n_processed, n, seqs, 0);
-		n_processed += n;
-		for (i = 0; i < n; ++i) {
-			err_fputs(seqs[i].sam, stdout);
-			free(seqs[i].name); free(seqs[i].comment); free(seqs[i].seq); free(seqs[i].qual); free(seqs[i].sam);
-		}
-		free(seqs);
-	}
-
+	if ((idx = bwa_idx_load(argv[optind], BWA_IDX_ALL | (opt->mz_len > 0? BWA_IDX_MZ : 0))) == 0) return 1; // FIXME: memory leak
+	if (use_numa) // before fork() such that all processes share the replicas; with -n, each worker runs on one node
+		opt->numa = numa = bwa_numa_init(idx, io.n_workers > 0 && sock == 0? io.n_workers : opt->n_threads);
+	if (sock) ret = mem_serve(opt, &io, idx, sock, rg_line);
+	else if (manifest) ret = mem_manifest(opt, &io, idx, manifest, rg_line, n_jobs);
+	else ret = mem_run(opt, &io, idx, argv[optind + 1], optind + 2 < argc? argv[optind + 2] : 0, rg_line);
 	free(opt);
+	bwa_numa_destroy(numa);
 	bwa_idx_destroy(idx);
-	kseq_destroy(ks);
-	err_gzclose(fp); kclose(ko);
-	if (ks2) {
-		kseq_destroy(ks2);
-		err_gzclose(fp2); kclose(ko2);
-	}
-	return 0;
+	return ret;
 }
 
+
 int main_fastmap(int argc, char *argv[])
 {
 	int c, i, min_iwidth = 20, min_len = 17, print_seq = 0, split_width = 0;
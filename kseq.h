@@ -108,12 +108,9 @@ typedef struct __kstring_t {
 					if (ks->end == 0) break;							\
 				} else break;											\
 			}															\
-			if (delimiter == KS_SEP_LINE) { \
-				for (i = ks->begin; i < ks->end; ++i) \
-					if (ks->buf[i] == '\n') break; \
-			} else if (delimiter > KS_SEP_MAX) {						\
-				for (i = ks->begin; i < ks->end; ++i)					\
-					if (ks->buf[i] == delimiter) break;					\
+			if (delimiter == KS_SEP_LINE || delimiter > KS_SEP_MAX) {	\
+				unsigned char *sep = (unsigned char*)memchr(ks->buf + ks->begin, delimiter == KS_SEP_LINE? '\n' : delimiter, ks->end - ks->begin); \
+				i = sep? sep - ks->buf : ks->end;						\
 			} else if (delimiter == KS_SEP_SPACE) {						\
 				for (i = ks->begin; i < ks->end; ++i)					\
 					if (isspace(ks->buf[i])) break;						\
@@ -221,8 +218,12 @@ typedef struct __kstring_t {
 		kstream_t *f;							\
 	} kseq_t;
 
+#ifndef KSEQ_BUFSIZE
+#define KSEQ_BUFSIZE 16384
+#endif
+
 #define KSEQ_INIT2(SCOPE, type_t, __read)		\
-	KSTREAM_INIT(type_t, __read, 16384)			\
+	KSTREAM_INIT(type_t, __read, KSEQ_BUFSIZE)	\
 	__KSEQ_TYPE(type_t)							\
 	__KSEQ_BASIC(SCOPE, type_t)					\
 	__KSEQ_READ(SCOPE)
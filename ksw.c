@@ -25,6 +25,7 @@
 
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 #include <emmintrin.h>
 #include "ksw.h"
 
@@ -365,12 +366,34 @@ typedef struct {
 	int32_t h, e;
 } eh_t;
 
-int ksw_extend(int qlen, const uint8_t *query, int tlen, const uint8_t *target, int m, const int8_t *mat, int gapo, int gape, int w, int end_bonus, int zdrop, int h0, int *_qle, int *_tle, int *_gtle, int *_gscore, int *_max_off)
+static void ksw_extck_save(ksw_extck_t *ck, int qlen, const eh_t *eh, int i, int beg, int end, int max, int max_i, int max_j, int max_ie, int gscore, int max_off)
+{
+	if (ck->m_eh < qlen + 1) {
+		ck->m_eh = qlen + 1;
+		ck->eh = realloc(ck->eh, ck->m_eh * sizeof(eh_t));
+	}
+	if (eh) memcpy(ck->eh, eh, (qlen + 1) * sizeof(eh_t));
+	ck->i = i, ck->beg = beg, ck->end = end, ck->max = max, ck->max_i = max_i, ck->max_j = max_j;
+	ck->max_ie = max_ie, ck->gscore = gscore, ck->max_off = max_off;
+}
+
+int ksw_extend2(int qlen, const uint8_t *query, int tlen, const uint8_t *target, int m, const int8_t *mat, int gapo, int gape, int w, int end_bonus, int zdrop, int h0, int *_qle, int *_tle, int *_gtle, int *_gscore, int *_max_off, ksw_extck_t *ck)
 {
 	eh_t *eh; // score array
 	int8_t *qp; // query profile
-	int i, j, k, gapoe = gapo + gape, beg, end, max, max_i, max_j, max_gap, max_ie, gscore, max_off;
+	int i, j, k, gapoe = gapo + gape, beg, end, max, max_i, max_j, max_gap, max_ie, gscore, max_off, i0 = 0, saved = 0;
 	if (h0 < 0) h0 = 0;
+	// adjust $w if it is too large
+	k = m * m;
+	for (i = 0, max = 0; i < k; ++i) // get the max score
+		max = max > mat[i]? max : mat[i];
+	max_gap = (int)((double)(qlen * max + end_bonus - gapo) / gape + 1.);
+	max_gap = max_gap > 1? max_gap : 1;
+	w = w < max_gap? w : max_gap;
+	if (ck && ck->set && w >= ck->w && (ck->i < 0 || w == ck->w)) { // the band has no effect; reuse the previous result
+		max = ck->score, max_i = ck->tle - 1, max_j = ck->qle - 1, max_ie = ck->gtle - 1, gscore = ck->gscore_, max_off = ck->max_off_;
+		goto end_extend;
+	}
 	// allocate memory
 	qp = malloc(qlen * m);
 	eh = calloc(qlen + 1, 8);
@@ -379,27 +402,29 @@ int ksw_extend(int qlen, const uint8_t *query, int tlen, const uint8_t *target,
 		const int8_t *p = &mat[k * m];
 		for (j = 0; j < qlen; ++j) qp[i++] = p[query[j]];
 	}
-	// fill the first row
-	eh[0].h = h0; eh[1].h = h0 > gapoe? h0 - gapoe : 0;
-	for (j = 2; j <= qlen && eh[j-1].h > gape; ++j)
-		eh[j].h = eh[j-1].h - gape;
-	// adjust $w if it is too large
-	k = m * m;
-	for (i = 0, max = 0; i < k; ++i) // get the max score
-		max = max > mat[i]? max : mat[i];
-	max_gap = (int)((double)(qlen * max + end_bonus - gapo) / gape + 1.);
-	max_gap = max_gap > 1? max_gap : 1;
-	w = w < max_gap? w : max_gap;
+	if (ck && ck->set && w > ck->w) { // resume from the row where the narrower band took effect
+		memcpy(eh, ck->eh, (qlen + 1) * sizeof(eh_t));
+		i0 = ck->i, beg = ck->beg, end = ck->end;
+		max = ck->max, max_i = ck->max_i, max_j = ck->max_j, max_ie = ck->max_ie, gscore = ck->gscore, max_off = ck->max_off;
+	} else {
+		// fill the first row
+		eh[0].h = h0; eh[1].h = h0 > gapoe? h0 - gapoe : 0;
+		for (j = 2; j <= qlen && eh[j-1].h > gape; ++j)
+			eh[j].h = eh[j-1].h - gape;
+		max = h0, max_i = max_j = -1; max_ie = -1, gscore = -1;
+		max_off = 0;
+		beg = 0, end = qlen;
+	}
 	// DP loop
-	max = h0, max_i = max_j = -1; max_ie = -1, gscore = -1;
-	max_off = 0;
-	beg = 0, end = qlen;
-	for (i = 0; LIKELY(i < tlen); ++i) {
+	for (i = i0; LIKELY(i < tlen); ++i) {
 		int f = 0, h1, m = 0, mj = -1;
 		int8_t *q = &qp[target[i] * qlen];
 		// compute the first column
 		h1 = h0 - (gapo + gape * (i + 1));
 		if (h1 < 0) h1 = 0;
+		// keep the state before the band takes effect for the first time; all rows above are the same with a larger band
+		if (ck && !saved && (beg < i - w || (end < qlen? end : qlen) > i + w + 1))
+			ksw_extck_save(ck, qlen, eh, i, beg, end, max, max_i, max_j, max_ie, gscore, max_off), saved = 1;
 		// apply the band and the constraint (if provided)
 		if (beg < i - w) beg = i - w;
 		if (end > i + w + 1) end = i + w + 1;
@@ -445,6 +470,12 @@ int ksw_extend(int qlen, const uint8_t *query, int tlen, const uint8_t *target,
 		//beg = 0; end = qlen; // uncomment this line for debugging
 	}
 	free(eh); free(qp);
+	if (ck && !saved) ck->i = -1;
+end_extend:
+	if (ck) {
+		ck->set = 1, ck->w = w;
+		ck->score = max, ck->qle = max_j + 1, ck->tle = max_i + 1, ck->gtle = max_ie + 1, ck->gscore_ = gscore, ck->max_off_ = max_off;
+	}
 	if (_qle) *_qle = max_j + 1;
 	if (_tle) *_tle = max_i + 1;
 	if (_gtle) *_gtle = max_ie + 1;
@@ -453,6 +484,257 @@ int ksw_extend(int qlen, const uint8_t *query, int tlen, const uint8_t *target,
 	return max;
 }
 
+int ksw_extend(int qlen, const uint8_t *query, int tlen, const uint8_t *target, int m, const int8_t *mat, int gapo, int gape, int w, int end_bonus, int zdrop, int h0, int *qle, int *tle, int *gtle, int *gscore, int *max_off)
+{
+	return ksw_extend2(qlen, query, tlen, target, m, mat, gapo, gape, w, end_bonus, zdrop, h0, qle, tle, gtle, gscore, max_off, 0);
+}
+
+/****************************
+ *** Batched SW extension ***
+ ****************************/
+
+/* ksw_extend_batch() vectorizes across jobs rather than within one job: lane
+ * L of H[j], E[j] and Q[j] holds column j of the L-th job. All lanes walk down
+ * the rows in lockstep; each lane keeps its own band [beg,end), which is
+ * applied as a mask. The row-wise bookkeeping of ksw_extend(), including the
+ * scan that shrinks [beg,end), is reproduced exactly, so the results are
+ * identical to those from ksw_extend().
+ */
+
+#define KSW_EXT_LANES 8
+#define KSW_EXT_NONE  0x7fff
+#define KSW_EXT_ZMAX  0x1000000 // max size of the backtrack matrix of a group; larger jobs are solved by ksw_extend_z()
+
+static inline __m128i ksw_blend(__m128i mask, __m128i x, __m128i y) // mask? x : y
+{
+	return _mm_or_si128(_mm_and_si128(mask, x), _mm_andnot_si128(mask, y));
+}
+
+static void ksw_extend8(int n, ksw_ext_t *const *jobs, const int8_t sc[3], int max_sc, int gapo, int gape, int zdrop, __m128i *H, __m128i *E, __m128i *Q, uint8_t *zm)
+{ // if zm is not NULL, lane L of cell (i,j) in the backtrack matrix is kept in zm[(i*(qmax+1)+j)*8+L]
+	int L, i, j, qmax, tmax, gapoe = gapo + gape;
+	int act[8], beg[8], end[8], w[8], h0[8], max[8], max_i[8], max_j[8], max_ie[8], gscore[8], max_off[8], saved[8];
+	int16_t *H16 = (int16_t*)H, *E16 = (int16_t*)E, *Q16 = (int16_t*)Q;
+	int16_t t_beg[8], t_end[8], t_tgt[8], t_h1[8], t_m[8], t_mj[8], t_zb[8], t_fz[8];
+	__m128i zero, one, three, none, mch, mis, amb, gapoe_v, gape_v, two, four, eight;
+
+	zero = _mm_setzero_si128(); one = _mm_set1_epi16(1); three = _mm_set1_epi16(3);
+	none = _mm_set1_epi16(KSW_EXT_NONE);
+	mch = _mm_set1_epi16(sc[0]); mis = _mm_set1_epi16(sc[1]); amb = _mm_set1_epi16(sc[2]);
+	gapoe_v = _mm_set1_epi16(gapoe); gape_v = _mm_set1_epi16(gape);
+	two = _mm_set1_epi16(2); four = _mm_set1_epi16(4); eight = _mm_set1_epi16(8);
+	// initialize; this mirrors the beginning of ksw_extend()
+	for (L = 0, qmax = tmax = 0; L < n; ++L) {
+		qmax = qmax > jobs[L]->qlen? qmax : jobs[L]->qlen;
+		tmax = tmax > jobs[L]->tlen? tmax : jobs[L]->tlen;
+	}
+	if (zm) memset(zm, 0, (size_t)tmax * (qmax + 1) * 8);
+	for (j = 0; j <= qmax; ++j) H[j] = E[j] = zero, Q[j] = _mm_set1_epi16(4);
+	for (L = 0; L < KSW_EXT_LANES; ++L) {
+		const ksw_ext_t *p;
+		int max_gap;
+		act[L] = saved[L] = 0;
+		if (L >= n) continue;
+		p = jobs[L];
+		h0[L] = p->h0 > 0? p->h0 : 0;
+		H16[L] = h0[L]; H16[8+L] = h0[L] > gapoe? h0[L] - gapoe : 0;
+		for (j = 2; j <= p->qlen && H16[(j-1)*8+L] > gape; ++j)
+			H16[j*8+L] = H16[(j-1)*8+L] - gape;
+		for (j = 0; j < p->qlen; ++j) Q16[j*8+L] = p->query[j];
+		max_gap = (int)((double)(p->qlen * max_sc + p->end_bonus - gapo) / gape + 1.);
+		max_gap = max_gap > 1? max_gap : 1;
+		w[L] = p->w < max_gap? p->w : max_gap;
+		max[L] = h0[L], max_i[L] = max_j[L] = -1, max_ie[L] = -1, gscore[L] = -1, max_off[L] = 0;
+		beg[L] = 0, end[L] = p->qlen, act[L] = 1;
+	}
+	// DP loop
+	for (i = 0;; ++i) {
+		int jlo = 0x7fffffff, jhi = 0, n_act = 0;
+		__m128i begv, endv, tv, h1, f, m, mj, lastz, zb, fz;
+		for (L = 0; L < KSW_EXT_LANES; ++L) {
+			t_beg[L] = KSW_EXT_NONE, t_end[L] = 0, t_tgt[L] = 4, t_h1[L] = 0;
+			if (act[L] && i >= jobs[L]->tlen) act[L] = 0;
+			if (act[L]) {
+				int h1 = h0[L] - (gapo + gape * (i + 1));
+				if (h1 < 0) h1 = 0;
+				if (jobs[L]->ck && !saved[L] && (beg[L] < i - w[L] || (end[L] < jobs[L]->qlen? end[L] : jobs[L]->qlen) > i + w[L] + 1)) {
+					eh_t *eh;
+					ksw_extck_save(jobs[L]->ck, jobs[L]->qlen, 0, i, beg[L], end[L], max[L], max_i[L], max_j[L], max_ie[L], gscore[L], max_off[L]);
+					for (j = 0, eh = (eh_t*)jobs[L]->ck->eh; j <= jobs[L]->qlen; ++j)
+						eh[j].h = H16[j*8+L], eh[j].e = E16[j*8+L];
+					saved[L] = 1;
+				}
+				if (beg[L] < i - w[L]) beg[L] = i - w[L];
+				if (end[L] > i + w[L] + 1) end[L] = i + w[L] + 1;
+				if (end[L] > jobs[L]->qlen) end[L] = jobs[L]->qlen;
+				if (beg[L] >= end[L]) { // an empty row: ksw_extend() gets m==0 and breaks
+					if (beg[L] == jobs[L]->qlen) {
+						max_ie[L] = gscore[L] > h1? max_ie[L] : i;
+						gscore[L] = gscore[L] > h1? gscore[L] : h1;
+					}
+					act[L] = 0;
+					continue;
+				}
+				t_beg[L] = beg[L] - 1, t_end[L] = end[L], t_tgt[L] = jobs[L]->target[i], t_h1[L] = h1;
+				jlo = jlo < beg[L]? jlo : beg[L];
+				jhi = jhi > end[L]? jhi : end[L];
+				++n_act;
+			}
+		}
+		if (n_act == 0) break;
+		begv = _mm_loadu_si128((__m128i*)t_beg); endv = _mm_loadu_si128((__m128i*)t_end);
+		tv = _mm_loadu_si128((__m128i*)t_tgt); h1 = _mm_loadu_si128((__m128i*)t_h1);
+		f = m = zero; mj = _mm_set1_epi16(-1);
+		lastz = zb = begv; fz = none;
+		for (j = jlo; LIKELY(j < jhi); ++j) {
+			// the same recurrence as in ksw_extend(); lanes outside their own band are left untouched
+			__m128i jv, inr, hp, e, q, s, h, t, upd, hz, c, d;
+			jv = _mm_set1_epi16(j);
+			inr = _mm_and_si128(_mm_cmpgt_epi16(jv, begv), _mm_cmpgt_epi16(endv, jv));
+			hp = _mm_load_si128(H + j); e = _mm_load_si128(E + j); q = _mm_load_si128(Q + j);
+			s = ksw_blend(_mm_cmpeq_epi16(q, tv), mch, mis);
+			s = ksw_blend(_mm_cmpgt_epi16(_mm_max_epi16(q, tv), three), amb, s);
+			_mm_store_si128(H + j, ksw_blend(inr, h1, hp)); // eh[j].h = H(i,j-1)
+			hz = _mm_and_si128(inr, _mm_cmpeq_epi16(h1, zero));
+			h = _mm_adds_epi16(hp, s);
+			d = _mm_and_si128(_mm_cmpgt_epi16(e, h), one); // the same tie-breaking as ksw_extend_z()
+			h = _mm_max_epi16(h, e);
+			d = ksw_blend(_mm_cmpgt_epi16(f, h), two, d);
+			h = _mm_max_epi16(h, f);
+			h1 = ksw_blend(inr, h, h1);
+			upd = _mm_andnot_si128(_mm_cmpgt_epi16(m, h), inr); // where mj is moved to j
+			// track the zero cells used to shrink [beg,end) for the next row
+			lastz = ksw_blend(hz, jv, lastz);
+			c = _mm_and_si128(_mm_and_si128(hz, _mm_cmpeq_epi16(fz, none)), _mm_cmpgt_epi16(jv, _mm_add_epi16(mj, one)));
+			fz = ksw_blend(upd, none, ksw_blend(c, jv, fz));
+			zb = ksw_blend(upd, lastz, zb);
+			mj = ksw_blend(upd, jv, mj);
+			m = _mm_max_epi16(m, _mm_and_si128(inr, h));
+			// E(i+1,j) and F(i,j+1)
+			t = _mm_subs_epu16(h, gapoe_v);
+			if (zm) {
+				d = _mm_or_si128(d, _mm_and_si128(_mm_cmpgt_epi16(_mm_subs_epu16(e, gape_v), t), four));
+				d = _mm_or_si128(d, _mm_and_si128(_mm_cmpgt_epi16(_mm_subs_epu16(f, gape_v), t), eight));
+				d = _mm_and_si128(d, inr);
+				_mm_storel_epi64((__m128i*)&zm[((size_t)i * (qmax + 1) + j) * 8], _mm_packus_epi16(d, d));
+			}
+			_mm_store_si128(E + j, ksw_blend(inr, _mm_max_epi16(_mm_subs_epu16(e, gape_v), t), e));
+			f = ksw_blend(inr, _mm_max_epi16(_mm_subs_epu16(f, gape_v), t), f);
+		}
+		_mm_storeu_si128((__m128i*)t_h1, h1); _mm_storeu_si128((__m128i*)t_m, m); _mm_storeu_si128((__m128i*)t_mj, mj);
+		_mm_storeu_si128((__m128i*)t_zb, zb); _mm_storeu_si128((__m128i*)t_fz, fz);
+		for (L = 0; L < KSW_EXT_LANES; ++L) {
+			int h1, mm, mjj, fzz;
+			if (!act[L]) continue;
+			h1 = t_h1[L], mm = t_m[L], mjj = t_mj[L], fzz = t_fz[L];
+			H16[end[L]*8+L] = h1; E16[end[L]*8+L] = 0;
+			if (end[L] == jobs[L]->qlen) {
+				max_ie[L] = gscore[L] > h1? max_ie[L] : i;
+				gscore[L] = gscore[L] > h1? gscore[L] : h1;
+			}
+			if (mm == 0 || (zdrop > 0 && max[L] - mm - abs((i - max_i[L]) - (end[L] - max_j[L])) * gape > zdrop)) {
+				act[L] = 0;
+				continue;
+			}
+			if (mm > max[L]) {
+				max[L] = mm, max_i[L] = i, max_j[L] = mjj;
+				max_off[L] = max_off[L] > abs(mjj - i)? max_off[L] : abs(mjj - i);
+			}
+			beg[L] = t_zb[L] + 1;
+			if (fzz == KSW_EXT_NONE && h1 == 0 && end[L] >= mjj + 2) fzz = end[L];
+			end[L] = fzz != KSW_EXT_NONE? fzz : end[L] + 1;
+		}
+	}
+	for (L = 0; L < n; ++L) {
+		ksw_ext_t *p = jobs[L];
+		p->score = max[L];
+		p->qle = max_j[L] + 1, p->tle = max_i[L] + 1, p->gtle = max_ie[L] + 1;
+		p->gscore = gscore[L], p->max_off = max_off[L];
+		if (p->tb) { // convert to the banded layout of ksw_extend_z()
+			int n_col = p->qlen < 2 * w[L] + 1? p->qlen : 2 * w[L] + 1, ww = w[L];
+			p->zw = ww;
+			p->z = calloc(((size_t)n_col * p->tlen + 1) >> 1, 1);
+			for (i = 0; i < p->tlen; ++i) {
+				int beg0 = i > ww? i - ww : 0;
+				const uint8_t *zi = &zm[((size_t)i * (qmax + 1) + beg0) * 8 + L];
+				uint8_t *z = p->z;
+				size_t c = (size_t)i * n_col;
+				for (j = 0; j < n_col && beg0 + j < p->qlen; ++j, ++c)
+					z[c>>1] |= zi[j * 8] << ((c&1)<<2);
+			}
+		} else if (p->ck) {
+			ksw_extck_t *ck = p->ck;
+			if (!saved[L]) ck->i = -1;
+			ck->set = 1, ck->w = w[L];
+			ck->score = p->score, ck->qle = p->qle, ck->tle = p->tle, ck->gtle = p->gtle, ck->gscore_ = p->gscore, ck->max_off_ = p->max_off;
+		}
+	}
+}
+
+static int ksw_ext_cmp(const void *a, const void *b)
+{
+	const ksw_ext_t *p = *(ksw_ext_t*const*)a, *q = *(ksw_ext_t*const*)b;
+	if (p->qlen != q->qlen) return p->qlen < q->qlen? -1 : 1;
+	return (p->tlen > q->tlen) - (p->tlen < q->tlen);
+}
+
+void ksw_extend_batch(int n, ksw_ext_t *jobs, int m, const int8_t *mat, int gapo, int gape, int zdrop)
+{
+	int i, j, n_b, max_sc, max_qlen, simple;
+	int8_t sc[3];
+	ksw_ext_t **b;
+	void *mem;
+	uint8_t *zm = 0;
+	size_t m_zm = 0;
+	__m128i *H;
+
+	if (n <= 0) return;
+	for (i = 0, max_sc = 0; i < m * m; ++i) // get the max score
+		max_sc = max_sc > mat[i]? max_sc : mat[i];
+	// the SIMD kernel only supports a match/mismatch matrix with a constant score for ambiguous bases
+	simple = (m == 5 && n > 1);
+	sc[0] = mat[0], sc[1] = mat[1], sc[2] = mat[4];
+	for (i = 0; simple && i < 5; ++i)
+		for (j = 0; j < 5; ++j)
+			if (mat[i * 5 + j] != (i == 4 || j == 4? sc[2] : i == j? sc[0] : sc[1])) simple = 0;
+	b = (ksw_ext_t**)malloc(n * sizeof(ksw_ext_t*));
+	for (i = n_b = 0, max_qlen = 0; i < n; ++i) {
+		ksw_ext_t *p = &jobs[i];
+		int h0 = p->h0 > 0? p->h0 : 0;
+		if (simple && p->qlen > 0 && p->qlen < KSW_EXT_NONE - 1 && h0 + (int64_t)p->qlen * max_sc < KSW_EXT_NONE && !(p->ck && p->ck->set)
+			&& (!p->tb || (size_t)p->tlen * (p->qlen + 1) * KSW_EXT_LANES <= KSW_EXT_ZMAX))
+		{
+			b[n_b++] = p;
+			max_qlen = max_qlen > p->qlen? max_qlen : p->qlen;
+		} else if (p->tb) p->score = ksw_extend_z(p->qlen, p->query, p->tlen, p->target, m, mat, gapo, gape, p->w, p->end_bonus, zdrop, p->h0, &p->qle, &p->tle, &p->gtle, &p->gscore, &p->max_off, &p->zw, &p->z);
+		else p->score = ksw_extend2(p->qlen, p->query, p->tlen, p->target, m, mat, gapo, gape, p->w, p->end_bonus, zdrop, p->h0, &p->qle, &p->tle, &p->gtle, &p->gscore, &p->max_off, p->ck); // a retry resumes from its checkpoint
+	}
+	if (n_b > 1) {
+		qsort(b, n_b, sizeof(ksw_ext_t*), ksw_ext_cmp); // put jobs of similar sizes in the same group
+		mem = malloc(16 * 3 * (max_qlen + 1) + 15);
+		H = (__m128i*)(((size_t)mem + 15) >> 4 << 4);
+		for (i = 0; i < n_b; i += KSW_EXT_LANES) {
+			int n8 = n_b - i < KSW_EXT_LANES? n_b - i : KSW_EXT_LANES, tb = 0, qmax = 0, tmax = 0;
+			for (j = 0; j < n8; ++j) {
+				tb |= b[i+j]->tb;
+				qmax = qmax > b[i+j]->qlen? qmax : b[i+j]->qlen;
+				tmax = tmax > b[i+j]->tlen? tmax : b[i+j]->tlen;
+			}
+			if (tb && m_zm < (size_t)tmax * (qmax + 1) * KSW_EXT_LANES) {
+				m_zm = (size_t)tmax * (qmax + 1) * KSW_EXT_LANES;
+				free(zm); zm = (uint8_t*)malloc(m_zm);
+			}
+			ksw_extend8(n8, b + i, sc, max_sc, gapo, gape, zdrop, H, H + max_qlen + 1, H + 2 * (max_qlen + 1), tb? zm : 0);
+		}
+		free(mem); free(zm);
+	} else if (n_b == 1) {
+		ksw_ext_t *p = b[0];
+		if (p->tb) p->score = ksw_extend_z(p->qlen, p->query, p->tlen, p->target, m, mat, gapo, gape, p->w, p->end_bonus, zdrop, p->h0, &p->qle, &p->tle, &p->gtle, &p->gscore, &p->max_off, &p->zw, &p->z);
+		else p->score = ksw_extend2(p->qlen, p->query, p->tlen, p->target, m, mat, gapo, gape, p->w, p->end_bonus, zdrop, p->h0, &p->qle, &p->tle, &p->gtle, &p->gscore, &p->max_off, p->ck);
+	}
+	free(b);
+}
+
 /********************
  * Global alignment *
  ********************/
@@ -555,6 +837,129 @@ int ksw_global(int qlen, const uint8_t *query, int tlen, const uint8_t *target,
 	return score;
 }
 
+/*******************************
+ * Extension with backtracking *
+ *******************************/
+
+int ksw_extend_z(int qlen, const uint8_t *query, int tlen, const uint8_t *target, int m, const int8_t *mat, int gapo, int gape, int w, int end_bonus, int zdrop, int h0, int *_qle, int *_tle, int *_gtle, int *_gscore, int *_max_off, int *_w, uint8_t **_z)
+{
+	eh_t *eh; // score array
+	int8_t *qp; // query profile
+	uint8_t *z; // backtrack matrix; two cells per byte, each being f<<3|e<<2|h
+	int i, j, k, gapoe = gapo + gape, beg, end, max, max_i, max_j, max_gap, max_ie, gscore, max_off, n_col;
+	if (h0 < 0) h0 = 0;
+	// adjust $w if it is too large
+	k = m * m;
+	for (i = 0, max = 0; i < k; ++i) // get the max score
+		max = max > mat[i]? max : mat[i];
+	max_gap = (int)((double)(qlen * max + end_bonus - gapo) / gape + 1.);
+	max_gap = max_gap > 1? max_gap : 1;
+	w = w < max_gap? w : max_gap;
+	// allocate memory
+	n_col = qlen < 2*w+1? qlen : 2*w+1;
+	z = calloc(((size_t)n_col * tlen + 1) >> 1, 1); // NB: cells outside the adaptive band are zero, pointing to the diagonal
+	qp = malloc(qlen * m);
+	eh = calloc(qlen + 1, 8);
+	// generate the query profile
+	for (k = i = 0; k < m; ++k) {
+		const int8_t *p = &mat[k * m];
+		for (j = 0; j < qlen; ++j) qp[i++] = p[query[j]];
+	}
+	// fill the first row
+	eh[0].h = h0; eh[1].h = h0 > gapoe? h0 - gapoe : 0;
+	for (j = 2; j <= qlen && eh[j-1].h > gape; ++j)
+		eh[j].h = eh[j-1].h - gape;
+	// DP loop; identical to ksw_extend() except that the directions are recorded
+	max = h0, max_i = max_j = -1; max_ie = -1, gscore = -1;
+	max_off = 0;
+	beg = 0, end = qlen;
+	for (i = 0; LIKELY(i < tlen); ++i) {
+		int f = 0, h1, m = 0, mj = -1;
+		int8_t *q = &qp[target[i] * qlen];
+		size_t off = (size_t)i * n_col - (i > w? i - w : 0); // z[off+j] keeps cell (i,j)
+		h1 = h0 - (gapo + gape * (i + 1));
+		if (h1 < 0) h1 = 0;
+		if (beg < i - w) beg = i - w;
+		if (end > i + w + 1) end = i + w + 1;
+		if (end > qlen) end = qlen;
+		for (j = beg; LIKELY(j < end); ++j) {
+			eh_t *p = &eh[j];
+			int h = p->h, e = p->e, d;
+			size_t c = off + j;
+			p->h = h1;
+			h += q[j];
+			d = h >= e? 0 : 1;
+			h = h >= e? h : e;
+			d = h >= f? d : 2;
+			h = h >= f? h : f;
+			h1 = h;
+			mj = m > h? mj : j;
+			m = m > h? m : h;
+			h -= gapoe;
+			h = h > 0? h : 0;
+			e -= gape;
+			d |= e > h? 1<<2 : 0;
+			e = e > h? e : h;
+			p->e = e;
+			f -= gape;
+			d |= f > h? 1<<3 : 0;
+			f = f > h? f : h;
+			z[c>>1] |= d << ((c&1)<<2);
+		}
+		eh[end].h = h1; eh[end].e = 0;
+		if (j == qlen) {
+			max_ie = gscore > h1? max_ie : i;
+			gscore = gscore > h1? gscore : h1;
+		}
+		if (m == 0 || (zdrop > 0 && max - m - abs((i - max_i) - (j - max_j)) * gape > zdrop)) break;
+		if (m > max) {
+			max = m, max_i = i, max_j = mj;
+			max_off = max_off > abs(mj - i)? max_off : abs(mj - i);
+		}
+		for (j = mj; j >= beg && eh[j].h; --j);
+		beg = j + 1;
+		for (j = mj + 2; j <= end && eh[j].h; ++j);
+		end = j;
+	}
+	free(eh); free(qp);
+	if (_qle) *_qle = max_j + 1;
+	if (_tle) *_tle = max_i + 1;
+	if (_gtle) *_gtle = max_ie + 1;
+	if (_gscore) *_gscore = gscore;
+	if (_max_off) *_max_off = max_off;
+	*_w = w, *_z = z;
+	return max;
+}
+
+uint32_t *ksw_extend_cigar(int qlen, int w, const uint8_t *z, int i, int j, int *_n_cigar)
+{
+	int n_cigar = 0, m_cigar = 0, which = 0, n_col = qlen < 2*w+1? qlen : 2*w+1;
+	uint32_t *cigar = 0, tmp;
+	while (i >= 0 && j >= 0) { // which: 0 for H, 1 for E and 2 for F
+		int col = j - (i > w? i - w : 0), d = 0;
+		size_t c = (size_t)i * n_col + col;
+		if (col >= 0 && col < n_col) d = z[c>>1] >> ((c&1)<<2) & 0xf;
+		if (which == 0) which = d & 3; // where H(i,j) comes from
+		if (which == 0) {
+			cigar = push_cigar(&n_cigar, &m_cigar, cigar, 0, 1), --i, --j;
+		} else if (which == 1) { // E(i,j) is computed at cell (i-1,j)
+			cigar = push_cigar(&n_cigar, &m_cigar, cigar, 2, 1), --i;
+			col = j - (i > w? i - w : 0), c = (size_t)i * n_col + col;
+			which = i >= 0 && col >= 0 && col < n_col && (z[c>>1] >> ((c&1)<<2) & 4)? 1 : 0;
+		} else { // F(i,j) is computed at cell (i,j-1)
+			cigar = push_cigar(&n_cigar, &m_cigar, cigar, 1, 1), --j;
+			col = j - (i > w? i - w : 0), c = (size_t)i * n_col + col;
+			which = j >= 0 && col >= 0 && col < n_col && (z[c>>1] >> ((c&1)<<2) & 8)? 2 : 0;
+		}
+	}
+	if (i >= 0) cigar = push_cigar(&n_cigar, &m_cigar, cigar, 2, i + 1);
+	if (j >= 0) cigar = push_cigar(&n_cigar, &m_cigar, cigar, 1, j + 1);
+	for (i = 0; i < n_cigar>>1; ++i) // reverse CIGAR
+		tmp = cigar[i], cigar[i] = cigar[n_cigar-1-i], cigar[n_cigar-1-i] = tmp;
+	*_n_cigar = n_cigar;
+	return cigar;
+}
+
 /*******************************************
  * Main function (not compiled by default) *
  *******************************************/
@@ -18,6 +18,27 @@ typedef struct {
 	int tb, qb; // target start and query start
 } kswr_t;
 
+typedef struct { // checkpoint of ksw_extend2()
+	int set;      // whether the following fields have been set
+	int w;        // the actual band width used in the last call
+	int i;        // the first row where the band took effect; -1 if the band never took effect
+	int beg, end, max, max_i, max_j, max_ie, gscore, max_off; // DP states at the beginning of row $i
+	int score, qle, tle, gtle, gscore_, max_off_; // results of the last call
+	int m_eh;
+	void *eh;     // DP row at the beginning of row $i; to be freed with free()
+} ksw_extck_t;
+
+typedef struct { // one extension job for ksw_extend_batch()
+	int qlen, tlen;
+	const uint8_t *query, *target;
+	int w, end_bonus, h0;
+	ksw_extck_t *ck; // checkpoint passed to ksw_extend2(); can be NULL
+	int tb;          // if true, solve with ksw_extend_z() and keep the backtrack matrix; $ck is ignored
+	int score, qle, tle, gtle, gscore, max_off; // output; identical to those returned by ksw_extend()
+	int zw;          // (out) band width for ksw_extend_cigar() if $tb is set
+	uint8_t *z;      // (out) backtrack matrix if $tb is set; to be freed with free()
+} ksw_ext_t;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -104,6 +125,65 @@ extern "C" {
 	 */
 	int ksw_extend(int qlen, const uint8_t *query, int tlen, const uint8_t *target, int m, const int8_t *mat, int gapo, int gape, int w, int end_bonus, int zdrop, int h0, int *qle, int *tle, int *gtle, int *gscore, int *max_off);
 
+	/**
+	 * Extend alignment with a checkpoint to reuse when the band is widened
+	 *
+	 * ksw_extend2() is identical to ksw_extend() when $ck is NULL. Otherwise,
+	 * $ck should be zero-filled before the first call. ksw_extend2() saves
+	 * the DP state at the first row where the band $w excludes cells that
+	 * the adaptive band would otherwise compute. All rows above this one are
+	 * the same with any larger band. A subsequent call on the same sequences
+	 * and parameters, but with a larger $w, resumes from that row instead
+	 * of recomputing the whole matrix, and returns immediately if the band
+	 * never took effect. The results are identical to those of ksw_extend().
+	 * Free $ck->eh with free() when done.
+	 */
+	int ksw_extend2(int qlen, const uint8_t *query, int tlen, const uint8_t *target, int m, const int8_t *mat, int gapo, int gape, int w, int end_bonus, int zdrop, int h0, int *qle, int *tle, int *gtle, int *gscore, int *max_off, ksw_extck_t *ck);
+
+	/**
+	 * Extend alignment and keep the backtrack matrix
+	 *
+	 * ksw_extend_z() computes the same DP as ksw_extend() and additionally
+	 * records 4 bits of directions per cell in the band. The matrix takes
+	 * tlen*min(qlen,2*w+1)/2 bytes, where w is the band width after being
+	 * capped by the maximal gap length.
+	 *
+	 * @param _w      (out) actual band width; required by ksw_extend_cigar()
+	 * @param _z      (out) backtrack matrix; caller need to deallocate with free()
+	 */
+	int ksw_extend_z(int qlen, const uint8_t *query, int tlen, const uint8_t *target, int m, const int8_t *mat, int gapo, int gape, int w, int end_bonus, int zdrop, int h0, int *qle, int *tle, int *gtle, int *gscore, int *max_off, int *_w, uint8_t **_z);
+
+	/**
+	 * Generate CIGAR from the backtrack matrix of ksw_extend_z()
+	 *
+	 * @param qlen    query length passed to ksw_extend_z()
+	 * @param w       band width returned by ksw_extend_z()
+	 * @param z       backtrack matrix
+	 * @param i       end position on the target, e.g. *tle-1 or *gtle-1
+	 * @param j       end position on the query, e.g. *qle-1 or qlen-1
+	 * @param n_cigar (out) number of CIGAR elements
+	 *
+	 * @return        BAM-encoded CIGAR of [0,j] on the query and [0,i] on the
+	 *                target; NULL if both are empty
+	 */
+	uint32_t *ksw_extend_cigar(int qlen, int w, const uint8_t *z, int i, int j, int *n_cigar);
+
+	/**
+	 * Solve many independent extensions at once
+	 *
+	 * Each job is solved as if ksw_extend2() were called with the parameters
+	 * in the job and the shared $m, $mat, $gapo, $gape and $zdrop; results
+	 * are written back to the job. With SSE2, up to 8 jobs are computed in
+	 * parallel, one per 16-bit lane. Jobs that may overflow a 16-bit score,
+	 * jobs resuming from a checkpoint, or a scoring matrix that is not a
+	 * simple match/mismatch matrix, fall back to ksw_extend2(). Jobs with
+	 * $tb set get the same backtrack matrix as from ksw_extend_z().
+	 *
+	 * @param n       number of jobs
+	 * @param jobs    array of jobs
+	 */
+	void ksw_extend_batch(int n, ksw_ext_t *jobs, int m, const int8_t *mat, int gapo, int gape, int zdrop);
+
 #ifdef __cplusplus
 }
 #endif
@@ -51,3 +51,109 @@ void kt_for(int n_threads, void (*func)(void*,int,int), void *data, int n)
 	for (i = 0; i < n_threads; ++i) pthread_create(&tid[i], 0, ktf_worker, &t.w[i]);
 	for (i = 0; i < n_threads; ++i) pthread_join(tid[i], 0);
 }
+
+/*****************
+ * kt_for() pool *
+ *****************/
+
+struct kt_forpool_t;
+
+typedef struct {
+	struct kt_forpool_t *t;
+	int i, action; // action: 0 for waiting, 1 for working and -1 for exiting
+} kto_worker_t;
+
+typedef struct kt_forpool_t {
+	int n_threads, n_pending, n;
+	pthread_t *tid;
+	kto_worker_t *w;
+	void (*func)(void*,int,int);
+	void *data;
+	void (*init)(void*,int); // called by each thread with its tid when it starts
+	void *init_data;
+	pthread_mutex_t mutex;
+	pthread_cond_t cv_m, cv_s; // signal the master and the workers, respectively
+} kt_forpool_t;
+
+static inline int kt_fp_steal_work(kt_forpool_t *t)
+{
+	int i, k, min = 0x7fffffff, min_i = -1;
+	for (i = 0; i < t->n_threads; ++i)
+		if (min > t->w[i].i) min = t->w[i].i, min_i = i;
+	k = __sync_fetch_and_add(&t->w[min_i].i, t->n_threads);
+	return k >= t->n? -1 : k;
+}
+
+static void *kt_fp_worker(void *data)
+{
+	kto_worker_t *w = (kto_worker_t*)data;
+	kt_forpool_t *fp = w->t;
+	if (fp->init) fp->init(fp->init_data, w - fp->w);
+	for (;;) {
+		int i, action;
+		pthread_mutex_lock(&fp->mutex);
+		if (--fp->n_pending == 0)
+			pthread_cond_signal(&fp->cv_m);
+		if (w->action > 0) w->action = 0;
+		while (w->action == 0) pthread_cond_wait(&fp->cv_s, &fp->mutex);
+		action = w->action;
+		pthread_mutex_unlock(&fp->mutex);
+		if (action < 0) break;
+		for (;;) {
+			i = __sync_fetch_and_add(&w->i, fp->n_threads);
+			if (i >= fp->n) break;
+			fp->func(fp->data, i, w - fp->w);
+		}
+		while ((i = kt_fp_steal_work(fp)) >= 0)
+			fp->func(fp->data, i, w - fp->w);
+	}
+	pthread_exit(0);
+}
+
+void *kt_forpool_init(int n_threads, void (*init)(void*,int), void *init_data)
+{ // $init, if not NULL, is called in each thread with $init_data and the tid later passed to func()
+	kt_forpool_t *fp;
+	int i;
+	fp = (kt_forpool_t*)calloc(1, sizeof(kt_forpool_t));
+	fp->n_threads = fp->n_pending = n_threads > 1? n_threads : 1;
+	fp->init = init, fp->init_data = init_data;
+	fp->tid = (pthread_t*)calloc(fp->n_threads, sizeof(pthread_t));
+	fp->w = (kto_worker_t*)calloc(fp->n_threads, sizeof(kto_worker_t));
+	for (i = 0; i < fp->n_threads; ++i) fp->w[i].t = fp;
+	pthread_mutex_init(&fp->mutex, 0);
+	pthread_cond_init(&fp->cv_m, 0);
+	pthread_cond_init(&fp->cv_s, 0);
+	for (i = 0; i < fp->n_threads; ++i) pthread_create(&fp->tid[i], 0, kt_fp_worker, &fp->w[i]);
+	pthread_mutex_lock(&fp->mutex);
+	while (fp->n_pending) pthread_cond_wait(&fp->cv_m, &fp->mutex); // wait until all workers are idle
+	pthread_mutex_unlock(&fp->mutex);
+	return fp;
+}
+
+void kt_forpool_destroy(void *_fp)
+{
+	kt_forpool_t *fp = (kt_forpool_t*)_fp;
+	int i;
+	if (fp == 0) return;
+	pthread_mutex_lock(&fp->mutex);
+	for (i = 0; i < fp->n_threads; ++i) fp->w[i].action = -1;
+	pthread_cond_broadcast(&fp->cv_s);
+	pthread_mutex_unlock(&fp->mutex);
+	for (i = 0; i < fp->n_threads; ++i) pthread_join(fp->tid[i], 0);
+	pthread_cond_destroy(&fp->cv_s);
+	pthread_cond_destroy(&fp->cv_m);
+	pthread_mutex_destroy(&fp->mutex);
+	free(fp->w); free(fp->tid); free(fp);
+}
+
+void kt_forpool(void *_fp, void (*func)(void*,int,int), void *data, int n)
+{ // same as kt_for() with the threads in $_fp; calls must not overlap
+	kt_forpool_t *fp = (kt_forpool_t*)_fp;
+	int i;
+	pthread_mutex_lock(&fp->mutex);
+	fp->n = n, fp->func = func, fp->data = data, fp->n_pending = fp->n_threads;
+	for (i = 0; i < fp->n_threads; ++i) fp->w[i].i = i, fp->w[i].action = 1;
+	pthread_cond_broadcast(&fp->cv_s);
+	while (fp->n_pending) pthread_cond_wait(&fp->cv_m, &fp->mutex);
+	pthread_mutex_unlock(&fp->mutex);
+}
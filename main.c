@@ -11,6 +11,7 @@ int bwa_fa2pac(int argc, char *argv[]);
 int bwa_pac2bwt(int argc, char *argv[]);
 int bwa_bwtupdate(int argc, char *argv[]);
 int bwa_bwt2sa(int argc, char *argv[]);
+int bwa_mzindex(int argc, char *argv[]);
 int bwa_index(int argc, char *argv[]);
 int bwt_bwtgen_main(int argc, char *argv[]);
 
@@ -24,6 +25,8 @@ int main_fastmap(int argc, char *argv[]);
 int main_mem(int argc, char *argv[]);
 
 int main_pemerge(int argc, char *argv[]);
+int main_bwr2sam(int argc, char *argv[]);
+int main_memc(int argc, char *argv[]);
 	
 char *bwa_pg;
 
@@ -36,6 +39,7 @@ static int usage()
 	fprintf(stderr, "Usage:   bwa <command> [options]\n\n");
 	fprintf(stderr, "Command: index         index sequences in the FASTA format\n");
 	fprintf(stderr, "         mem           BWA-MEM algorithm\n");
+	fprintf(stderr, "         memc          send reads to a `bwa mem -X' server\n");
 	fprintf(stderr, "         fastmap       identify super-maximal exact matches\n");
 	fprintf(stderr, "         pemerge       merge overlapping paired ends (EXPERIMENTAL)\n");
 	fprintf(stderr, "         aln           gapped/ungapped alignment\n");
@@ -48,6 +52,8 @@ static int usage()
 	fprintf(stderr, "         pac2bwtgen    alternative algorithm for generating BWT\n");
 	fprintf(stderr, "         bwtupdate     update .bwt to the new format\n");
 	fprintf(stderr, "         bwt2sa        generate SA from BWT and Occ\n");
+	fprintf(stderr, "         mzindex       add the minimizer index for `bwa mem -z' to an index\n");
+	fprintf(stderr, "         bwr2sam       convert the BWR output of `bwa mem -f bwr' to SAM\n");
 	fprintf(stderr, "\n");
 	fprintf(stderr,
 "Note: To use BWA, you need to first index the genome with `bwa index'.\n"
@@ -72,6 +78,7 @@ int main(int argc, char *argv[])
 	else if (strcmp(argv[1], "pac2bwtgen") == 0) ret = bwt_bwtgen_main(argc-1, argv+1);
 	else if (strcmp(argv[1], "bwtupdate") == 0) ret = bwa_bwtupdate(argc-1, argv+1);
 	else if (strcmp(argv[1], "bwt2sa") == 0) ret = bwa_bwt2sa(argc-1, argv+1);
+	else if (strcmp(argv[1], "mzindex") == 0) ret = bwa_mzindex(argc-1, argv+1);
 	else if (strcmp(argv[1], "index") == 0) ret = bwa_index(argc-1, argv+1);
 	else if (strcmp(argv[1], "aln") == 0) ret = bwa_aln(argc-1, argv+1);
 	else if (strcmp(argv[1], "samse") == 0) ret = bwa_sai2sam_se(argc-1, argv+1);
@@ -82,6 +89,8 @@ int main(int argc, char *argv[])
 	else if (strcmp(argv[1], "fastmap") == 0) ret = main_fastmap(argc-1, argv+1);
 	else if (strcmp(argv[1], "mem") == 0) ret = main_mem(argc-1, argv+1);
 	else if (strcmp(argv[1], "pemerge") == 0) ret = main_pemerge(argc-1, argv+1);
+	else if (strcmp(argv[1], "bwr2sam") == 0) ret = main_bwr2sam(argc-1, argv+1);
+	else if (strcmp(argv[1], "memc") == 0) ret = main_memc(argc-1, argv+1);
 	else {
 		fprintf(stderr, "[main] unrecognized command '%s'\n", argv[1]);
 		return 1;
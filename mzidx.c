@@ -0,0 +1,169 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+#include "mzidx.h"
+#include "kvec.h"
+
+#ifdef USE_MALLOC_WRAPPERS
+#  include "malloc_wrap.h"
+#endif
+
+/* Minimizer index
+ *
+ * A (w,k)-minimizer is the k-mer with the smallest hash among w consecutive
+ * k-mers. Strands are merged by hashing the canonical k-mer. The index
+ * keeps the minimizers of all reference sequences, packed into one 64-bit
+ * integer each and sorted, such that the hits of a minimizer are found by
+ * a binary search. With k<=15, the hash takes 30 bits and the position 33
+ * bits, enough for 8 Gbp.
+ */
+
+static inline uint64_t mz_hash64(uint64_t key, uint64_t mask) // invertible within the mask
+{
+	key = (~key + (key << 21)) & mask;
+	key = key ^ key >> 24;
+	key = ((key + (key << 3)) + (key << 8)) & mask;
+	key = key ^ key >> 14;
+	key = ((key + (key << 2)) + (key << 4)) & mask;
+	key = key ^ key >> 28;
+	key = (key + (key << 31)) & mask;
+	return key;
+}
+
+void mz_sketch(int k, int w, int64_t len, const uint8_t *seq, pair64_v *p)
+{
+	uint64_t shift1 = 2 * (k - 1), mask = (1ULL<<2*k) - 1, kmer[2] = {0,0};
+	int64_t i;
+	int j, l, buf_pos, min_pos;
+	pair64_t buf[256], min = { UINT64_MAX, UINT64_MAX };
+
+	assert(w > 0 && w < 256 && k > 0 && k <= 28);
+	memset(buf, 0xff, w * sizeof(pair64_t));
+	for (i = l = buf_pos = min_pos = 0; i < len; ++i) {
+		int c = seq[i];
+		pair64_t info = { UINT64_MAX, UINT64_MAX };
+		if (c < 4) { // not an ambiguous base
+			int z;
+			kmer[0] = (kmer[0] << 2 | c) & mask;           // forward k-mer
+			kmer[1] = (kmer[1] >> 2) | (3ULL^c) << shift1; // reverse k-mer
+			if (kmer[0] == kmer[1]) continue; // skip "symmetric k-mers" as we don't know their strand
+			z = kmer[0] < kmer[1]? 0 : 1; // strand
+			++l;
+			if (l >= k) info.x = mz_hash64(kmer[z], mask), info.y = (uint64_t)i<<1 | z;
+		} else l = 0;
+		buf[buf_pos] = info; // need to do this here as appropriate buf_pos and buf[buf_pos] are needed below
+		if (l == w + k - 1) { // special case for the first window - because identical k-mers are not stored yet
+			for (j = buf_pos + 1; j < w; ++j)
+				if (min.x == buf[j].x && buf[j].y != min.y) kv_push(pair64_t, *p, buf[j]);
+			for (j = 0; j < buf_pos; ++j)
+				if (min.x == buf[j].x && buf[j].y != min.y) kv_push(pair64_t, *p, buf[j]);
+		}
+		if (info.x <= min.x) { // a new minimum; then write the old min
+			if (l >= w + k && min.x != UINT64_MAX) kv_push(pair64_t, *p, min);
+			min = info, min_pos = buf_pos;
+		} else if (buf_pos == min_pos) { // old min has moved outside the window
+			if (l >= w + k - 1 && min.x != UINT64_MAX) kv_push(pair64_t, *p, min);
+			for (j = buf_pos + 1, min.x = UINT64_MAX; j < w; ++j) // the two loops are necessary when there are identical k-mers
+				if (min.x >= buf[j].x) min = buf[j], min_pos = j; // >= is important s.t. min is always the closest k-mer
+			for (j = 0; j <= buf_pos; ++j)
+				if (min.x >= buf[j].x) min = buf[j], min_pos = j;
+			if (l >= w + k - 1 && min.x != UINT64_MAX) { // write identical k-mers
+				for (j = buf_pos + 1; j < w; ++j) // these two loops make sure the output is sorted
+					if (min.x == buf[j].x && min.y != buf[j].y) kv_push(pair64_t, *p, buf[j]);
+				for (j = 0; j <= buf_pos; ++j)
+					if (min.x == buf[j].x && min.y != buf[j].y) kv_push(pair64_t, *p, buf[j]);
+			}
+		}
+		if (++buf_pos == w) buf_pos = 0;
+	}
+	if (min.x != UINT64_MAX) kv_push(pair64_t, *p, min);
+}
+
+mzidx_t *mz_build(const bntseq_t *bns, const uint8_t *pac, int k, int w)
+{
+	mzidx_t *mz;
+	pair64_v p = {0,0,0};
+	uint64_v a = {0,0,0};
+	uint8_t *seq = 0;
+	int64_t max_len = 0, j;
+	int i;
+
+	assert(k > 0 && k <= 15 && bns->l_pac < 1LL<<33);
+	for (i = 0; i < bns->n_seqs; ++i)
+		max_len = max_len > bns->anns[i].len? max_len : bns->anns[i].len;
+	seq = malloc(max_len);
+	for (i = 0; i < bns->n_seqs; ++i) { // sketch each sequence separately, such that no k-mer spans two sequences
+		const bntann1_t *q = &bns->anns[i];
+		bns_unpack(pac, q->offset, q->offset + q->len, 0, seq);
+		p.n = 0;
+		mz_sketch(k, w, q->len, seq, &p);
+		for (j = 0; j < p.n; ++j)
+			kv_push(uint64_t, a, p.a[j].x<<34 | (uint64_t)(q->offset + (p.a[j].y>>1))<<1 | (p.a[j].y&1));
+	}
+	free(seq); free(p.a);
+	ks_introsort_64(a.n, a.a);
+	mz = calloc(1, sizeof(mzidx_t));
+	mz->k = k, mz->w = w, mz->n = a.n, mz->a = a.a;
+	return mz;
+}
+
+void mz_dump(const char *fn, const mzidx_t *mz)
+{
+	FILE *fp;
+	int32_t x[2];
+	fp = xopen(fn, "wb");
+	x[0] = mz->k, x[1] = mz->w;
+	err_fwrite("MZI\1", 1, 4, fp);
+	err_fwrite(x, 4, 2, fp);
+	err_fwrite(&mz->n, 8, 1, fp);
+	err_fwrite(mz->a, 8, mz->n, fp);
+	err_fflush(fp);
+	err_fclose(fp);
+}
+
+mzidx_t *mz_restore(const char *fn)
+{
+	FILE *fp;
+	char magic[4];
+	int32_t x[2];
+	mzidx_t *mz;
+	if ((fp = fopen(fn, "rb")) == 0) {
+		fprintf(stderr, "[E::%s] fail to open '%s'; build it with `bwa mzindex' first\n", __func__, fn);
+		return 0;
+	}
+	err_fread_noeof(magic, 1, 4, fp);
+	if (strncmp(magic, "MZI\1", 4) != 0) {
+		fprintf(stderr, "[E::%s] invalid minimizer index '%s'\n", __func__, fn);
+		err_fclose(fp);
+		return 0;
+	}
+	mz = calloc(1, sizeof(mzidx_t));
+	err_fread_noeof(x, 4, 2, fp);
+	mz->k = x[0], mz->w = x[1];
+	err_fread_noeof(&mz->n, 8, 1, fp);
+	mz->a = malloc(mz->n * 8);
+	err_fread_noeof(mz->a, 8, mz->n, fp);
+	err_fclose(fp);
+	return mz;
+}
+
+void mz_destroy(mzidx_t *mz)
+{
+	if (mz == 0) return;
+	free(mz->a); free(mz);
+}
+
+const uint64_t *mz_get(const mzidx_t *mz, uint64_t hash, int64_t *n)
+{
+	int64_t lo = 0, hi = mz->n, b;
+	uint64_t x = hash << 34;
+	while (lo < hi) { // the first entry not smaller than x
+		int64_t mid = (lo + hi) >> 1;
+		if (mz->a[mid] < x) lo = mid + 1;
+		else hi = mid;
+	}
+	for (b = lo; hi < mz->n && mz->a[hi]>>34 == hash; ++hi);
+	*n = hi - b;
+	return &mz->a[b];
+}
@@ -0,0 +1,52 @@
+#ifndef BWA_MZIDX_H
+#define BWA_MZIDX_H
+
+#include <stdint.h>
+#include "bntseq.h"
+#include "utils.h"
+
+#define MZ_DEF_K 15
+#define MZ_DEF_W 10
+
+typedef struct {
+	int k, w;      // k-mer size and window size; k <= 15
+	int64_t n;     // number of minimizers
+	uint64_t *a;   // hash<<34 | pos<<1 | strand, where pos is the end of the k-mer on the forward strand; sorted
+} mzidx_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+	/**
+	 * Compute the (w,k)-minimizers of a 2-bit encoded sequence
+	 *
+	 * Bases larger than 3 are ambiguous and not included in any k-mer. For
+	 * each minimizer, .x is the hash of the canonical k-mer and .y is
+	 * pos<<1|strand, where pos is the end of the k-mer and strand is 1 if
+	 * the canonical k-mer is the reverse complement. Minimizers are
+	 * appended to $p.
+	 */
+	void mz_sketch(int k, int w, int64_t len, const uint8_t *seq, pair64_v *p);
+
+	mzidx_t *mz_build(const bntseq_t *bns, const uint8_t *pac, int k, int w);
+	void mz_dump(const char *fn, const mzidx_t *mz);
+	mzidx_t *mz_restore(const char *fn);
+	void mz_destroy(mzidx_t *mz);
+
+	/**
+	 * Find the reference positions of a minimizer
+	 *
+	 * @return  pointer to the first entry; the number of entries is written
+	 *          to *n. Use mz_pos() and mz_strand() to decode an entry.
+	 */
+	const uint64_t *mz_get(const mzidx_t *mz, uint64_t hash, int64_t *n);
+
+#ifdef __cplusplus
+}
+#endif
+
+#define mz_pos(x)    ((int64_t)((x)>>1 & 0x1ffffffffULL))
+#define mz_strand(x) ((int)((x)&1))
+
+#endif
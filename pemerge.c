@@ -10,6 +10,7 @@
 #include "kstring.h"
 #include "bwa.h"
 #include "utils.h"
+#include "bgzfr.h"
 KSEQ_DECLARE(gzFile)
 
 #ifdef USE_MALLOC_WRAPPERS
@@ -134,9 +135,7 @@ int bwa_pemerge(const pem_opt_t *opt, bseq1_t x[2])
 	for (i = 0; i < l_seq; ++i) seq[i] = "ACGTN"[(int)seq[i]], qual[i] += 33;
 	seq[l_seq] = qual[l_seq] = 0;
 
-	free(x[1].name); free(x[1].seq); free(x[1].qual); free(x[1].comment);
-	memset(&x[1], 0, sizeof(bseq1_t));
-	free(x[0].seq); free(x[0].qual);
+	memset(&x[1], 0, sizeof(bseq1_t)); // x[1].name==0 marks a merged pair
 	x[0].l_seq = l_seq; x[0].seq = (char*)seq; x[0].qual = (char*)qual;
 
 pem_ret:
@@ -208,10 +207,10 @@ static void process_seqs(const pem_opt_t *opt, int n_, bseq1_t *seqs, int64_t cn
 		} else if (opt->flag&1)
 			print_bseq(&seqs[i<<1|0], 0);
 	}
-	for (i = 0; i < n; ++i) {
-		bseq1_t *s = &seqs[i];
-		free(s->name); free(s->seq); free(s->qual); free(s->comment);
-	}
+	for (i = 0; i < n>>1; ++i)
+		if (seqs[i<<1|1].name == 0) { // merged; not allocated by bseq_read()
+			free(seqs[i<<1].seq); free(seqs[i<<1].qual);
+		}
 }
 
 int main_pemerge(int argc, char *argv[])
@@ -249,22 +248,10 @@ int main_pemerge(int argc, char *argv[])
 		return 1;
 	}
 
-	fp = strcmp(argv[optind], "-")? gzopen(argv[optind], "r") : gzdopen(fileno(stdin), "r");
-	if (NULL == fp) {
-		fprintf(stderr, "Couldn't open %s : %s\n",
-				strcmp(argv[optind], "-") ? argv[optind] : "stdin",
-				errno ? strerror(errno) : "Out of memory");
-		exit(EXIT_FAILURE);
-	}
+	fp = bgzfr_open(argv[optind], opt->n_threads);
 	ks = kseq_init(fp);
 	if (optind + 1 < argc) {
-		fp2 = strcmp(argv[optind+1], "-")? gzopen(argv[optind+1], "r") : gzdopen(fileno(stdin), "r");
-		if (NULL == fp) {
-			fprintf(stderr, "Couldn't open %s : %s\n",
-					strcmp(argv[optind+1], "-") ? argv[optind+1] : "stdin",
-					errno ? strerror(errno) : "Out of memory");
-			exit(EXIT_FAILURE);
-		}
+		fp2 = bgzfr_open(argv[optind+1], opt->n_threads);
 		ks2 = kseq_init(fp2);
 	}
 
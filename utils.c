@@ -46,6 +46,7 @@
 KSORT_INIT(128, pair64_t, pair64_lt)
 KSORT_INIT(64,  uint64_t, ks_lt_generic)
 
+#define KSEQ_BUFSIZE 0x40000
 #include "kseq.h"
 KSEQ_INIT2(, gzFile, err_gzread)
 